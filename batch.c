@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "batch.h"
+
+/* the jobs a worker has yet to do: [lo, hi). the owner takes from the
+   front, thieves split off the back half. */
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	size_t lo, hi;
+	struct batch *b;
+	unsigned id;
+	int started;
+};
+
+struct batch {
+	struct cpp_batch_job *jobs;
+	struct worker *workers;
+	unsigned nworkers;
+	cpp_batch_setup setup;
+	void *ctx;
+};
+
+static int take(struct worker *w, size_t *job) {
+	int ret = 0;
+	pthread_mutex_lock(&w->lock);
+	if(w->lo < w->hi) {
+		*job = w->lo++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+/* move half of the jobs another worker has left to w */
+static int steal(struct worker *w) {
+	struct batch *b = w->b;
+	unsigned i;
+	size_t lo, hi;
+	for(i = 1; i < b->nworkers; i++) {
+		struct worker *v = &b->workers[(w->id + i) % b->nworkers];
+		pthread_mutex_lock(&v->lock);
+		hi = v->hi;
+		lo = v->lo + (v->hi - v->lo) / 2;
+		v->hi = lo;
+		pthread_mutex_unlock(&v->lock);
+		if(lo == hi) continue;
+		pthread_mutex_lock(&w->lock);
+		w->lo = lo;
+		w->hi = hi;
+		pthread_mutex_unlock(&w->lock);
+		return 1;
+	}
+	return 0;
+}
+
+static int run_job(struct batch *b, struct cpp_batch_job *job) {
+	struct cpp_sink out;
+	struct cpp *cpp;
+	FILE *in;
+	int fd, ret = 0;
+	if(!(in = fopen(job->in, "r"))) {
+		perror(job->in);
+		return 0;
+	}
+	if((fd = open(job->out, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+		perror(job->out);
+		fclose(in);
+		return 0;
+	}
+	if((cpp = b->setup(b->ctx))) {
+		cpp_sink_init_fd(&out, fd);
+		ret = cpp_run_sink(cpp, in, &out, job->in);
+		ret = cpp_sink_fini(&out) && ret;
+		job->stats = *cpp_get_stats(cpp);
+		cpp_destroy(cpp);
+	}
+	if(close(fd)) ret = 0;
+	fclose(in);
+	if(!ret) unlink(job->out);
+	return ret;
+}
+
+static void *work(void *arg) {
+	struct worker *w = arg;
+	size_t job;
+	while(take(w, &job) || (steal(w) && take(w, &job)))
+		w->b->jobs[job].ok = run_job(w->b, &w->b->jobs[job]);
+	return 0;
+}
+
+size_t cpp_run_batch(struct cpp_batch_job *jobs, size_t count, unsigned nthreads, cpp_batch_setup setup, void *ctx) {
+	struct batch b = {.jobs = jobs, .setup = setup, .ctx = ctx};
+	size_t i, failed = 0;
+	unsigned n;
+	long cpus;
+	for(i = 0; i < count; i++) jobs[i].ok = 0;
+	if(!nthreads) nthreads = (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? cpus : 1;
+	if(nthreads > count) nthreads = count ? count : 1;
+	if(!(b.workers = calloc(nthreads, sizeof *b.workers))) return count;
+	b.nworkers = nthreads;
+	for(n = 0; n < nthreads; n++) {
+		struct worker *w = &b.workers[n];
+		pthread_mutex_init(&w->lock, 0);
+		w->lo = count * n / nthreads;
+		w->hi = count * (n + 1) / nthreads;
+		w->b = &b;
+		w->id = n;
+	}
+	/* worker 0 is the calling thread. if a thread can't be started,
+	   its jobs are stolen by the others. */
+	for(n = 1; n < nthreads; n++)
+		b.workers[n].started = !pthread_create(&b.workers[n].thread, 0, work, &b.workers[n]);
+	work(&b.workers[0]);
+	for(n = 1; n < nthreads; n++)
+		if(b.workers[n].started) pthread_join(b.workers[n].thread, 0);
+	for(n = 0; n < nthreads; n++) pthread_mutex_destroy(&b.workers[n].lock);
+	free(b.workers);
+	for(i = 0; i < count; i++) failed += !jobs[i].ok;
+	return failed;
+}
@@ -0,0 +1,38 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include "preproc.h"
+
+/* preprocessing many files in one process. every input is processed
+   with a struct cpp of its own, so macros don't carry over from one to
+   the next, while header contents and derived data are shared through
+   the process-wide file cache. include lookups aren't shared, each
+   instance resolves the names it meets and stat()s them itself. */
+
+struct cpp_batch_job {
+	const char *in;
+	const char *out; /* created or truncated; removed if the run fails.
+	                    no two jobs may have the same. */
+	int ok; /* set by cpp_run_batch() */
+	struct cpp_stats stats; /* of the run, if it started */
+};
+
+/* returns a struct cpp configured for one input, or 0 on failure.
+   called on the worker threads, concurrently. */
+typedef struct cpp *(*cpp_batch_setup)(void *ctx);
+
+/* process count jobs on nthreads threads, 0 for one per CPU. each
+   thread starts with an equal share of the jobs, threads that run out
+   take half of what another one has left. diagnostics of concurrent
+   jobs go to stderr as they occur, unless setup gives the instances a
+   callback with cpp_set_diag(). returns the number of jobs that
+   failed. */
+size_t cpp_run_batch(struct cpp_batch_job *jobs, size_t count, unsigned nthreads, cpp_batch_setup setup, void *ctx);
+
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"
+#endif
+#pragma RcB2 DEP "batch.c"
+
+#endif
@@ -1,40 +1,310 @@
 #include "preproc.h"
+#include "filecache.h"
+#include "tokstream.h"
+#include "batch.h"
+#include "pipeline.h"
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 static int usage(char *a0) {
 	fprintf(stderr,
 			"example preprocessor\n"
-			"usage: %s [-I includedir...] [-D define] file\n"
+			"usage: %s [-I includedir...] [-D define] [-p profile] [-P prelude...] [-S snapshot] [-T tokencache] [-L threads] [-x threads] [-b] [-c] [-m] [-t] [-l] [-s] file\n"
+			"       %s [options] [-j threads] -o outdir file...\n"
 			"if no filename or '-' is passed, stdin is used.\n"
-			, a0);
+			"-o preprocesses all files, writing the output for dir/name.c to\n"
+			"   outdir/dir/name.i. -j sets the number of threads, 0 for one per CPU.\n"
+			"-p predefines the macros of one of the built-in profiles.\n"
+			"-P processes a header before file, discarding its output.\n"
+			"-S saves the macro state after the preludes to snapshot, and\n"
+			"   on later runs loads it instead, as long as it is up to date.\n"
+			"-T keeps the tokens of headers in the directory tokencache.\n"
+			"-L lexes files of 1 MiB and more ahead on that many more threads.\n"
+			"-x processes parts of a file of 1 MiB and more, and runs of\n"
+			"   #include lines, speculatively on that many more threads.\n"
+			"-b writes a binary token stream (see tokstream.h) instead of text.\n"
+			"-c collapses whitespace and blank lines.\n"
+			"-m like -c, also drops blank lines and writes #line markers instead.\n"
+			"-t writes on a thread of its own, and reads on one or, for a regular\n"
+			"   file of 1 MiB and more, lexes ahead on one. for pipes, only reading\n"
+			"   and writing overlap with preprocessing.\n"
+			"-l reads the include dirs' listings up front.\n"
+			"-s prints statistics to stderr.\n"
+			, a0, a0);
 	return 1;
 }
 
+static int set_profile(struct cpp *cpp, const char *name) {
+	int i;
+	for(i = 0; cpp_profiles[i]; i++)
+		if(!strcmp(cpp_profiles[i]->name, name)) {
+			cpp_set_profile(cpp, cpp_profiles[i]);
+			return 1;
+		}
+	fprintf(stderr, "unknown profile %s, available:", name);
+	for(i = 0; cpp_profiles[i]; i++)
+		fprintf(stderr, " %s", cpp_profiles[i]->name);
+	fputc('\n', stderr);
+	return 0;
+}
+
+static void print_stats(const struct cpp_stats *st) {
+	struct filecache_stats fc;
+	filecache_get_stats(&fc);
+	fprintf(stderr,
+		"includes: %lu\n"
+		"skipped by include guard: %lu\n"
+		"skipped by #pragma once: %lu\n"
+		"lookup cache hits: %lu\n"
+		"stat calls: %lu\n"
+		"file cache hits/misses/evictions: %lu/%lu/%lu\n"
+		"file cache size: %zu files, %zu bytes\n"
+		"token cache hits/writes: %lu/%lu, tokens replayed: %lu\n"
+		"inactive blocks skipped by directive index: %lu\n"
+		"#if results reused: %lu\n"
+		"#elif ladders resolved by lookup: %lu\n"
+		"files lexed in parallel: %lu\n"
+		"chunks processed speculatively/again: %lu/%lu\n"
+		"runs of #include lines processed as chunks: %lu\n"
+		, st->includes, st->guard_skips, st->once_skips,
+		st->resolve_hits, st->stat_calls,
+		fc.hits, fc.misses, fc.evictions, fc.entries, fc.bytes,
+		st->token_cache_hits, st->token_cache_writes, st->tokens_replayed,
+		st->skeleton_skips, st->condition_cache_hits, st->ladder_jumps,
+		st->prelexed, st->spec_chunks, st->spec_reruns, st->include_runs);
+}
+
+static int discard(void *ctx, const char *data, size_t len) {
+	(void) ctx; (void) data; (void) len;
+	return 1;
+}
+
+static int run_prelude(struct cpp *cpp, const char *fn) {
+	FILE *in = fopen(fn, "r");
+	struct cpp_sink out;
+	int ret = 0;
+	cpp_sink_init(&out, discard, 0);
+	if(!in) perror("fopen");
+	else ret = cpp_run_sink(cpp, in, &out, fn);
+	if(in) fclose(in);
+	cpp_sink_fini(&out);
+	return ret;
+}
+
+/* the options that configure a struct cpp. in batch mode, every input
+   gets a struct cpp of its own, set up the same way. */
+struct config {
+	struct { int c; char *arg; } *opts; /* -I, -D, -p and -T, in order */
+	int nopts;
+	char **preludes;
+	int npreludes;
+	char *snapshot;
+	int save; /* write the snapshot if it can't be loaded */
+	int flags, compact;
+	unsigned lex_threads, spec_threads;
+};
+
+static struct cpp *configure(void *ctx) {
+	struct config *cfg = ctx;
+	struct cpp *cpp = cpp_new();
+	int i;
+	if(!cpp) return 0;
+	for(i = 0; i < cfg->nopts; i++) {
+		char *arg = cfg->opts[i].arg;
+		switch(cfg->opts[i].c) {
+		case 'I': cpp_add_includedir(cpp, arg); break;
+		case 'D': cpp_add_define(cpp, arg); break;
+		case 'p': if(!set_profile(cpp, arg)) goto fail; break;
+		case 'T': cpp_set_token_cache(cpp, arg); break;
+		}
+	}
+	cpp_set_flags(cpp, cfg->flags);
+	cpp_set_lex_threads(cpp, cfg->lex_threads);
+	cpp_set_spec_threads(cpp, cfg->spec_threads);
+	if(!cfg->snapshot || !cpp_load_snapshot(cpp, cfg->snapshot)) {
+		for(i = 0; i < cfg->npreludes; i++)
+			if(!run_prelude(cpp, cfg->preludes[i])) goto fail;
+		if(cfg->snapshot && cfg->save && !cpp_save_snapshot(cpp, cfg->snapshot))
+			perror(cfg->snapshot);
+	}
+	/* the output of preludes is discarded anyway */
+	cpp_set_flags(cpp, cfg->flags | cfg->compact);
+	return cpp;
+fail:
+	cpp_destroy(cpp);
+	return 0;
+}
+
+/* outdir/in with the extension replaced by .i. leading slashes are
+   dropped and .. components become __, so it stays inside outdir.
+   the directories are created. */
+static char *out_path(const char *outdir, const char *in) {
+	size_t len = strlen(outdir);
+	char *buf = malloc(len + strlen(in) + 4), *p, *dot;
+	if(!buf) return 0;
+	memcpy(buf, outdir, len);
+	p = buf + len;
+	while(*in) {
+		while(*in == '/') in++;
+		if(!strncmp(in, "./", 2)) in += 2;
+		else if(!strncmp(in, "../", 3) || !strcmp(in, "..")) {
+			p = stpcpy(p, "/__");
+			in += 2;
+		} else if(*in) {
+			*p++ = '/';
+			while(*in && *in != '/') *p++ = *in++;
+		}
+	}
+	*p = 0;
+	if((dot = strrchr(buf, '.')) && dot > strrchr(buf, '/')) *dot = 0;
+	strcat(buf, ".i");
+	for(p = buf + 1; (p = strchr(p, '/')); p++) {
+		*p = 0;
+		mkdir(buf, 0777);
+		*p = '/';
+	}
+	return buf;
+}
+
+static int cmp_out(const void *a, const void *b) {
+	return strcmp((*(struct cpp_batch_job* const*) a)->out, (*(struct cpp_batch_job* const*) b)->out);
+}
+
+/* concurrent jobs mustn't write the same file, as for a/x.c and a/x.h */
+static int check_outputs(struct cpp_batch_job *jobs, size_t n) {
+	struct cpp_batch_job **sorted = malloc(n * sizeof *sorted);
+	size_t i;
+	int ret = 1;
+	if(!sorted) return 0;
+	for(i = 0; i < n; i++) sorted[i] = &jobs[i];
+	qsort(sorted, n, sizeof *sorted, cmp_out);
+	for(i = 1; i < n; i++)
+		if(!strcmp(sorted[i-1]->out, sorted[i]->out)) {
+			fprintf(stderr, "%s and %s would both be written to %s\n",
+				sorted[i-1]->in, sorted[i]->in, sorted[i]->out);
+			ret = 0;
+		}
+	free(sorted);
+	return ret;
+}
+
+static int run_batch(struct config *cfg, char **files, size_t nfiles, const char *outdir, unsigned nthreads, int stats) {
+	struct cpp_batch_job *jobs = calloc(nfiles, sizeof *jobs);
+	struct cpp_stats total = {0};
+	struct cpp *cpp;
+	size_t i, failed = 1;
+	if(!jobs) return 0;
+	for(i = 0; i < nfiles; i++) {
+		jobs[i].in = files[i];
+		if(!(jobs[i].out = out_path(outdir, files[i]))) goto out;
+	}
+	if(!check_outputs(jobs, nfiles)) goto out;
+	/* check the options and write the snapshot once, up front */
+	cfg->save = 1;
+	if(!(cpp = configure(cfg))) goto out;
+	cpp_destroy(cpp);
+	cfg->save = 0;
+	failed = cpp_run_batch(jobs, nfiles, nthreads, configure, cfg);
+	if(stats) {
+		for(i = 0; i < nfiles; i++) cpp_stats_add(&total, &jobs[i].stats);
+		print_stats(&total);
+	}
+out:
+	for(i = 0; i < nfiles; i++) free((char*) jobs[i].out);
+	free(jobs);
+	return !failed;
+}
+
+/* the main file is only lexed or processed in parallel from memory */
+static int run_mapped(struct cpp *cpp, FILE *in, struct cpp_sink *out, const char *fn) {
+	struct stat st;
+	void *map;
+	int ret;
+	if(fstat(fileno(in), &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+	   (map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0)) == MAP_FAILED)
+		return cpp_run_sink(cpp, in, out, fn);
+	ret = cpp_run_buffer(cpp, map, st.st_size, out, fn);
+	munmap(map, st.st_size);
+	return ret;
+}
+
 int main(int argc, char** argv) {
-	int c; char* tmp;
-	struct cpp* cpp = cpp_new();
-	while ((c = getopt(argc, argv, "D:I:")) != EOF) switch(c) {
-	case 'I': cpp_add_includedir(cpp, optarg); break;
+	int c, ret = 0, stats = 0, binary = 0, pipelined = 0; char* tmp, *outdir = 0;
+	unsigned nthreads = 1;
+	struct cpp *cpp = 0;
+	char *fn = "stdin";
+	FILE *in = stdin;
+	struct config cfg = {
+		.opts = calloc(argc, sizeof *cfg.opts),
+		.preludes = calloc(argc, sizeof(char*)),
+	};
+	if(!cfg.opts || !cfg.preludes) {
+		perror("calloc");
+		goto done;
+	}
+	while ((c = getopt(argc, argv, "bcD:I:j:lL:mo:p:P:S:sT:tx:")) != EOF) switch(c) {
 	case 'D':
 		if((tmp = strchr(optarg, '='))) *tmp = ' ';
-		cpp_add_define(cpp, optarg);
+		/* fall through */
+	case 'I': case 'p': case 'T':
+		cfg.opts[cfg.nopts].c = c;
+		cfg.opts[cfg.nopts++].arg = optarg;
 		break;
-	default: return usage(argv[0]);
+	case 'P': cfg.preludes[cfg.npreludes++] = optarg; break;
+	case 'S': cfg.snapshot = optarg; break;
+	case 'b': binary = 1; break;
+	case 'c': cfg.compact |= CPP_FLAG_COMPACT; break;
+	case 'm': cfg.compact |= CPP_FLAG_COMPACT | CPP_FLAG_LINE_MARKERS; break;
+	case 'j': nthreads = atoi(optarg); break;
+	case 'l': cfg.flags |= CPP_FLAG_LIST_DIRS; break;
+	case 'L': cfg.lex_threads = atoi(optarg); break;
+	case 'o': outdir = optarg; break;
+	case 's': stats = 1; break;
+	case 't': pipelined = 1; break;
+	case 'x': cfg.spec_threads = atoi(optarg); break;
+	default: goto bad_usage;
 	}
-	char *fn = "stdin";
-	FILE *in = stdin;
+	if(outdir) {
+		if(binary || pipelined || optind == argc) goto bad_usage;
+		ret = run_batch(&cfg, argv + optind, argc - optind, outdir, nthreads, stats);
+		goto done;
+	}
+	if(argc - optind > 1 || nthreads != 1) goto bad_usage;
+	if(pipelined && (binary || cfg.compact)) goto bad_usage;
+	cfg.save = 1;
+	if(!(cpp = configure(&cfg))) goto done;
 	if(argv[optind] && strcmp(argv[optind], "-")) {
 		fn = argv[optind];
-		in = fopen(fn, "r");
-		if(!in) {
+		if(!(in = fopen(fn, "r"))) {
 			perror("fopen");
-			return 1;
+			goto done;
 		}
 	}
-	int ret = cpp_run(cpp, in, stdout, fn);
-	cpp_free(cpp);
-	if(in != stdin) fclose(in);
+	/* the lexing stage of -t, which only mapped files have */
+	struct stat st;
+	if(pipelined && !cfg.lex_threads && !fstat(fileno(in), &st) && S_ISREG(st.st_mode))
+		cpp_set_lex_threads(cpp, 1);
+	struct cpp_sink out;
+	cpp_sink_init_fd(&out, 1);
+	if(binary) {
+		struct tokstream_writer *w = tokstream_writer_new(&out);
+		ret = w && cpp_run_tokens(cpp, in, tokstream_write, w, fn);
+		ret = w && tokstream_writer_finish(w) && ret;
+	} else if(pipelined) ret = cpp_run_pipelined(cpp, fileno(in), 1, fn);
+	else if(cfg.lex_threads || cfg.spec_threads) ret = run_mapped(cpp, in, &out, fn);
+	else ret = cpp_run_sink(cpp, in, &out, fn);
+	cpp_sink_fini(&out);
+	if(stats) print_stats(cpp_get_stats(cpp));
+	goto done;
+bad_usage:
+	usage(argv[0]);
+done:
+	if(cpp) cpp_destroy(cpp);
+	if(in && in != stdin) fclose(in);
+	free(cfg.opts);
+	free(cfg.preludes);
 	return !ret;
 }
-
@@ -0,0 +1,263 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "filecache.h"
+#include "hbmap.h"
+
+#define FILECACHE_DEFAULT_LIMIT (64UL << 20)
+
+struct entry {
+	struct filecache_file f; /* first, so the public pointer converts */
+	char *name;  /* key in the table, 0 once replaced or evicted */
+	unsigned refs;
+	int mapped;
+	struct entry *prev, *next; /* lru list, most recent first */
+	void *aux[FILECACHE_AUX_MAX];
+	void (*aux_free[FILECACHE_AUX_MAX])(void*);
+	uint64_t hash;
+	int have_hash;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static hbmap(char*, struct entry*, 256) *table;
+static struct entry *lru_head, *lru_tail;
+static size_t limit = FILECACHE_DEFAULT_LIMIT;
+static struct filecache_stats stats;
+
+static unsigned string_hash(const char* s) {
+	uint_fast32_t h = 0;
+	while (*s) {
+		h = 16*h + *s++;
+		h ^= h>>24 & 0xf0;
+	}
+	return h & 0xfffffff;
+}
+
+static int strptrcmp(const void *a, const void *b) {
+	const char * const *x = a;
+	const char * const *y = b;
+	return strcmp(*x, *y);
+}
+
+static void entry_name(char *buf, size_t size, const struct filecache_key *key) {
+	snprintf(buf, size, "%llx:%llx", (unsigned long long) key->dev, (unsigned long long) key->ino);
+}
+
+static int key_fresh(const struct filecache_key *a, const struct filecache_key *b) {
+	return a->size == b->size &&
+		a->mtime_sec == b->mtime_sec &&
+		a->mtime_nsec == b->mtime_nsec;
+}
+
+static void lru_unlink(struct entry *e) {
+	if(e->prev) e->prev->next = e->next;
+	else lru_head = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else lru_tail = e->prev;
+	e->prev = e->next = 0;
+}
+
+static void lru_push(struct entry *e) {
+	e->prev = 0;
+	e->next = lru_head;
+	if(lru_head) lru_head->prev = e;
+	else lru_tail = e;
+	lru_head = e;
+}
+
+static void entry_free(struct entry *e) {
+	int i;
+	for(i = 0; i < FILECACHE_AUX_MAX; i++)
+		if(e->aux[i]) e->aux_free[i](e->aux[i]);
+	if(e->mapped) munmap((void*) e->f.data, e->f.size);
+	else free((void*) e->f.data);
+	free(e);
+}
+
+/* remove from the table; the entry lives on until its last release */
+static void entry_drop(struct entry *e) {
+	hbmap_iter k = hbmap_find(table, e->name);
+	if(k != (hbmap_iter) -1) hbmap_delete(table, k);
+	free(e->name);
+	e->name = 0;
+	lru_unlink(e);
+	stats.bytes -= e->f.size;
+	stats.entries--;
+	if(!e->refs) entry_free(e);
+}
+
+static void evict(void) {
+	struct entry *e = lru_tail, *prev;
+	while(e && stats.bytes > limit) {
+		prev = e->prev;
+		if(!e->refs) {
+			entry_drop(e);
+			stats.evictions++;
+		}
+		e = prev;
+	}
+}
+
+static struct entry *entry_load(const char *path) {
+	struct stat st;
+	struct entry *e;
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) return 0;
+	if(fstat(fd, &st) || !(e = calloc(1, sizeof *e))) {
+		close(fd);
+		return 0;
+	}
+	e->f.size = st.st_size;
+	e->f.key = (struct filecache_key) {
+		.dev = st.st_dev, .ino = st.st_ino, .size = st.st_size,
+		.mtime_sec = st.st_mtim.tv_sec, .mtime_nsec = st.st_mtim.tv_nsec,
+	};
+	if(st.st_size) {
+		void *m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(m != MAP_FAILED) {
+			e->f.data = m;
+			e->mapped = 1;
+		}
+	}
+	if(!e->mapped) {
+		/* empty, or not mappable */
+		char *buf = malloc(st.st_size + 1);
+		size_t len = 0;
+		ssize_t n = 1;
+		while(buf && len < (size_t) st.st_size && (n = read(fd, buf + len, st.st_size - len)) > 0)
+			len += n;
+		if(!buf || n < 0) {
+			free(buf);
+			free(e);
+			close(fd);
+			return 0;
+		}
+		e->f.data = buf;
+		e->f.size = len;
+	}
+	close(fd);
+	return e;
+}
+
+const struct filecache_file *filecache_get(const char *path, const struct filecache_key *key) {
+	char name[48];
+	struct entry *e, **found;
+	entry_name(name, sizeof name, key);
+	pthread_mutex_lock(&lock);
+	if(!table) table = hbmap_new(strptrcmp, string_hash, 256);
+	if((found = hbmap_get(table, name)) && key_fresh(&(*found)->f.key, key)) {
+		e = *found;
+		e->refs++;
+		lru_unlink(e);
+		lru_push(e);
+		stats.hits++;
+		pthread_mutex_unlock(&lock);
+		return &e->f;
+	}
+	stats.misses++;
+	pthread_mutex_unlock(&lock);
+
+	/* read without holding the lock, other threads may do the same */
+	if(!(e = entry_load(path))) return 0;
+	entry_name(name, sizeof name, &e->f.key);
+	e->refs = 1;
+
+	pthread_mutex_lock(&lock);
+	if((found = hbmap_get(table, name))) {
+		struct entry *old = *found;
+		if(key_fresh(&old->f.key, &e->f.key)) {
+			/* someone else was faster */
+			old->refs++;
+			pthread_mutex_unlock(&lock);
+			entry_free(e);
+			return &old->f;
+		}
+		entry_drop(old);
+	}
+	e->name = strdup(name);
+	hbmap_insert(table, e->name, e);
+	lru_push(e);
+	stats.bytes += e->f.size;
+	stats.entries++;
+	evict();
+	pthread_mutex_unlock(&lock);
+	return &e->f;
+}
+
+void filecache_release(const struct filecache_file *f) {
+	struct entry *e = (struct entry*) f;
+	pthread_mutex_lock(&lock);
+	if(!--e->refs) {
+		if(!e->name) entry_free(e);
+		else evict();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void *filecache_get_aux(const struct filecache_file *f, enum filecache_aux slot) {
+	struct entry *e = (struct entry*) f;
+	pthread_mutex_lock(&lock);
+	void *ret = e->aux[slot];
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void *filecache_set_aux(const struct filecache_file *f, enum filecache_aux slot, void *data, void (*free_func)(void*)) {
+	struct entry *e = (struct entry*) f;
+	pthread_mutex_lock(&lock);
+	void *ret = e->aux[slot];
+	if(!ret) {
+		e->aux[slot] = ret = data;
+		e->aux_free[slot] = free_func;
+	}
+	pthread_mutex_unlock(&lock);
+	if(ret != data) free_func(data);
+	return ret;
+}
+
+int filecache_hash(const char *path, const struct filecache_key *key, uint64_t *h) {
+	const struct filecache_file *f = filecache_get(path, key);
+	struct entry *e = (struct entry*) f;
+	const unsigned char *p;
+	uint64_t x;
+	size_t i;
+	int have;
+	if(!f) return 0;
+	pthread_mutex_lock(&lock);
+	have = e->have_hash;
+	x = e->hash;
+	pthread_mutex_unlock(&lock);
+	if(!have) {
+		/* the contents don't change, so no lock is needed */
+		x = 0xcbf29ce484222325ULL;
+		for(p = (const unsigned char*) f->data, i = 0; i < f->size; i++) {
+			x ^= p[i];
+			x *= 0x100000001b3ULL;
+		}
+		pthread_mutex_lock(&lock);
+		e->hash = x;
+		e->have_hash = 1;
+		pthread_mutex_unlock(&lock);
+	}
+	filecache_release(f);
+	*h = x;
+	return 1;
+}
+
+void filecache_set_limit(size_t l) {
+	pthread_mutex_lock(&lock);
+	limit = l;
+	evict();
+	pthread_mutex_unlock(&lock);
+}
+
+void filecache_get_stats(struct filecache_stats *st) {
+	pthread_mutex_lock(&lock);
+	*st = stats;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,62 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* process-wide cache of header contents, shared read-only by all
+   struct cpp instances and threads. files are identified by device and
+   inode, and an entry is only reused while size and mtime match. */
+
+struct filecache_key {
+	int64_t dev, ino;
+	int64_t size;
+	int64_t mtime_sec, mtime_nsec;
+};
+
+struct filecache_file {
+	const char *data; /* not 0-terminated */
+	size_t size;
+	struct filecache_key key; /* as found when the file was read */
+};
+
+struct filecache_stats {
+	unsigned long hits, misses, evictions;
+	size_t bytes; /* contents currently held */
+	size_t entries;
+};
+
+/* return the contents of path, which stat() described as key. the file
+   is read unless the cache holds an up to date copy. returns 0 if it
+   can't be read. every successful call needs a filecache_release(). */
+const struct filecache_file *filecache_get(const char *path, const struct filecache_key *key);
+void filecache_release(const struct filecache_file *f);
+
+/* data derived from a file's contents, shared along with them */
+enum filecache_aux {
+	FILECACHE_AUX_TOKENS, /* struct tokcache */
+	FILECACHE_AUX_SKELETON, /* struct skeleton, see preproc.c */
+	FILECACHE_AUX_MAX
+};
+
+void *filecache_get_aux(const struct filecache_file *f, enum filecache_aux slot);
+/* attach data to f, to be freed with free_func when f is dropped.
+   if another thread was faster, its data is returned instead, and
+   data is freed right away. */
+void *filecache_set_aux(const struct filecache_file *f, enum filecache_aux slot, void *data, void (*free_func)(void*));
+
+/* 64bit FNV-1a of the contents of path, computed once per cached copy.
+   returns 0 if it can't be read. */
+int filecache_hash(const char *path, const struct filecache_key *key, uint64_t *h);
+
+/* contents of released files are dropped, least recently used first,
+   while more than limit bytes are cached. */
+void filecache_set_limit(size_t limit);
+void filecache_get_stats(struct filecache_stats *st);
+
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"
+#endif
+#pragma RcB2 DEP "filecache.c"
+
+#endif
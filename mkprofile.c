@@ -0,0 +1,76 @@
+#include "preproc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* turns macro dumps (e.g. the output of `cc -dM -E - </dev/null`)
+   into const tables that cppmain -p can select without parsing. */
+
+static int usage(char *a0) {
+	fprintf(stderr,
+			"profile generator\n"
+			"usage: %s [name=]file... > profiles.c\n"
+			"each file is preprocessed, and the resulting macros are\n"
+			"written as a profile called name, or the file's basename.\n"
+			, a0);
+	return 1;
+}
+
+static char *profile_name(char *arg, char **file) {
+	char *eq = strchr(arg, '='), *p;
+	if(eq) {
+		*eq = 0;
+		*file = eq + 1;
+		return arg;
+	}
+	*file = arg;
+	if((p = strrchr(arg, '/'))) arg = p + 1;
+	arg = strdup(arg);
+	if((p = strrchr(arg, '.'))) *p = 0;
+	return arg;
+}
+
+static char *c_name(const char *name) {
+	char *ret = strdup(name), *p;
+	for(p = ret; *p; p++)
+		if(!isalnum((unsigned char) *p)) *p = '_';
+	return ret;
+}
+
+int main(int argc, char** argv) {
+	int i, ret = 0;
+	char **cnames, *file, *name;
+	for(i = 1; i < argc; i++)
+		if(argv[i][0] == '-') return usage(argv[0]);
+	cnames = calloc(argc, sizeof(char*));
+	printf("/* generated by mkprofile, do not edit */\n"
+	       "#include \"preproc.h\"\n\n");
+	for(i = 1; i < argc; i++) {
+		name = profile_name(argv[i], &file);
+		cnames[i] = c_name(name);
+		FILE *in = fopen(file, "r"), *out = fopen("/dev/null", "w");
+		struct cpp *cpp = cpp_new();
+		if(!in || !out) {
+			perror(file);
+			ret = 1;
+		} else if(!cpp_run(cpp, in, out, file) ||
+		          !cpp_write_profile(cpp, stdout, name, cnames[i]))
+			ret = 1;
+		cpp_destroy(cpp);
+		if(in) fclose(in);
+		if(out) fclose(out);
+		if(name != argv[i]) free(name);
+		if(ret) break;
+	}
+	if(!ret) {
+		for(i = 1; i < argc; i++)
+			printf("extern const struct cpp_profile cpp_profile_%s;\n", cnames[i]);
+		printf("\nconst struct cpp_profile *const cpp_profiles[] = {\n");
+		for(i = 1; i < argc; i++)
+			printf("\t&cpp_profile_%s,\n", cnames[i]);
+		printf("\t0,\n};\n");
+	}
+	for(i = 1; i < argc; i++) free(cnames[i]);
+	free(cnames);
+	return ret;
+}
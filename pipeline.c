@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "pipeline.h"
+
+#define BLOCK_SIZE (256 * 1024)
+#define RING_SLOTS 8 /* blocks per stage */
+/* as PRELEX_MIN_SIZE in preproc.c, smaller files aren't lexed ahead */
+#define PIPELINE_LEX_MIN (1024 * 1024)
+
+struct block {
+	size_t len; /* 0 marks the end */
+	char data[BLOCK_SIZE];
+};
+
+/* each end is used by one thread only. the semaphore counts the filled
+   slots, its post and wait order the slot accesses, so no lock is
+   needed. it isn't lock-free though: a stage that has nothing to do
+   sleeps in sem_wait() instead of spinning, which matters with fewer
+   cores than stages. a ring can't overflow since it holds at most the
+   RING_SLOTS blocks of its stage. */
+struct ring {
+	struct block *slot[RING_SLOTS];
+	unsigned head, tail;
+	sem_t filled;
+};
+
+/* blocks go forth in full and come back through empty */
+struct stage {
+	struct ring full, empty;
+	struct block *blocks;
+};
+
+struct pipeline {
+	struct stage input, output;
+	int in, out;
+	const char *inname;
+	struct block *cur; /* output block being filled */
+	atomic_int stop; /* processing failed, the reader may quit */
+	atomic_int write_failed;
+	int read_errno, write_errno;
+};
+
+static void ring_push(struct ring *r, struct block *b) {
+	r->slot[r->tail++ % RING_SLOTS] = b;
+	sem_post(&r->filled);
+}
+
+static struct block *ring_pop(struct ring *r) {
+	while(sem_wait(&r->filled) && errno == EINTR);
+	return r->slot[r->head++ % RING_SLOTS];
+}
+
+static int stage_init(struct stage *s) {
+	unsigned i;
+	if(!(s->blocks = malloc(RING_SLOTS * sizeof *s->blocks))) return 0;
+	s->full.head = s->full.tail = s->empty.head = s->empty.tail = 0;
+	sem_init(&s->full.filled, 0, 0);
+	sem_init(&s->empty.filled, 0, 0);
+	for(i = 0; i < RING_SLOTS; i++) ring_push(&s->empty, &s->blocks[i]);
+	return 1;
+}
+
+static void stage_fini(struct stage *s) {
+	sem_destroy(&s->full.filled);
+	sem_destroy(&s->empty.filled);
+	free(s->blocks);
+}
+
+static void *reader(void *arg) {
+	struct pipeline *p = arg;
+	struct block *b;
+	ssize_t n;
+	do {
+		b = ring_pop(&p->input.empty);
+		b->len = 0;
+		/* fill the block, so short reads from pipes don't become
+		   as many cpp_feed() calls */
+		while(!atomic_load(&p->stop) && b->len < BLOCK_SIZE) {
+			if((n = read(p->in, b->data + b->len, BLOCK_SIZE - b->len)) > 0)
+				b->len += n;
+			else if(n == 0) break;
+			else if(errno != EINTR) {
+				p->read_errno = errno;
+				break;
+			}
+		}
+		ring_push(&p->input.full, b);
+	} while(b->len == BLOCK_SIZE);
+	/* a short block is the last one, send the end mark unless it is */
+	if(b->len) {
+		b = ring_pop(&p->input.empty);
+		b->len = 0;
+		ring_push(&p->input.full, b);
+	}
+	return 0;
+}
+
+static void *writer(void *arg) {
+	struct pipeline *p = arg;
+	struct block *b;
+	size_t off;
+	ssize_t n;
+	while((b = ring_pop(&p->output.full))->len) {
+		/* after a failure, keep taking blocks so the producer can't
+		   get stuck */
+		for(off = 0; off < b->len && !atomic_load(&p->write_failed); )
+			if((n = write(p->out, b->data + off, b->len - off)) >= 0)
+				off += n;
+			else if(errno != EINTR) {
+				p->write_errno = errno;
+				atomic_store(&p->write_failed, 1);
+			}
+		ring_push(&p->output.empty, b);
+	}
+	return 0;
+}
+
+/* sink callback on the processing thread */
+static int send_output(void *ctx, const char *data, size_t len) {
+	struct pipeline *p = ctx;
+	size_t n;
+	while(len) {
+		if(!p->cur) {
+			p->cur = ring_pop(&p->output.empty);
+			p->cur->len = 0;
+		}
+		n = BLOCK_SIZE - p->cur->len;
+		if(n > len) n = len;
+		memcpy(p->cur->data + p->cur->len, data, n);
+		p->cur->len += n;
+		data += n;
+		len -= n;
+		if(p->cur->len == BLOCK_SIZE) {
+			ring_push(&p->output.full, p->cur);
+			p->cur = 0;
+		}
+	}
+	return !atomic_load(&p->write_failed);
+}
+
+/* the blocks of the reader, through cpp_feed() */
+static int process_fed(struct cpp *cpp, struct pipeline *p, struct cpp_sink *out) {
+	struct block *b;
+	int started, ret;
+	if(!(ret = started = cpp_start(cpp, out, p->inname))) atomic_store(&p->stop, 1);
+	while((b = ring_pop(&p->input.full))->len) {
+		if(ret && !cpp_feed(cpp, b->data, b->len)) {
+			ret = 0;
+			atomic_store(&p->stop, 1);
+		}
+		ring_push(&p->input.empty, b);
+	}
+	ring_push(&p->input.empty, b);
+	if(started) ret = cpp_finish(cpp) && ret;
+	return ret;
+}
+
+static int process_fd(struct cpp *cpp, struct pipeline *p, struct cpp_sink *out) {
+	pthread_t rt;
+	int ret;
+	if(!stage_init(&p->input)) return 0;
+	if((errno = pthread_create(&rt, 0, reader, p))) {
+		perror("pthread_create");
+		stage_fini(&p->input);
+		return 0;
+	}
+	ret = process_fed(cpp, p, out);
+	pthread_join(rt, 0);
+	stage_fini(&p->input);
+	if(p->read_errno) {
+		errno = p->read_errno;
+		perror(p->inname);
+		ret = 0;
+	}
+	return ret;
+}
+
+/* a regular file large enough to be lexed ahead is mapped instead, so
+   prelex can lex it into token records on the instance's lex threads
+   while this one processes them. their page faults read it. */
+static void *map_input(int in, size_t *size) {
+	struct stat st;
+	void *map;
+	if(fstat(in, &st) || !S_ISREG(st.st_mode) || st.st_size < PIPELINE_LEX_MIN ||
+	   (uint64_t) st.st_size > UINT32_MAX ||
+	   (map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, in, 0)) == MAP_FAILED)
+		return 0;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return map;
+}
+
+static void end_output(struct pipeline *p) {
+	/* pass on the rest and the end mark */
+	if(p->cur && p->cur->len) {
+		ring_push(&p->output.full, p->cur);
+		p->cur = 0;
+	}
+	if(!p->cur) p->cur = ring_pop(&p->output.empty);
+	p->cur->len = 0;
+	ring_push(&p->output.full, p->cur);
+	p->cur = 0;
+}
+
+int cpp_run_pipelined(struct cpp *cpp, int in, int out, const char *inname) {
+	struct pipeline p = {.in = in, .out = out, .inname = inname};
+	struct cpp_sink sink;
+	pthread_t wt;
+	size_t size;
+	void *map;
+	int ret;
+	atomic_init(&p.stop, 0);
+	atomic_init(&p.write_failed, 0);
+	if(!stage_init(&p.output)) return 0;
+	if((errno = pthread_create(&wt, 0, writer, &p))) {
+		perror("pthread_create");
+		stage_fini(&p.output);
+		return 0;
+	}
+	cpp_sink_init(&sink, send_output, &p);
+	if((map = map_input(in, &size))) {
+		ret = cpp_run_buffer(cpp, map, size, &sink, inname);
+		munmap(map, size);
+	} else ret = process_fd(cpp, &p, &sink);
+	ret = cpp_sink_fini(&sink) && ret;
+	end_output(&p);
+	pthread_join(wt, 0);
+	if(p.write_errno) {
+		errno = p.write_errno;
+		perror("write");
+		ret = 0;
+	}
+	stage_fini(&p.output);
+	return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "preproc.h"
+
+/* preprocessing one large input in stages on threads of their own:
+   a regular file of 1 MiB up to 4 GiB is mapped and lexed ahead into
+   token records on the lex threads of the instance, see
+   cpp_set_lex_threads(), which should be at least 1 for this. other
+   input, such as a pipe, is read ahead in blocks by a reader thread
+   instead and lexed along with processing, so only its reading and
+   writing overlap with preprocessing. the calling thread handles
+   directives and expands macros, and a writer thread writes the output
+   while the next part is produced. reader and writer hand blocks to
+   the calling thread and back through single producer, single consumer
+   rings. */
+
+/* like cpp_run_sink() to a file descriptor, reading from the fd in.
+   the output is plain text, CPP_FLAG_COMPACT doesn't apply. read and
+   write errors are printed to stderr. returns 0 on errors. */
+int cpp_run_pipelined(struct cpp *cpp, int in, int out, const char *inname);
+
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"
+#endif
+#pragma RcB2 DEP "pipeline.c"
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "prelex.h"
+#include "tokcache.h"
+
+#define CHUNK_SIZE (256 * 1024)
+
+struct chunk {
+	size_t start, end;
+	uint32_t line; /* at start, which is at column 0 */
+	struct tokcache *tc; /* 0 if lexing it failed */
+	int done;
+};
+
+/* chunk i lives in slot i % window while it is lexed or replayed.
+   the threads take chunks in order and stay less than window chunks
+   ahead of the one being replayed. */
+struct prelex {
+	struct tokenizer proto; /* state at the start, copied for each chunk */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct chunk *chunks;
+	size_t window;
+	size_t next; /* the chunk to lex next */
+	size_t cur; /* the chunk being replayed */
+	size_t cut; /* where the next chunk starts */
+	uint32_t cut_line;
+	int stop;
+	pthread_t *threads;
+	unsigned nthreads;
+};
+
+#define SLOT(P, I) (&(P)->chunks[(I) % (P)->window])
+#define AT_END(P) ((P)->cut == (P)->proto.mem_size)
+
+/* the end of the chunk starting at pos, the first line end at least
+   CHUNK_SIZE later that the tokenizer reaches outside of a comment,
+   literal or continued line. adds the lines passed to *line. */
+static size_t cut_chunk(const char *p, size_t pos, size_t size, uint32_t *line) {
+	enum { CODE, BLOCK_COMMENT, LINE_COMMENT, QUOTE } state = CODE;
+	size_t want = pos + CHUNK_SIZE, i;
+	int quote = 0;
+	for(i = pos; i < size; i++) {
+		int c = p[i];
+		if(c == '\n') ++*line;
+		switch(state) {
+		case BLOCK_COMMENT:
+			if(c == '*' && i + 1 < size && p[i+1] == '/') {
+				state = CODE;
+				i++;
+			}
+			continue;
+		case LINE_COMMENT:
+			/* the tokenizer ends it at the first newline */
+			if(c == '\n') {
+				state = CODE;
+				goto newline;
+			}
+			continue;
+		case QUOTE:
+			if(c == '\\' && i + 1 < size) {
+				if(p[++i] == '\n') ++*line;
+			} else if(c == quote) state = CODE;
+			else if(c == '\n') {
+				state = CODE;
+				goto newline;
+			}
+			continue;
+		case CODE:
+			break;
+		}
+		switch(c) {
+		case '/':
+			if(i + 1 < size && p[i+1] == '*') state = BLOCK_COMMENT;
+			else if(i + 1 < size && p[i+1] == '/') state = LINE_COMMENT;
+			else break;
+			i++;
+			break;
+		case '"': case '\'':
+			state = QUOTE;
+			quote = c;
+			break;
+		case '\\':
+			if(i + 1 < size && p[i+1] == '\n') {
+				++*line;
+				i++;
+			}
+			break;
+		case '\n':
+		newline:
+			if(i + 1 >= want) return i + 1;
+			break;
+		}
+	}
+	return size;
+}
+
+static void lex_chunk(struct prelex *p, struct chunk *c) {
+	struct tokenizer t = p->proto;
+	struct tokcache_writer *w = tokcache_writer_new();
+	struct token tok;
+	off_t pos;
+	if(!w) return;
+	tokenizer_seek(&t, c->start, c->line, 0);
+	tokenizer_set_recorder(&t, tokcache_record, w);
+	/* the last token may run past the end, e.g. after a // comment */
+	while((pos = tokenizer_ftello(&t)) < (off_t) c->end) {
+		tokenizer_next(&t, &tok);
+		if(tok.type == TT_EOF || tokenizer_ftello(&t) == pos) break;
+	}
+	c->tc = tokcache_writer_finish(w, 0, 0, 0);
+}
+
+static void *work(void *arg) {
+	struct prelex *p = arg;
+	struct chunk *c;
+	pthread_mutex_lock(&p->lock);
+	while(!p->stop) {
+		if(AT_END(p) || p->next >= p->cur + p->window) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+		c = SLOT(p, p->next++);
+		c->start = p->cut;
+		c->line = p->cut_line;
+		c->end = p->cut = cut_chunk(p->proto.mem, p->cut, p->proto.mem_size, &p->cut_line);
+		c->tc = 0;
+		c->done = 0;
+		pthread_mutex_unlock(&p->lock);
+		lex_chunk(p, c);
+		pthread_mutex_lock(&p->lock);
+		c->done = 1;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/* the tokenizer is at pos and has used up the records it had */
+static void refill(void *ctx, struct tokenizer *t, size_t pos) {
+	struct prelex *p = ctx;
+	struct chunk *c;
+	pthread_mutex_lock(&p->lock);
+	while(1) {
+		if(p->cur >= p->next && AT_END(p)) {
+			/* no more chunks */
+			tokenizer_set_replay(t, 0, 0, 0);
+			tokenizer_set_refill(t, 0, 0);
+			break;
+		}
+		c = SLOT(p, p->cur);
+		if(p->cur >= p->next || !c->done) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+		if(c->end > pos) {
+			if(c->tc) tokenizer_set_replay(t, c->tc->records, c->tc->count, c->tc->strings);
+			else tokenizer_set_replay(t, 0, 0, 0);
+			break;
+		}
+		/* passed it, make room for the next one */
+		tokcache_free(c->tc);
+		c->tc = 0;
+		p->cur++;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+struct prelex *prelex_start(struct tokenizer *t, unsigned nthreads) {
+	struct prelex *p = calloc(1, sizeof *p);
+	if(!p) return 0;
+	p->proto = *t;
+	p->proto.replay = 0;
+	p->proto.replay_count = 0;
+	p->proto.refill = 0;
+	p->proto.recorder = 0;
+	p->proto.peeking = 0;
+	p->cut = t->mem_pos;
+	p->cut_line = t->line;
+	p->window = 2 * nthreads;
+	p->chunks = calloc(p->window, sizeof *p->chunks);
+	p->threads = calloc(nthreads, sizeof *p->threads);
+	pthread_mutex_init(&p->lock, 0);
+	pthread_cond_init(&p->cond, 0);
+	if(p->chunks && p->threads)
+		for(; p->nthreads < nthreads; p->nthreads++)
+			if(pthread_create(&p->threads[p->nthreads], 0, work, p)) break;
+	if(!p->nthreads) {
+		prelex_free(p);
+		return 0;
+	}
+	tokenizer_set_refill(t, refill, p);
+	return p;
+}
+
+void prelex_free(struct prelex *p) {
+	size_t i;
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	for(i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], 0);
+	/* chunks being lexed are finished by now */
+	for(i = 0; p->chunks && i < p->window; i++) tokcache_free(p->chunks[i].tc);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	free(p->chunks);
+	free(p->threads);
+	free(p);
+}
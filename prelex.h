@@ -0,0 +1,28 @@
+#ifndef PRELEX_H
+#define PRELEX_H
+
+#include "tokenizer.h"
+
+/* lexing a large memory input ahead on several threads. a quick scan
+   cuts the input into chunks at line ends outside of comments, literals
+   and continued lines, which are lexed concurrently into token records.
+   the tokenizer replays them as it gets to each chunk, only a few
+   chunks ahead of it are kept. where a record doesn't fit the
+   tokenizer's state, it lexes on its own, so the result never depends
+   on where the input was cut. */
+
+struct prelex;
+
+/* t must have memory input of less than 4 GiB, no custom tokens, be
+   at the start of a line and stay where it is until prelex_free().
+   returns 0 if out of memory or no thread could be started. */
+struct prelex *prelex_start(struct tokenizer *t, unsigned nthreads);
+/* stop the threads and free the records. t must not be used anymore. */
+void prelex_free(struct prelex *p);
+
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"
+#endif
+#pragma RcB2 DEP "prelex.c"
+
+#endif
@@ -1,22 +1,48 @@
 #include <string.h>
-#include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <pthread.h>
 #include "preproc.h"
 #include "tokenizer.h"
+#include "filecache.h"
+#include "tokcache.h"
+#include "prelex.h"
 #include "tglist.h"
 #include "hbmap.h"
 
 #define MACRO_FLAG_OBJECTLIKE (1U<<31)
 #define MACRO_FLAG_VARIADIC (1U<<30)
-#define MACRO_ARGCOUNT_MASK (~(0|MACRO_FLAG_OBJECTLIKE|MACRO_FLAG_VARIADIC))
+/* name, contents and argnames are not owned by the macro table,
+   e.g. because they point into a mapped snapshot */
+#define MACRO_FLAG_BORROWED (1U<<29)
+#define MACRO_FLAG_BUILTIN (1U<<28)
+#define MACRO_ARGCOUNT_MASK (~(0|MACRO_FLAG_OBJECTLIKE|MACRO_FLAG_VARIADIC|MACRO_FLAG_BORROWED|MACRO_FLAG_BUILTIN))
 
 #define OBJECTLIKE(M) (M->num_args & MACRO_FLAG_OBJECTLIKE)
 #define FUNCTIONLIKE(M) (!(OBJECTLIKE(M)))
 #define MACRO_ARGCOUNT(M) (M->num_args & MACRO_ARGCOUNT_MASK)
 #define MACRO_VARIADIC(M) (M->num_args & MACRO_FLAG_VARIADIC)
+#define MACRO_BORROWED(M) (M->num_args & MACRO_FLAG_BORROWED)
 
 #define MAX_RECURSION 32
 
+/* inputs from this size on are lexed ahead in parallel, if enabled */
+#define PRELEX_MIN_SIZE (1024 * 1024)
+
+/* independent of the locale, which another thread may be changing */
+static int ascii_isdigit(int c) { return c >= '0' && c <= '9'; }
+static int ascii_isalpha(int c) { return (c | 32) >= 'a' && (c | 32) <= 'z'; }
+static int ascii_isalnum(int c) { return ascii_isalpha(c) || ascii_isdigit(c); }
+static int ascii_tolower(int c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
 static unsigned string_hash(const char* s) {
 	uint_fast32_t h = 0;
 	while (*s) {
@@ -26,19 +52,177 @@ static unsigned string_hash(const char* s) {
 	return h & 0xfffffff;
 }
 
+/* 64bit FNV-1a, used where string_hash' 28 bits aren't enough */
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data;
+	if(!h) h = 0xcbf29ce484222325ULL;
+	while(len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
 struct macro {
 	unsigned num_args;
-	FILE* str_contents;
 	char *str_contents_buf;
-	tglist(char*) argnames;
+	size_t str_contents_len;
+	char **argnames; /* MACRO_ARGCOUNT entries */
+};
+
+/* a definition taken out of a macro table along with its key */
+struct macro_def {
+	char *name;
+	struct macro m;
+};
+
+/* size and mtime of an input file at the time it was opened */
+struct file_stamp {
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct mapping {
+	void *addr;
+	size_t size;
+	char **args;
+};
+
+/* a header whose tokens all sit inside #ifndef macro ... #endif.
+   as long as macro is defined, including it again only produces the
+   whitespace around that block, which is stored in output. */
+struct include_guard {
+	char *macro;
+	char *output;
+};
+
+/* a file that contained #pragma once. path and hash are used to
+   recognize copies of it reached through a different path. */
+struct once_file {
+	char *path;
+	int64_t size;
+	uint64_t hash;
+	int have_hash;
+};
+
+/* sorted names of a directory's entries, for CPP_FLAG_LIST_DIRS */
+struct dir_listing {
+	char **names;
+	size_t count;
+	int ok; /* 0 if the directory couldn't be read */
+};
+
+/* a header registered with cpp_add_include_buffer(), found without
+   looking at the filesystem. guard and once are kept here, as there
+   is no path or inode to key them by. */
+struct virtual_file {
+	char *data;
+	size_t size;
+	int once;
+	struct include_guard guard;
+};
+
+/* generation of a macro name, bumped whenever the name is defined or
+   undefined. only names read by a cached #if are tracked. */
+struct macro_gen {
+	unsigned gen;
+	char name[];
+};
+
+struct cond_dep {
+	struct macro_gen *g;
+	unsigned gen; /* when the condition was evaluated */
+};
+
+/* result of an #if expression, valid while none of the names its
+   expansion looked up has changed */
+struct cond_entry {
+	int result;
+	size_t ndeps;
+	struct cond_dep deps[];
+};
+
+/* how far input that arrives in pieces can be processed: lines are
+   only cut where no comment, continued line or parenthesis is open. */
+struct input_scan {
+	size_t pos; /* scanned up to */
+	size_t safe; /* everything before it is complete */
+	enum { SCAN_CODE, SCAN_BLOCK_COMMENT, SCAN_LINE_COMMENT, SCAN_QUOTE } state;
+	int quote;
+	int depth; /* of parentheses outside directives */
+	int line_start, directive;
+	size_t eol; /* after the last line ending in code */
+};
+
+/* the macro names a chunk processed speculatively looked up in the
+   base instance, and the ones it changed. likewise for files: how
+   including each went the first time, and what it left behind. */
+struct spec_access {
+	hbmap(char*, char, 1024) *reads;
+	hbmap(char*, struct macro_def*, 32) *writes; /* final definition, 0 if undefined */
+	hbmap(char*, char, 64) *files; /* path -> include_outcome() */
+	hbmap(char*, struct include_guard, 32) *guards;
+	hbmap(char*, struct once_file, 32) *once;
+	hbmap(char*, struct file_stamp, 32) *deps;
 };
 
 struct cpp {
 	tglist(char*) includedirs;
 	hbmap(char*, struct macro, 128) *macros;
+	hbmap(char*, struct file_stamp, 32) *deps;
+	hbmap(char*, struct include_guard, 32) *guards;
+	hbmap(char*, struct filecache_key, 64) *stat_cache; /* size -1: doesn't exist */
+	hbmap(char*, struct once_file, 32) *once; /* keyed by once_key() */
+	hbmap(char*, char*, 64) *resolved; /* resolve_key() -> path or 0 */
+	hbmap(char*, struct dir_listing, 16) *dirs;
+	hbmap(char*, struct virtual_file*, 16) *virtuals;
+	hbmap(char*, char, 32) *names; /* spellings of included files, which
+	                                  tokens and __FILE__ refer to */
+	char *cur_dir; /* directory of the file being processed */
+	struct cpp_sink cond; /* expansion of the current #if, reused */
+	hbmap(char*, struct macro_gen*, 128) *macro_gens;
+	hbmap(char*, struct cond_entry*, 64) *conds; /* raw expression -> result */
+	char *cond_key;
+	size_t cond_key_cap;
+	struct cond_dep *cond_deps; /* names read by the current #if */
+	size_t cond_ndeps, cond_deps_cap;
+	int cond_recording; /* 1: record into cond_deps, -1: don't cache */
+	char *token_cache; /* directory of the on-disk token cache, or 0 */
+	unsigned lex_threads;
+	unsigned spec_threads;
+	int flags;
+	struct cpp_stats stats;
+	tglist(struct mapping) mappings;
+	const struct cpp_profile *profile;
+	unsigned char *profile_shadow; /* bitmap of profile macros that were
+	                                  redefined, undefined or copied into
+	                                  the macro table */
+	uint64_t config_hash;
+	int have_config_hash;
 	const char *last_file;
 	int last_line;
 	struct tokenizer *tchain[MAX_RECURSION];
+	struct parse_frame *frame; /* innermost file being processed */
+	unsigned inclusions; /* files entered in this run */
+	struct cpp_sink pull; /* output not yet taken by cpp_read() */
+	size_t pull_pos;
+	int pull_failed;
+	struct cpp_sink feed; /* input passed to cpp_feed() */
+	struct input_scan scan;
+	struct parse_frame *feed_frame; /* of the fed file */
+	struct cpp_sink *feed_out;
+	int feed_failed, feed_finish;
+	size_t feed_wait; /* the limit a macro call ran into, see feed_steps() */
+	cpp_diag_func diag;
+	void *diag_ctx;
+	/* speculative processing, see run_speculative(). a worker has
+	   spec set while it runs a chunk against the macros of spec_base,
+	   the base has spec_saved while it takes the results. */
+	struct cpp *spec_base;
+	struct spec_access *spec;
+	hbmap(char*, struct macro*, 32) *spec_saved; /* meaning at the start of the batch, 0 if undefined */
+	int spec_failed; /* out of memory, what was noted is incomplete */
 };
 
 static int token_needs_string(struct token *tok) {
@@ -60,10 +244,17 @@ static int token_needs_string(struct token *tok) {
 	}
 }
 
-static void tokenizer_from_file(struct tokenizer *t, FILE* f) {
-	tokenizer_init(t, f, TF_PARSE_STRINGS);
+static void tokenizer_from_mem(struct tokenizer *t, const char *buf, size_t len) {
+	tokenizer_init_mem(t, buf, len, TF_PARSE_STRINGS);
 	tokenizer_set_filename(t, "<macro>");
-	tokenizer_rewind(t);
+}
+
+/* read back what was written to a memory sink, which must not be
+   written to while t is in use */
+static void tokenizer_from_sink(struct tokenizer *t, struct cpp_sink *s) {
+	size_t len;
+	const char *buf = cpp_sink_data(s, &len);
+	tokenizer_from_mem(t, buf, len);
 }
 
 static int strptrcmp(const void *a, const void *b) {
@@ -72,71 +263,517 @@ static int strptrcmp(const void *a, const void *b) {
 	return strcmp(*x, *y);
 }
 
-static struct macro* get_macro(struct cpp *cpp, const char *name) {
+/* index of name in the profile, or -1 if it isn't in it or got shadowed */
+static int profile_find(struct cpp *cpp, const char *name) {
+	const struct cpp_profile *p = cpp->profile;
+	if(!p || !p->count) return -1;
+	unsigned h = string_hash(name), mask = p->nbuckets - 1, i;
+	for(i = h & mask; p->buckets[i]; i = (i + 1) & mask) {
+		unsigned idx = p->buckets[i] - 1;
+		if(p->macros[idx].hash == h && !strcmp(p->macros[idx].name, name)) {
+			if(cpp->profile_shadow && (cpp->profile_shadow[idx/8] & (1 << idx%8)))
+				return -1;
+			return idx;
+		}
+	}
+	return -1;
+}
+
+static void profile_shadow(struct cpp *cpp, int idx) {
+	if(!cpp->profile_shadow &&
+	   !(cpp->profile_shadow = calloc(1, (cpp->profile->count + 7) / 8)))
+		return;
+	cpp->profile_shadow[idx/8] |= 1 << idx%8;
+}
+
+/* profile macros are copied into the macro table on first use, so the
+   rest of the code only ever deals with one table. nothing is parsed or
+   duplicated, the entry borrows the profile's const data. */
+static struct macro profile_entry(const struct cpp_profile_macro *pm) {
+	return (struct macro) {
+		.num_args = pm->num_args | MACRO_FLAG_BORROWED,
+		.str_contents_buf = (char*) pm->body,
+		.str_contents_len = pm->body_len,
+		.argnames = (char**) pm->argnames,
+	};
+}
+
+static struct macro* profile_macro(struct cpp *cpp, const char *name) {
+	int idx = profile_find(cpp, name);
+	if(idx == -1) return 0;
+	const struct cpp_profile_macro *pm = &cpp->profile->macros[idx];
+	profile_shadow(cpp, idx);
+	hbmap_insert(cpp->macros, (char*) pm->name, profile_entry(pm));
 	return hbmap_get(cpp->macros, name);
 }
 
-static void add_macro(struct cpp *cpp, const char *name, struct macro*m) {
-	hbmap_insert(cpp->macros, name, *m);
+/* the definition of name without changing anything, a profile macro
+   is described in *buf */
+static struct macro *find_macro(struct cpp *cpp, const char *name, struct macro *buf) {
+	struct macro *m = hbmap_get(cpp->macros, name);
+	int idx;
+	if(m || (idx = profile_find(cpp, name)) == -1) return m;
+	*buf = profile_entry(&cpp->profile->macros[idx]);
+	return buf;
+}
+
+static int same_macro(const struct macro *a, const struct macro *b) {
+	unsigned i;
+	if(!a || !b) return a == b;
+	if((a->num_args ^ b->num_args) & ~MACRO_FLAG_BORROWED ||
+	   a->str_contents_len != b->str_contents_len ||
+	   !a->str_contents_buf != !b->str_contents_buf ||
+	   (a->str_contents_len && memcmp(a->str_contents_buf, b->str_contents_buf, a->str_contents_len)))
+		return 0;
+	for(i = 0; i < MACRO_ARGCOUNT(a); i++)
+		if(strcmp(a->argnames[i], b->argnames[i])) return 0;
+	return 1;
+}
+
+static void release_macro(struct macro *m) {
+	unsigned i;
+	if(MACRO_BORROWED(m)) return;
+	free(m->str_contents_buf);
+	for(i = 0; m->argnames && i < MACRO_ARGCOUNT(m); i++)
+		free(m->argnames[i]);
+	free(m->argnames);
+}
+
+/* a copy of m that owns its data, or 0 if out of memory */
+static struct macro *dup_macro(const struct macro *m) {
+	struct macro *d = malloc(sizeof *d);
+	unsigned i, n = MACRO_ARGCOUNT(m);
+	if(!d || MACRO_BORROWED(m)) {
+		if(d) *d = *m;
+		return d;
+	}
+	*d = (struct macro) {.num_args = m->num_args, .str_contents_len = m->str_contents_len};
+	if(m->str_contents_buf) {
+		if(!(d->str_contents_buf = malloc(m->str_contents_len + 1))) goto fail;
+		memcpy(d->str_contents_buf, m->str_contents_buf, m->str_contents_len);
+		d->str_contents_buf[m->str_contents_len] = 0;
+	}
+	if(m->argnames && !(d->argnames = calloc(n ? n : 1, sizeof *d->argnames)))
+		goto fail;
+	for(i = 0; i < n; i++)
+		if(!(d->argnames[i] = strdup(m->argnames[i]))) goto fail;
+	return d;
+fail:
+	release_macro(d);
+	free(d);
+	return 0;
+}
+
+static void record_condition_dep(struct cpp *cpp, const char *name, struct macro *m) {
+	struct macro_gen **gp, *g;
+	size_t i;
+	/* __FILE__ and __LINE__ depend on where the condition is */
+	if(m && (m->num_args & MACRO_FLAG_BUILTIN) && strcmp(name, "defined"))
+		goto fail;
+	if(cpp->cond_recording != 1) return;
+	if((gp = hbmap_get(cpp->macro_gens, name))) g = *gp;
+	else {
+		size_t len = strlen(name);
+		if(!(g = malloc(sizeof *g + len + 1))) goto fail;
+		g->gen = 0;
+		memcpy(g->name, name, len + 1);
+		hbmap_insert(cpp->macro_gens, g->name, g);
+	}
+	for(i = 0; i < cpp->cond_ndeps; i++)
+		if(cpp->cond_deps[i].g == g) return;
+	if(cpp->cond_ndeps == cpp->cond_deps_cap) {
+		size_t cap = cpp->cond_deps_cap ? cpp->cond_deps_cap * 2 : 16;
+		struct cond_dep *n = realloc(cpp->cond_deps, cap * sizeof *n);
+		if(!n) goto fail;
+		cpp->cond_deps = n;
+		cpp->cond_deps_cap = cap;
+	}
+	cpp->cond_deps[cpp->cond_ndeps++] = (struct cond_dep) {g, g->gen};
+	return;
+fail:
+	cpp->cond_recording = -1;
+}
+
+/* a chunk processed speculatively looks up what it didn't define
+   itself in spec_base, noting the name as read. returns 0 if the
+   chunk changed the name. */
+static int spec_read(struct cpp *cpp, const char *name) {
+	char *key;
+	if(hbmap_getsize(cpp->spec->writes) && hbmap_find(cpp->spec->writes, name) != (hbmap_iter) -1)
+		return 0;
+	if(hbmap_find(cpp->spec->reads, name) == (hbmap_iter) -1) {
+		if(!(key = strdup(name))) cpp->spec_failed = 1;
+		else hbmap_insert(cpp->spec->reads, key, 0);
+	}
+	return 1;
+}
+
+static struct macro* get_macro(struct cpp *cpp, const char *name) {
+	struct macro *m = hbmap_get(cpp->macros, name);
+	if(!m && cpp->spec && spec_read(cpp, name))
+		m = hbmap_get(cpp->spec_base->macros, name);
+	if(!m && cpp->profile) m = profile_macro(cpp, name);
+	if(cpp->cond_recording) record_condition_dep(cpp, name, m);
+	return m;
+}
+
+/* about to change name: note it as written by a speculative chunk, or
+   keep what it meant at the start of the batch for validating them */
+static void spec_write(struct cpp *cpp, const char *name) {
+	struct macro buf, *m, *d = 0;
+	char *key;
+	if(cpp->spec) {
+		if(hbmap_find(cpp->spec->writes, name) != (hbmap_iter) -1) return;
+		if(!(key = strdup(name))) cpp->spec_failed = 1;
+		else hbmap_insert(cpp->spec->writes, key, 0);
+	} else if(hbmap_find(cpp->spec_saved, name) == (hbmap_iter) -1) {
+		if(((m = find_macro(cpp, name, &buf)) && !(d = dup_macro(m))) || !(key = strdup(name))) {
+			free(d);
+			cpp->spec_failed = 1;
+		} else hbmap_insert(cpp->spec_saved, key, d);
+	}
 }
 
 static int undef_macro(struct cpp *cpp, const char *name) {
+	struct macro_gen **g = hbmap_get(cpp->macro_gens, name);
+	if(g) (*g)->gen++;
+	if(cpp->spec || cpp->spec_saved) spec_write(cpp, name);
+	int idx = profile_find(cpp, name);
+	if(idx != -1) profile_shadow(cpp, idx);
 	hbmap_iter k = hbmap_find(cpp->macros, name);
-	if(k == (hbmap_iter) -1) return 0;
+	if(k == (hbmap_iter) -1) return idx != -1;
 	struct macro *m = &hbmap_getval(cpp->macros, k);
-	free(hbmap_getkey(cpp->macros, k));
-	if(m->str_contents) fclose(m->str_contents);
-	free(m->str_contents_buf);
-	tglist_free_values(&m->argnames);
-	tglist_free_items(&m->argnames);
+	if(!MACRO_BORROWED(m)) free(hbmap_getkey(cpp->macros, k));
+	release_macro(m);
 	hbmap_delete(cpp->macros, k);
 	return 1;
 }
 
-static void free_macros(struct cpp *cpp) {
+static void add_macro(struct cpp *cpp, const char *name, struct macro*m) {
+	/* release a previous definition, so the table never holds on to
+	   a stale key or one that isn't owned by the new value */
+	undef_macro(cpp, name);
+	hbmap_insert(cpp->macros, name, *m);
+}
+
+static void clear_macros(struct cpp *cpp) {
 	hbmap_iter i;
 	hbmap_foreach(cpp->macros, i) {
 		while(hbmap_iter_index_valid(cpp->macros, i))
 			undef_macro(cpp, hbmap_getkey(cpp->macros, i));
 	}
+}
+
+static void free_macros(struct cpp *cpp) {
+	clear_macros(cpp);
 	hbmap_fini(cpp->macros, 1);
 	free(cpp->macros);
 }
 
-static void error_or_warning(const char *err, const char* type, struct tokenizer *t, struct token *curr) {
-	unsigned column = curr ? curr->column : t->column;
-	unsigned line  = curr ? curr->line : t->line;
-	dprintf(2, "<%s> %u:%u %s: '%s'\n", t->filename, line, column, type, err);
-	dprintf(2, "%s\n", t->buf);
-	for(int i = 0; i < strlen(t->buf); i++)
-		dprintf(2, "^");
-	dprintf(2, "\n");
+static void add_dependency_stamp(struct cpp *cpp, const char *path, const struct file_stamp *fs) {
+	if(hbmap_find(cpp->deps, path) == (hbmap_iter) -1)
+		hbmap_insert(cpp->deps, strdup(path), *fs);
+}
+
+static void add_dependency(struct cpp *cpp, const char *path, int fd) {
+	struct stat st;
+	if(fstat(fd, &st) || !S_ISREG(st.st_mode)) return;
+	struct file_stamp fs = {
+		.size = st.st_size,
+		.mtime_sec = st.st_mtim.tv_sec,
+		.mtime_nsec = st.st_mtim.tv_nsec,
+	};
+	add_dependency_stamp(cpp, path, &fs);
+}
+
+/* remove "." components and duplicate slashes, so that spellings of the
+   same path map to one include guard. ".." is left alone, since it
+   can't be resolved without looking at symlinks. */
+static void canonicalize_path(char *path) {
+	char *r = path, *w = path;
+	while(*r) {
+		if(r[0] == '/' && (r[1] == '/' || (r[1] == '.' && (r[2] == '/' || !r[2])))) {
+			r += r[1] == '/' ? 1 : 2;
+			continue;
+		}
+		if(w == path && r[0] == '.' && r[1] == '/' && r[2]) {
+			r += 2;
+			continue;
+		}
+		*w++ = *r++;
+	}
+	if(w > path + 1 && w[-1] == '/') --w;
+	*w = 0;
+}
+
+/* stat() path, or look it up in the cache. returns 0 if it doesn't
+   exist or can't be included. */
+static int stat_file(struct cpp *cpp, const char *path, struct filecache_key *id) {
+	struct filecache_key *c = hbmap_get(cpp->stat_cache, path);
+	if(c) {
+		*id = *c;
+		return id->size != -1;
+	}
+	struct stat st;
+	memset(id, 0, sizeof *id);
+	id->size = -1;
+	cpp->stats.stat_calls++;
+	if(!stat(path, &st) && !S_ISDIR(st.st_mode)) {
+		id->dev = st.st_dev;
+		id->ino = st.st_ino;
+		id->size = st.st_size;
+		id->mtime_sec = st.st_mtim.tv_sec;
+		id->mtime_nsec = st.st_mtim.tv_nsec;
+	}
+	hbmap_insert(cpp->stat_cache, strdup(path), *id);
+	return id->size != -1;
+}
+
+static void once_key(char *buf, size_t size, const struct filecache_key *id) {
+	snprintf(buf, size, "%llx:%llx", (unsigned long long) id->dev, (unsigned long long) id->ino);
+}
+
+static void mark_once(struct cpp *cpp, const char *path, const struct filecache_key *id) {
+	char key[48];
+	once_key(key, sizeof key, id);
+	if(hbmap_find(cpp->once, key) != (hbmap_iter) -1) return;
+	struct once_file o = {.path = strdup(path), .size = id->size};
+	hbmap_insert(cpp->once, strdup(key), o);
+}
+
+/* the file cache keeps the hash along with the contents, so a file
+   is only hashed again when it changed */
+static int hash_file(struct cpp *cpp, const char *path, uint64_t *h) {
+	struct filecache_key id;
+	return stat_file(cpp, path, &id) && filecache_hash(path, &id, h);
+}
+
+static int same_contents(const char *a, const char *b) {
+	FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+	int ca, cb, ret = 0;
+	if(fa && fb) {
+		do {
+			ca = getc(fa);
+			cb = getc(fb);
+		} while(ca == cb && ca != EOF);
+		ret = ca == cb && !ferror(fa) && !ferror(fb);
+	}
+	if(fa) fclose(fa);
+	if(fb) fclose(fb);
+	return ret;
+}
+
+/* whether the file at path was marked with #pragma once, either itself
+   or as an identical copy at another path. only the identity lookup is
+   needed for files seen before; contents are only read if a marked file
+   of the same size exists. */
+static int is_once(struct cpp *cpp, const char *path, const struct filecache_key *id) {
+	char key[48];
+	uint64_t h;
+	int have_h = 0;
+	hbmap_iter k;
+	once_key(key, sizeof key, id);
+	if(hbmap_find(cpp->once, key) != (hbmap_iter) -1) return 1;
+	/* a worker only looks the identity up in the base, see spec_valid() */
+	if(cpp->spec && hbmap_find(cpp->spec_base->once, key) != (hbmap_iter) -1) return 1;
+	hbmap_foreach(cpp->once, k) {
+		struct once_file *o = &hbmap_getval(cpp->once, k);
+		if(o->size != id->size) continue;
+		if(!have_h && !(have_h = filecache_hash(path, id, &h))) return 0;
+		if(!o->have_hash && !(o->have_hash = hash_file(cpp, o->path, &o->hash))) continue;
+		if(o->hash == h && same_contents(o->path, path)) {
+			mark_once(cpp, path, id);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* how an #include of path goes as things are: 'g' if its guard skips
+   it, 'o' if #pragma once does, else 'e' */
+static int include_outcome(struct cpp *cpp, const char *path) {
+	struct include_guard *g = hbmap_get(cpp->guards, path);
+	struct filecache_key id;
+	struct macro buf;
+	if(g && find_macro(cpp, g->macro, &buf)) return 'g';
+	if(stat_file(cpp, path, &id) && is_once(cpp, path, &id)) return 'o';
+	return 'e';
+}
+
+/* a chunk processed speculatively notes how it included path the first
+   time, which depended on the base */
+static void spec_include(struct cpp *cpp, const char *path, int outcome) {
+	char *key;
+	if(hbmap_find(cpp->spec->files, path) != (hbmap_iter) -1) return;
+	if(!(key = strdup(path))) cpp->spec_failed = 1;
+	else hbmap_insert(cpp->spec->files, key, outcome);
+}
+
+static int dir_listing_has(struct dir_listing *dl, const char *name) {
+	return bsearch(&name, dl->names, dl->count, sizeof(char*), strptrcmp) != 0;
+}
+
+/* with CPP_FLAG_LIST_DIRS, each include dir is read once, and a name
+   whose first component isn't listed is known to be missing. */
+static int dir_may_contain(struct cpp *cpp, const char *dir, const char *name) {
+	struct dir_listing *dl = hbmap_get(cpp->dirs, dir);
+	if(!dl) {
+		struct dir_listing n = {0};
+		size_t cap = 0;
+		DIR *d = opendir(dir);
+		struct dirent *de;
+		if(d) {
+			n.ok = 1;
+			while((de = readdir(d))) {
+				if(n.count == cap) {
+					char **nn = realloc(n.names, (cap = cap ? cap * 2 : 64) * sizeof(char*));
+					if(!nn) {
+						n.ok = 0;
+						break;
+					}
+					n.names = nn;
+				}
+				n.names[n.count++] = strdup(de->d_name);
+			}
+			closedir(d);
+			qsort(n.names, n.count, sizeof(char*), strptrcmp);
+		}
+		hbmap_insert(cpp->dirs, strdup(dir), n);
+		dl = hbmap_get(cpp->dirs, dir);
+	}
+	if(!dl->ok) return 1;
+	const char *slash = strchr(name, '/');
+	if(!slash) return dir_listing_has(dl, name);
+	char first[256];
+	if((size_t) (slash - name) >= sizeof first) return 1;
+	memcpy(first, name, slash - name);
+	first[slash - name] = 0;
+	return dir_listing_has(dl, first);
+}
+
+static void free_dirs(struct cpp *cpp) {
+	hbmap_iter k;
+	size_t i;
+	hbmap_foreach(cpp->dirs, k) {
+		struct dir_listing *dl = &hbmap_getval(cpp->dirs, k);
+		for(i = 0; i < dl->count; i++) free(dl->names[i]);
+		free(dl->names);
+		free(hbmap_getkey(cpp->dirs, k));
+	}
+}
+
+static void free_resolved(struct cpp *cpp) {
+	hbmap_iter k;
+	hbmap_foreach(cpp->resolved, k) {
+		free(hbmap_getkey(cpp->resolved, k));
+		free(hbmap_getval(cpp->resolved, k));
+	}
+}
+
+static int probe(struct cpp *cpp, char *buf, size_t size, const char *dir, const char *name) {
+	struct filecache_key id;
+	if((cpp->flags & CPP_FLAG_LIST_DIRS) && !dir_may_contain(cpp, dir, name))
+		return 0;
+	if((size_t) snprintf(buf, size, "%s/%s", dir, name) >= size) return 0;
+	canonicalize_path(buf);
+	return stat_file(cpp, buf, &id);
+}
+
+/* find the file an #include refers to. "" includes are looked up in the
+   directory of the including file first, then like <> includes in the
+   include dirs. results, including failed lookups, are cached for
+   (spelling, quote kind, including directory). paths that don't fit
+   PATH_MAX aren't found. */
+static const char *resolve_include(struct cpp *cpp, const char *name, int quoted) {
+	char key[2 * PATH_MAX + 2], buf[PATH_MAX];
+	struct filecache_key id;
+	size_t i;
+	const char *dir = quoted ? cpp->cur_dir : "";
+	if((size_t) snprintf(key, sizeof key, "%c%s\n%s", quoted ? '"' : '<', dir, name) >= sizeof key)
+		return 0;
+	hbmap_iter k = hbmap_find(cpp->resolved, key);
+	if(k != (hbmap_iter) -1) {
+		cpp->stats.resolve_hits++;
+		return hbmap_getval(cpp->resolved, k);
+	}
+	char *path = 0;
+	if(name[0] == '/') {
+		if((size_t) snprintf(buf, sizeof buf, "%s", name) < sizeof buf) {
+			canonicalize_path(buf);
+			if(stat_file(cpp, buf, &id)) path = strdup(buf);
+		}
+	} else if(quoted && probe(cpp, buf, sizeof buf, dir, name)) {
+		path = strdup(buf);
+	} else tglist_foreach(&cpp->includedirs, i) {
+		if(probe(cpp, buf, sizeof buf, tglist_get(&cpp->includedirs, i), name)) {
+			path = strdup(buf);
+			break;
+		}
+	}
+	hbmap_insert(cpp->resolved, strdup(key), path);
+	return path;
+}
+
+/* without a callback, diagnostics go to stderr in a single write */
+static void print_diag(const struct cpp_diag *d) {
+	struct cpp_sink s;
+	char buf[64];
+	cpp_sink_init_fd(&s, 2);
+	cpp_sink_putc(&s, '<');
+	cpp_sink_puts(&s, d->file);
+	snprintf(buf, sizeof buf, "> %u:%u %s: '", d->line, d->column, d->is_error ? "error" : "warning");
+	cpp_sink_puts(&s, buf);
+	cpp_sink_puts(&s, d->msg);
+	cpp_sink_puts(&s, "'\n");
+	cpp_sink_puts(&s, d->text);
+	cpp_sink_putc(&s, '\n');
+	cpp_sink_fill(&s, '^', strlen(d->text));
+	cpp_sink_putc(&s, '\n');
+	cpp_sink_fini(&s);
+}
+
+static void report_diag(struct cpp *cpp, const struct cpp_diag *d) {
+	if(cpp->diag) cpp->diag(cpp->diag_ctx, d);
+	else print_diag(d);
+}
+
+static void error_or_warning(struct cpp *cpp, const char *err, int is_error, struct tokenizer *t, struct token *curr) {
+	struct cpp_diag d = {
+		.is_error = is_error,
+		.file = t->filename,
+		.line = curr ? curr->line : t->line,
+		.column = curr ? curr->column : t->column,
+		.msg = err,
+		.text = t->buf,
+	};
+	report_diag(cpp, &d);
 }
-static void error(const char *err, struct tokenizer *t, struct token *curr) {
-	error_or_warning(err, "error", t, curr);
+static void error(struct cpp *cpp, const char *err, struct tokenizer *t, struct token *curr) {
+	error_or_warning(cpp, err, 1, t, curr);
 }
-static void warning(const char *err, struct tokenizer *t, struct token *curr) {
-	error_or_warning(err, "warning", t, curr);
+static void warning(struct cpp *cpp, const char *err, struct tokenizer *t, struct token *curr) {
+	error_or_warning(cpp, err, 0, t, curr);
 }
 
-static void emit(FILE *out, const char *s) {
-	fprintf(out, "%s", s);
+static void emit(struct cpp_sink *out, const char *s) {
+	cpp_sink_puts(out, s);
 }
 
-static int x_tokenizer_next_of(struct tokenizer *t, struct token *tok, int fail_unk) {
+static int x_tokenizer_next_of(struct cpp *cpp, struct tokenizer *t, struct token *tok, int fail_unk) {
 	int ret = tokenizer_next(t, tok);
 	if(tok->type == TT_OVERFLOW) {
-		error("max token length of 4095 exceeded!", t, tok);
+		error(cpp, "max token length of 4095 exceeded!", t, tok);
 		return 0;
 	} else if (fail_unk && ret == 0) {
-		error("tokenizer encountered unknown token", t, tok);
+		error(cpp, "tokenizer encountered unknown token", t, tok);
 		return 0;
 	}
 	return 1;
 }
 
-#define tokenizer_next(T, TOK) x_tokenizer_next_of(T, TOK, 0)
-#define x_tokenizer_next(T, TOK) x_tokenizer_next_of(T, TOK, 1)
+/* these report errors to the cpp in scope */
+#define tokenizer_next(T, TOK) x_tokenizer_next_of(cpp, T, TOK, 0)
+#define x_tokenizer_next(T, TOK) x_tokenizer_next_of(cpp, T, TOK, 1)
 
 static int is_whitespace_token(struct token *token)
 {
@@ -145,7 +782,7 @@ static int is_whitespace_token(struct token *token)
 }
 
 /* return index of matching item in values array, or -1 on error */
-static int expect(struct tokenizer *t, enum tokentype tt, const char* values[], struct token *token)
+static int expect(struct cpp *cpp, struct tokenizer *t, enum tokentype tt, const char* values[], struct token *token)
 {
 	int ret;
 	do {
@@ -155,7 +792,7 @@ static int expect(struct tokenizer *t, enum tokentype tt, const char* values[],
 
 	if(token->type != tt) {
 err:
-		error("unexpected token", t, token);
+		error(cpp, "unexpected token", t, token);
 		return -1;
 	}
 	int i = 0;
@@ -171,15 +808,15 @@ static int is_char(struct token *tok, int ch) {
 	return tok->type == TT_SEP && tok->value == ch;
 }
 
-static void flush_whitespace(FILE *out, int *ws_count) {
-	while(*ws_count > 0) {
-		emit(out, " ");
-		--(*ws_count);
+static void flush_whitespace(struct cpp_sink *out, int *ws_count) {
+	if(*ws_count > 0) {
+		cpp_sink_fill(out, ' ', *ws_count);
+		*ws_count = 0;
 	}
 }
 
 /* skips until the next non-whitespace token (if the current one is one too)*/
-static int eat_whitespace(struct tokenizer *t, struct token *token, int *count) {
+static int eat_whitespace(struct cpp *cpp, struct tokenizer *t, struct token *token, int *count) {
 	*count = 0;
 	int ret = 1;
 	while (is_whitespace_token(token)) {
@@ -190,86 +827,281 @@ static int eat_whitespace(struct tokenizer *t, struct token *token, int *count)
 	return ret;
 }
 /* fetches the next token until it is non-whitespace */
-static int skip_next_and_ws(struct tokenizer *t, struct token *tok) {
+static int skip_next_and_ws(struct cpp *cpp, struct tokenizer *t, struct token *tok) {
 	int ret = tokenizer_next(t, tok);
 	if(!ret) return ret;
 	int ws_count;
-	ret = eat_whitespace(t, tok, &ws_count);
+	ret = eat_whitespace(cpp, t, tok, &ws_count);
 	return ret;
 }
 
-static void emit_token(FILE* out, struct token *tok, const char* strbuf) {
+/* cpp_run_tokens() output. tokens are collected with their spelling
+   and passed on in batches. text written to the sink itself, i.e. by
+   emit() and flush_whitespace(), is lexed when the origin changes. */
+#define TOKEN_BATCH 256
+
+struct token_out {
+	cpp_token_func fn;
+	void *ctx;
+	struct cpp_token batch[TOKEN_BATCH];
+	size_t text[TOKEN_BATCH], file[TOKEN_BATCH]; /* offsets into strings */
+	size_t count;
+	struct cpp_sink strings;
+	const char *origin_file;
+	unsigned origin_line, origin_inclusion;
+	int origin_macro;
+	size_t file_off; /* of origin_file in strings, -1 if not yet there */
+	int error;
+};
+
+static void deliver_tokens(struct token_out *to) {
+	size_t i, len;
+	const char *s = cpp_sink_data(&to->strings, &len);
+	for(i = 0; i < to->count; i++) {
+		to->batch[i].text = s + to->text[i];
+		to->batch[i].file = s + to->file[i];
+	}
+	if(to->count && !to->error && !to->fn(to->ctx, to->batch, to->count))
+		to->error = 1;
+	to->count = 0;
+	to->file_off = -1;
+	cpp_sink_clear(&to->strings);
+}
+
+static void add_token(struct token_out *to, struct token *tok, const char *text, size_t len) {
+	if(to->count == TOKEN_BATCH) deliver_tokens(to);
+	if(to->file_off == (size_t) -1) {
+		to->file_off = to->strings.len;
+		cpp_sink_write(&to->strings, to->origin_file, strlen(to->origin_file) + 1);
+	}
+	to->batch[to->count] = (struct cpp_token) {
+		.type = tok->type, .value = tok->value, .len = len,
+		.line = to->origin_line, .inclusion = to->origin_inclusion,
+		.from_macro = to->origin_macro,
+	};
+	to->text[to->count] = to->strings.len;
+	to->file[to->count] = to->file_off;
+	cpp_sink_write(&to->strings, text, len);
+	cpp_sink_putc(&to->strings, 0);
+	to->count++;
+}
+
+static void emit_token(struct cpp_sink *out, struct token *tok, const char* strbuf);
+
+/* lex the text written to a token sink since the last call */
+static void flush_text(struct cpp_sink *out) {
+	struct tokenizer t;
+	struct token tok;
+	int ret;
+	if(!out->len) return;
+	tokenizer_from_sink(&t, out);
+	/* emit_token() mustn't come back here */
+	out->len = 0;
+	while(1) {
+		ret = (tokenizer_next)(&t, &tok);
+		if(tok.type == TT_EOF || (!ret && tok.type != TT_UNKNOWN)) break;
+		emit_token(out, &tok, t.buf);
+	}
+}
+
+/* where what is emitted to out next comes from */
+static void token_origin(struct cpp_sink *out, const char *file, unsigned line, unsigned inclusion, int macro) {
+	struct token_out *to = out->tokens;
+	flush_text(out);
+	if(file != to->origin_file) to->file_off = -1;
+	to->origin_file = file;
+	to->origin_line = line;
+	to->origin_inclusion = inclusion;
+	to->origin_macro = macro;
+}
+
+/* what follows comes from expanding a macro at the current origin */
+static void token_origin_macro(struct cpp_sink *out) {
+	struct token_out *to = out->tokens;
+	token_origin(out, to->origin_file, to->origin_line, to->origin_inclusion, 1);
+}
+
+static void emit_token(struct cpp_sink *out, struct token *tok, const char* strbuf) {
+	if(out->tokens) {
+		char c = tok->value;
+		flush_text(out);
+		if(tok->type == TT_SEP) add_token(out->tokens, tok, &c, 1);
+		else if(strbuf && token_needs_string(tok)) add_token(out->tokens, tok, strbuf, strlen(strbuf));
+		return;
+	}
+	/* other types, TT_EOF, have no text. overflows are reported where
+	   they are lexed. */
 	if(tok->type == TT_SEP) {
-		fprintf(out, "%c", tok->value);
+		cpp_sink_putc(out, tok->value);
 	} else if(strbuf && token_needs_string(tok)) {
-		fprintf(out, "%s", strbuf);
-	} else {
-		dprintf(2, "oops, dunno how to handle tt %d (%s)\n", (int) tok->type, strbuf);
+		cpp_sink_puts(out, strbuf);
 	}
 }
 
-int parse_file(struct cpp* cpp, FILE *f, const char*, FILE *out);
-static int include_file(struct cpp* cpp, struct tokenizer *t, FILE* out) {
+static int push_frame(struct cpp *cpp, FILE *in, const struct filecache_file *f, const char *fn, const char *path, const struct filecache_key *id);
+static int push_virtual(struct cpp *cpp, struct virtual_file *vf, const char *name);
+static int feed_cut(struct cpp *cpp, struct tokenizer *t);
+
+static void free_tokcache(void *tc) {
+	tokcache_free(tc);
+}
+
+static int wants_prelex(struct cpp *cpp, size_t size) {
+	return cpp->lex_threads && size >= PRELEX_MIN_SIZE && size <= UINT32_MAX;
+}
+
+/* replay f's tokens from the token cache if possible, else arrange for
+   them to be recorded. returns the writer to pass to tokcache_writer_finish(). */
+static struct tokcache_writer *setup_token_cache(struct cpp *cpp, struct tokenizer *t, const struct filecache_file *f) {
+	struct tokcache *tc;
+	struct tokcache_writer *w;
+	if(!cpp->token_cache) return 0;
+	if(!(tc = filecache_get_aux(f, FILECACHE_AUX_TOKENS)) &&
+	   (tc = tokcache_open(cpp->token_cache, f->data, f->size)))
+		tc = filecache_set_aux(f, FILECACHE_AUX_TOKENS, tc, free_tokcache);
+	if(tc) {
+		cpp->stats.token_cache_hits++;
+		tokenizer_set_replay(t, tc->records, tc->count, tc->strings);
+		return 0;
+	}
+	/* records store 32 bit offsets. large files are lexed in parallel
+	   instead, which leaves nothing to record. */
+	if(f->size > UINT32_MAX || wants_prelex(cpp, f->size) || !(w = tokcache_writer_new())) return 0;
+	tokenizer_set_recorder(t, tokcache_record, w);
+	return w;
+}
+
+static const char *intern_name(struct cpp *cpp, const char *name) {
+	hbmap_iter k = hbmap_find(cpp->names, (char*) name);
+	char *n;
+	if(k != (hbmap_iter) -1) return hbmap_getkey(cpp->names, k);
+	if(!(n = strdup(name))) return 0;
+	hbmap_insert(cpp->names, n, 0);
+	return n;
+}
+
+static int include_file(struct cpp* cpp, struct tokenizer *t, struct cpp_sink *out) {
 	static const char* inc_chars[] = { "\"", "<", 0};
 	static const char* inc_chars_end[] = { "\"", ">", 0};
 	struct token tok;
 	tokenizer_set_flags(t, 0); // disable string tokenization
 
-	int inc1sep = expect(t, TT_SEP, inc_chars, &tok);
+	int inc1sep = expect(cpp, t, TT_SEP, inc_chars, &tok);
 	if(inc1sep == -1) {
-		error("expected one of [\"<]", t, &tok);
+		error(cpp, "expected one of [\"<]", t, &tok);
 		return 0;
 	}
 	int ret = tokenizer_read_until(t, inc_chars_end[inc1sep], 1);
 	if(!ret) {
-		error("error parsing filename", t, &tok);
+		error(cpp, "error parsing filename", t, &tok);
 		return 0;
 	}
-	// TODO: different path lookup depending on whether " or <
-	size_t i;
-	FILE *f = 0;
-	tglist_foreach(&cpp->includedirs, i) {
-		char buf[512];
-		snprintf(buf, sizeof buf, "%s/%s", tglist_get(&cpp->includedirs, i), t->buf);
-		f = fopen(buf, "r");
-		if(f) break;
-	}
-	if(!f) {
-		dprintf(2, "%s: ", t->buf);
-		perror("fopen");
+	const struct filecache_file *f = 0;
+	char buf[PATH_MAX];
+	struct include_guard *g = 0;
+	struct filecache_key id;
+	int once = 0;
+	hbmap_iter vk = hbmap_find(cpp->virtuals, t->buf);
+	struct virtual_file *vf = vk == (hbmap_iter) -1 ? 0 : hbmap_getval(cpp->virtuals, vk);
+	/* registered headers keep their state in the base instance */
+	if(cpp->spec && hbmap_find(cpp->spec_base->virtuals, t->buf) != (hbmap_iter) -1) {
+		cpp->spec_failed = 1;
+		return 0;
+	}
+	const char *path = vf ? 0 : resolve_include(cpp, t->buf, inc1sep == 0);
+	if(vf) {
+		g = vf->guard.macro && get_macro(cpp, vf->guard.macro) ? &vf->guard : 0;
+		once = vf->once;
+	} else if(path) {
+		/* the path may be freed if the include dirs change */
+		snprintf(buf, sizeof buf, "%s", path);
+		if(!(g = hbmap_get(cpp->guards, buf)) && cpp->spec)
+			g = hbmap_get(cpp->spec_base->guards, buf);
+		if(!(g && get_macro(cpp, g->macro))) {
+			g = 0;
+			if(stat_file(cpp, buf, &id) && !(once = is_once(cpp, buf, &id)) &&
+			   (f = filecache_get(buf, &id))) {
+				struct file_stamp fs = {
+					.size = f->key.size,
+					.mtime_sec = f->key.mtime_sec,
+					.mtime_nsec = f->key.mtime_nsec,
+				};
+				add_dependency_stamp(cpp, buf, &fs);
+			}
+		}
+		if(cpp->spec) spec_include(cpp, buf, g ? 'g' : once ? 'o' : 'e');
+	} else errno = ENOENT;
+	if(!vf && !f && !g && !once) {
+		error(cpp, errno == ENOENT ? "file not found" : "can't read file", t, &tok);
 		return 0;
 	}
-	const char *fn = strdup(t->buf);
+	const char *fn = f ? intern_name(cpp, t->buf) : vf ? hbmap_getkey(cpp->virtuals, vk) : 0;
+	if(f && !fn) return 0;
 	assert(tokenizer_next(t, &tok) && is_char(&tok, inc_chars_end[inc1sep][0]));
 
 	tokenizer_set_flags(t, TF_PARSE_STRINGS);
-	return parse_file(cpp, f, fn, out);
+	cpp->stats.includes++;
+	if(g) {
+		cpp->stats.guard_skips++;
+		emit(out, g->output);
+		return 1;
+	}
+	if(once) {
+		cpp->stats.once_skips++;
+		return 1;
+	}
+	if(vf) return push_virtual(cpp, vf, fn);
+	return push_frame(cpp, 0, f, fn, buf, &id);
 }
 
-static int emit_error_or_warning(struct tokenizer *t, int is_error) {
+static int emit_error_or_warning(struct cpp *cpp, struct tokenizer *t, int is_error) {
 	int ws_count;
 	int ret = tokenizer_skip_chars(t, " \t", &ws_count);
 	if(!ret) return ret;
 	struct token tmp = {.column = t->column, .line = t->line};
 	ret = tokenizer_read_until(t, "\n", 1);
 	if(is_error) {
-		error(t->buf, t, &tmp);
+		error(cpp, t->buf, t, &tmp);
 		return 0;
 	}
-	warning(t->buf, t, &tmp);
+	warning(cpp, t->buf, t, &tmp);
 	return 1;
 }
 
-static FILE *freopen_r(FILE *f, char **buf, size_t *size) {
-	fflush(f);
-	fclose(f);
-	return fmemopen(*buf, *size, "r");
+/* forward a pragma to the output, apart from "#pragma once",
+   which sets *once instead */
+static int parse_pragma(struct cpp *cpp, struct tokenizer *t, struct cpp_sink *out, int *once) {
+	struct token tok;
+	char ws[256];
+	size_t n = 0;
+	int ret;
+	while((ret = x_tokenizer_next(t, &tok)) && is_whitespace_token(&tok) && n < sizeof ws - 1)
+		ws[n++] = tok.value;
+	if(!ret) return ret;
+	ws[n] = 0;
+	if(tok.type == TT_IDENTIFIER && !strcmp(t->buf, "once")) {
+		*once = 1;
+		while((ret = x_tokenizer_next(t, &tok)) && tok.type != TT_EOF)
+			if(is_char(&tok, '\n')) {
+				emit(out, "\n");
+				break;
+			}
+		return ret;
+	}
+	emit(out, "#pragma");
+	emit(out, ws);
+	while(ret && tok.type != TT_EOF) {
+		emit_token(out, &tok, t->buf);
+		if(is_char(&tok, '\n')) break;
+		ret = x_tokenizer_next(t, &tok);
+	}
+	return ret;
 }
 
-static int consume_nl_and_ws(struct tokenizer *t, struct token *tok, int expected) {
+static int consume_nl_and_ws(struct cpp *cpp, struct tokenizer *t, struct token *tok, int expected) {
 	if(!x_tokenizer_next(t, tok)) {
 err:
-		error("unexpected", t, tok);
+		error(cpp, "unexpected", t, tok);
 		return 0;
 	}
 	if(expected) {
@@ -283,10 +1115,10 @@ err:
 		else if(is_char(tok, '\\')) expected = '\n';
 		else return 1;
 	}
-	return consume_nl_and_ws(t, tok, expected);
+	return consume_nl_and_ws(cpp, t, tok, expected);
 }
 
-static int expand_macro(struct cpp *cpp, struct tokenizer *t, FILE* out, const char* name, unsigned rec_level, char *visited[]);
+static int expand_macro(struct cpp *cpp, struct tokenizer *t, struct cpp_sink *out, const char* name, unsigned rec_level, char *visited[]);
 
 static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 	int ws_count;
@@ -295,42 +1127,42 @@ static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 	struct token curr; //tmp = {.column = t->column, .line = t->line};
 	ret = tokenizer_next(t, &curr) && curr.type != TT_EOF;
 	if(!ret) {
-		error("parsing macro name", t, &curr);
+		error(cpp, "parsing macro name", t, &curr);
 		return ret;
 	}
 	if(curr.type != TT_IDENTIFIER) {
-		error("expected identifier", t, &curr);
+		error(cpp, "expected identifier", t, &curr);
 		return 0;
 	}
-	const char* macroname = strdup(t->buf);
+	char* macroname = strdup(t->buf);
+	if(!macroname) return 0;
 #ifdef DEBUG
 	dprintf(2, "parsing macro %s\n", macroname);
 #endif
+	struct macro new = { 0 };
+	unsigned macro_flags = MACRO_FLAG_OBJECTLIKE;
+	size_t i;
 	int redefined = 0;
 	if(get_macro(cpp, macroname)) {
 		if(!strcmp(macroname, "defined")) {
-			error("\"defined\" cannot be used as a macro name", t, &curr);
-			return 0;
+			error(cpp, "\"defined\" cannot be used as a macro name", t, &curr);
+			goto fail;
 		}
 		redefined = 1;
 	}
 
-	struct macro new = { 0 };
-	unsigned macro_flags = MACRO_FLAG_OBJECTLIKE;
-	tglist_init(&new.argnames);
-
 	ret = x_tokenizer_next(t, &curr) && curr.type != TT_EOF;
-	if(!ret) return ret;
+	if(!ret) goto fail;
 
 	if (is_char(&curr, '(')) {
 		macro_flags = 0;
 		unsigned expected = 0;
 		while(1) {
 			/* process next function argument identifier */
-			ret = consume_nl_and_ws(t, &curr, expected);
+			ret = consume_nl_and_ws(cpp, t, &curr, expected);
 			if(!ret) {
-				error("unexpected", t, &curr);
-				return ret;
+				error(cpp, "unexpected", t, &curr);
+				goto fail;
 			}
 			expected = 0;
 			if(curr.type == TT_SEP) {
@@ -342,65 +1174,65 @@ static int parse_macro(struct cpp *cpp, struct tokenizer *t) {
 					continue;
 				case ')':
 					ret = tokenizer_skip_chars(t, " \t", &ws_count);
-					if(!ret) return ret;
+					if(!ret) goto fail;
 					goto break_loop1;
 				default:
-					error("unexpected character", t, &curr);
-					return 0;
+					error(cpp, "unexpected character", t, &curr);
+					goto fail;
 				}
 			} else if(!(curr.type == TT_IDENTIFIER || curr.type == TT_ELLIPSIS)) {
-				error("expected identifier for macro arg", t, &curr);
-				return 0;
+				error(cpp, "expected identifier for macro arg", t, &curr);
+				goto fail;
 			}
 			{
 				if(curr.type == TT_ELLIPSIS) {
 					if(macro_flags & MACRO_FLAG_VARIADIC) {
-						error("\"...\" isn't the last parameter", t, &curr);
-						return 0;
+						error(cpp, "\"...\" isn't the last parameter", t, &curr);
+						goto fail;
 					}
 					macro_flags |= MACRO_FLAG_VARIADIC;
 				}
-				char *tmps = strdup(t->buf);
-				tglist_add(&new.argnames, tmps);
+				char **tmpa = realloc(new.argnames, (new.num_args + 1) * sizeof(char*));
+				if(!tmpa) goto fail;
+				new.argnames = tmpa;
+				if(!(new.argnames[new.num_args] = strdup(t->buf))) goto fail;
 			}
 			++new.num_args;
 		}
 		break_loop1:;
 	} else if(is_whitespace_token(&curr)) {
 		ret = tokenizer_skip_chars(t, " \t", &ws_count);
-		if(!ret) return ret;
+		if(!ret) goto fail;
 	} else if(is_char(&curr, '\n')) {
 		/* content-less macro */
 		goto done;
 	}
 
-	struct FILE_container {
-		FILE *f;
-		char *buf;
-		size_t len;
-        } contents;
-	contents.f = open_memstream(&contents.buf, &contents.len);
+	struct cpp_sink contents;
+	cpp_sink_init_mem(&contents);
 
 	int backslash_seen = 0;
 	while(1) {
 		/* ignore unknown tokens in macro body */
 		ret = tokenizer_next(t, &curr);
-		if(!ret) return 0;
+		if(!ret) {
+			cpp_sink_fini(&contents);
+			goto fail;
+		}
 		if(curr.type == TT_EOF) break;
 		if (curr.type == TT_SEP) {
 			if(curr.value == '\\')
 				backslash_seen = 1;
 			else {
 				if(curr.value == '\n' && !backslash_seen) break;
-				emit_token(contents.f, &curr, t->buf);
+				emit_token(&contents, &curr, t->buf);
 				backslash_seen = 0;
 			}
 		} else {
-			emit_token(contents.f, &curr, t->buf);
+			emit_token(&contents, &curr, t->buf);
 		}
 	}
-	new.str_contents = freopen_r(contents.f, &contents.buf, &contents.len);
-	new.str_contents_buf = contents.buf;
+	new.str_contents_buf = cpp_sink_take(&contents, &new.str_contents_len);
 done:
 	if(redefined) {
 		struct macro *old = get_macro(cpp, macroname);
@@ -408,19 +1240,24 @@ done:
 		char *s_new = new.str_contents_buf ? new.str_contents_buf : "";
 		if(strcmp(s_old, s_new)) {
 			char buf[128];
-			sprintf(buf, "redefinition of macro %s", macroname);
-			warning(buf, t, 0);
+			snprintf(buf, sizeof buf, "redefinition of macro %s", macroname);
+			warning(cpp, buf, t, 0);
 		}
 	}
 	new.num_args |= macro_flags;
 	add_macro(cpp, macroname, &new);
 	return 1;
+fail:
+	free(macroname);
+	for(i = 0; i < new.num_args; i++) free(new.argnames[i]);
+	free(new.argnames);
+	return 0;
 }
 
 static size_t macro_arglist_pos(struct macro *m, const char* iden) {
 	size_t i;
-	for(i = 0; i < tglist_getsize(&m->argnames); i++) {
-		char *item = tglist_get(&m->argnames, i);
+	for(i = 0; i < MACRO_ARGCOUNT(m); i++) {
+		char *item = m->argnames[i];
 		if(!strcmp(item, iden)) return i;
 	}
 	return (size_t) -1;
@@ -458,10 +1295,11 @@ unsigned get_macro_info(struct cpp* cpp,
 #endif
 		struct macro* m = 0;
 		if(tok.type == TT_IDENTIFIER && (m = get_macro(cpp, t->buf)) && !was_visited(t->buf, visited, rec_level)) {
-			const char* newname = strdup(t->buf);
+			const char* newname;
 			if(FUNCTIONLIKE(m)) {
 				if(tokenizer_peek(t) == '(') {
 					unsigned tpos_save = tpos;
+					newname = strdup(t->buf);
 					tpos = get_macro_info(cpp, t, mi_list, mi_cnt, nest+1, tpos+1, newname, visited, rec_level);
 					mi_list[*mi_cnt] = (struct macro_info) {
 						.name = newname,
@@ -473,6 +1311,7 @@ unsigned get_macro_info(struct cpp* cpp,
 					/* suppress expansion */
 				}
 			} else {
+				newname = strdup(t->buf);
 				mi_list[*mi_cnt] = (struct macro_info) {
 					.name = newname,
 					.nest=nest+1,
@@ -491,23 +1330,20 @@ unsigned get_macro_info(struct cpp* cpp,
 	return tpos;
 }
 
-struct FILE_container {
-	FILE *f;
-	char *buf;
-	size_t len;
+struct mem_container {
+	struct cpp_sink s;
 	struct tokenizer t;
 };
 
-static void free_file_container(struct FILE_container *fc) {
-	fclose(fc->f);
-	free(fc->buf);
+static void free_mem_container(struct mem_container *mc) {
+	cpp_sink_fini(&mc->s);
 }
 
-static int mem_tokenizers_join(
-	struct FILE_container* org, struct FILE_container *inj,
-	struct FILE_container* result,
+static int mem_tokenizers_join(struct cpp *cpp,
+	struct mem_container* org, struct mem_container *inj,
+	struct mem_container* result,
 	int first, off_t lastpos) {
-	result->f = open_memstream(&result->buf, &result->len);
+	cpp_sink_init_mem(&result->s);
 	size_t i;
 	struct token tok;
 	int ret;
@@ -515,13 +1351,13 @@ static int mem_tokenizers_join(
 	for(i=0; i<first; ++i) {
 		ret = tokenizer_next(&org->t, &tok);
 		assert(ret && tok.type != TT_EOF);
-		emit_token(result->f, &tok, org->t.buf);
+		emit_token(&result->s, &tok, org->t.buf);
 	}
 	int cnt = 0, last = first;
 	while(1) {
 		ret = tokenizer_next(&inj->t, &tok);
 		if(!ret || tok.type == TT_EOF) break;
-		emit_token(result->f, &tok, inj->t.buf);
+		emit_token(&result->s, &tok, inj->t.buf);
 		++cnt;
 	}
 	while(tokenizer_ftello(&org->t) < lastpos) {
@@ -534,11 +1370,10 @@ static int mem_tokenizers_join(
 	while(1) {
 		ret = tokenizer_next(&org->t, &tok);
 		if(!ret || tok.type == TT_EOF) break;
-		emit_token(result->f, &tok, org->t.buf);
+		emit_token(&result->s, &tok, org->t.buf);
 	}
 
-	result->f = freopen_r(result->f, &result->buf, &result->len);
-	tokenizer_from_file(&result->t, result->f);
+	tokenizer_from_sink(&result->t, &result->s);
 	return diff;
 }
 
@@ -553,7 +1388,7 @@ static int tchain_parens_follows(struct cpp *cpp, int rec_level) {
 	return -1;
 }
 
-static int stringify(struct cpp *ccp, struct tokenizer *t, FILE* output) {
+static int stringify(struct cpp *cpp, struct tokenizer *t, struct cpp_sink *output) {
 	int ret = 1;
 	struct token tok;
 	emit(output, "\"");
@@ -564,19 +1399,14 @@ static int stringify(struct cpp *ccp, struct tokenizer *t, FILE* output) {
 		if(is_char(&tok, '\n')) continue;
 		if(is_char(&tok, '\\') && tokenizer_peek(t) == '\n') continue;
 		if(tok.type == TT_DQSTRING_LIT) {
-			char *s = t->buf;
-			char buf[2] = {0};
-			while(*s) {
-				if(*s == '\"') {
-					emit(output, "\\\"");
-				} else if (*s == '\\') {
-					emit(output, "\\\\");
-				} else {
-					buf[0] = *s;
-					emit(output, buf);
-				}
-				++s;
+			/* escape " and \, copying the runs between them */
+			const char *s = t->buf, *run = s;
+			for(; *s; ++s) if(*s == '\"' || *s == '\\') {
+				cpp_sink_write(output, run, s - run);
+				cpp_sink_putc(output, '\\');
+				run = s;
 			}
+			cpp_sink_write(output, run, s - run);
 		} else
 			emit_token(output, &tok, t->buf);
 	}
@@ -587,7 +1417,7 @@ static int stringify(struct cpp *ccp, struct tokenizer *t, FILE* output) {
 /* rec_level -1 serves as a magic value to signal we're using
    expand_macro from the if-evaluator code, which means activating
    the "define" macro */
-static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const char* name, unsigned rec_level, char* visited[]) {
+static int expand_macro(struct cpp* cpp, struct tokenizer *t, struct cpp_sink *out, const char* name, unsigned rec_level, char* visited[]) {
 	int is_define = !strcmp(name, "defined");
 
 	struct macro *m;
@@ -600,7 +1430,7 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 	}
 	if(rec_level == -1) rec_level = 0;
 	if(rec_level >= MAX_RECURSION) {
-		error("max recursion level reached", t, 0);
+		error(cpp, "max recursion level reached", t, 0);
 		return 0;
 	}
 #ifdef DEBUG
@@ -611,6 +1441,7 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 		cpp->last_file = t->filename;
 		cpp->last_line = t->line;
 	}
+	if(out->tokens && !FUNCTIONLIKE(m)) token_origin_macro(out);
 	if(!strcmp(name, "__FILE__")) {
 		emit(out, "\"");
 		emit(out, cpp->last_file);
@@ -630,10 +1461,15 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 	size_t i;
 	struct token tok;
 	unsigned num_args = MACRO_ARGCOUNT(m);
-	struct FILE_container *argvalues = calloc(MACRO_VARIADIC(m) ? num_args + 1 : num_args, sizeof(struct FILE_container));
+	struct mem_container *argvalues = calloc(MACRO_VARIADIC(m) ? num_args + 1 : num_args, sizeof(struct mem_container));
 
+	struct mem_container cwae; /* contents_with_args_expanded */
+	struct macro_info *mcs = 0;
+	size_t nmcs = 0;
+	int ok = 1;
 	for(i=0; i < num_args; i++)
-		argvalues[i].f = open_memstream(&argvalues[i].buf, &argvalues[i].len);
+		cpp_sink_init_mem(&argvalues[i].s);
+	cpp_sink_init_mem(&cwae.s);
 
 	/* replace named arguments in the contents of the macro call */
 	if(FUNCTIONLIKE(m)) {
@@ -641,27 +1477,38 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 		if((ret = tokenizer_peek(t)) != '(') {
 			/* function-like macro shall not be expanded if not followed by '(' */
 			if(ret == EOF && rec_level > 0 && (ret = tchain_parens_follows(cpp, rec_level-1)) != -1) {
-				// warning("Replacement text involved subsequent text", t, 0);
+				// warning(cpp, "Replacement text involved subsequent text", t, 0);
 				t = cpp->tchain[ret];
 			} else {
 				emit(out, name);
 				goto cleanup;
 			}
 		}
+		if(out->tokens) token_origin_macro(out);
 		ret = x_tokenizer_next(t, &tok);
 		assert(ret && is_char(&tok, '('));
 
 		unsigned curr_arg = 0, need_arg = 1, parens = 0;
 		int ws_count;
-		if(!tokenizer_skip_chars(t, " \t", &ws_count)) return 0;
+		if(!tokenizer_skip_chars(t, " \t", &ws_count)) goto fail;
 
 		int varargs = 0;
 		if(num_args == 1 && MACRO_VARIADIC(m)) varargs = 1;
 		while(1) {
 			int ret = tokenizer_next(t, &tok);
-			if(!ret) return 0;
+			if(!ret) goto fail;
 			if( tok.type == TT_EOF) {
-				dprintf(2, "warning EOF\n");
+				/* the fed input goes on past the limit. only the
+				   outermost call has written nothing yet. */
+				if(feed_cut(cpp, t)) {
+					if(rec_level) {
+						error(cpp, "macro call runs past the input processed so far", t, &tok);
+						goto fail;
+					}
+					cpp->feed_wait = t->mem_size;
+					goto cleanup;
+				}
+				warning(cpp, "unterminated macro call", t, &tok);
 				break;
 			}
 			if(!parens && is_char(&tok, ',') && !varargs) {
@@ -673,19 +1520,19 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 				if(curr_arg + 1 == num_args && MACRO_VARIADIC(m)) {
 					varargs = 1;
 				} else if(curr_arg >= num_args) {
-					error("too many arguments for function macro", t, &tok);
-					return 0;
+					error(cpp, "too many arguments for function macro", t, &tok);
+					goto fail;
 				}
 				ret = tokenizer_skip_chars(t, " \t", &ws_count);
-				if(!ret) return ret;
+				if(!ret) goto fail;
 				continue;
 			} else if(is_char(&tok, '(')) {
 				++parens;
 			} else if(is_char(&tok, ')')) {
 				if(!parens) {
 					if(curr_arg + num_args && curr_arg < num_args-1) {
-						error("too few args for function macro", t, &tok);
-						return 0;
+						error(cpp, "too few args for function macro", t, &tok);
+						goto fail;
 					}
 					break;
 				}
@@ -694,39 +1541,36 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 				if(tokenizer_peek(t) == '\n') continue;
 			}
 			need_arg = 0;
-			emit_token(argvalues[curr_arg].f, &tok, t->buf);
+			emit_token(&argvalues[curr_arg].s, &tok, t->buf);
 		}
 	}
 
 	for(i=0; i < num_args; i++) {
-		argvalues[i].f = freopen_r(argvalues[i].f, &argvalues[i].buf, &argvalues[i].len);
-		tokenizer_from_file(&argvalues[i].t, argvalues[i].f);
+		tokenizer_from_sink(&argvalues[i].t, &argvalues[i].s);
 #ifdef DEBUG
-		dprintf(2, "macro argument %i: %s\n", (int) i, argvalues[i].buf);
+		dprintf(2, "macro argument %i: %s\n", (int) i, cpp_sink_data(&argvalues[i].s, 0));
 #endif
 	}
 
 	if(is_define) {
-		if(get_macro(cpp, argvalues[0].buf))
+		if(get_macro(cpp, cpp_sink_data(&argvalues[0].s, 0)))
 			emit(out, "1");
 		else
 			emit(out, "0");
 	}
 
-	if(!m->str_contents) goto cleanup;
+	if(!m->str_contents_buf) goto cleanup;
 
-	struct FILE_container cwae = {0}; /* contents_with_args_expanded */
-	cwae.f = open_memstream(&cwae.buf, &cwae.len);
-	FILE* output = cwae.f;
+	struct cpp_sink *output = &cwae.s;
 
 	struct tokenizer t2;
-	tokenizer_from_file(&t2, m->str_contents);
+	tokenizer_from_mem(&t2, m->str_contents_buf, m->str_contents_len);
 	int hash_count = 0;
 	int ws_count = 0;
 	while(1) {
 		int ret;
 		ret = tokenizer_next(&t2, &tok);
-		if(!ret) return 0;
+		if(!ret) goto fail;
 		if(tok.type == TT_EOF) break;
 		if(tok.type == TT_IDENTIFIER) {
 			flush_whitespace(output, &ws_count);
@@ -740,7 +1584,7 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 				if(hash_count == 1) ret = stringify(cpp, &argvalues[arg_nr].t, output);
 				else while(1) {
 					ret = tokenizer_next(&argvalues[arg_nr].t, &tok);
-					if(!ret) return ret;
+					if(!ret) goto fail;
 					if(tok.type == TT_EOF) break;
 					emit_token(output, &tok, argvalues[arg_nr].t.buf);
 				}
@@ -748,8 +1592,8 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 			} else {
 				if(hash_count == 1) {
 		hash_err:
-					error("'#' is not followed by macro parameter", &t2, &tok);
-					return 0;
+					error(cpp, "'#' is not followed by macro parameter", &t2, &tok);
+					goto fail;
 				}
 				emit_token(output, &tok, t2.buf);
 			}
@@ -768,15 +1612,15 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 			}
 			if(hash_count == 1) flush_whitespace(output, &ws_count);
 			else if(hash_count > 2) {
-				error("only two '#' characters allowed for macro expansion", &t2, &tok);
-				return 0;
+				error(cpp, "only two '#' characters allowed for macro expansion", &t2, &tok);
+				goto fail;
 			}
 			if(hash_count == 2)
 				ret = tokenizer_skip_chars(&t2, " \t\n", &ws_count);
 			else
 				ret = tokenizer_skip_chars(&t2, " \t", &ws_count);
 
-			if(!ret) return ret;
+			if(!ret) goto fail;
 			ws_count = 0;
 
 		} else if(is_whitespace_token(&tok)) {
@@ -791,22 +1635,22 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 
 	/* we need to expand macros after the macro arguments have been inserted */
 	if(1) {
-		cwae.f = freopen_r(cwae.f, &cwae.buf, &cwae.len);
 #ifdef DEBUG
-		dprintf(2, "contents with args expanded: %s\n", cwae.buf);
+		dprintf(2, "contents with args expanded: %s\n", cpp_sink_data(&cwae.s, 0));
 #endif
-		tokenizer_from_file(&cwae.t, cwae.f);
+		tokenizer_from_sink(&cwae.t, &cwae.s);
 		size_t mac_cnt = 0;
 		while(1) {
 			int ret = tokenizer_next(&cwae.t, &tok);
-			if(!ret) return ret;
+			if(!ret) goto fail;
 			if(tok.type == TT_EOF) break;
 			if(tok.type == TT_IDENTIFIER && get_macro(cpp, cwae.t.buf))
 				++mac_cnt;
 		}
 
 		tokenizer_rewind(&cwae.t);
-		struct macro_info *mcs = calloc(mac_cnt, sizeof(struct macro_info));
+		mcs = calloc(mac_cnt, sizeof(struct macro_info));
+		nmcs = mac_cnt;
 		{
 			size_t mac_iter = 0;
 			get_macro_info(cpp, &cwae.t, mcs, &mac_iter, 0, 0, "null", visited, rec_level);
@@ -816,34 +1660,35 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 		}
 		size_t i; int depth = 0;
 		for(i = 0; i < mac_cnt; ++i) {
-			if(mcs[i].nest > depth) depth = mcs[i].nest;
+			if((int) mcs[i].nest > depth) depth = mcs[i].nest;
 		}
 		while(depth > -1) {
-			for(i = 0; i < mac_cnt; ++i) if(mcs[i].nest == depth) {
+			for(i = 0; i < mac_cnt; ++i) if((int) mcs[i].nest == depth) {
 				struct macro_info *mi = &mcs[i];
 				tokenizer_rewind(&cwae.t);
 				size_t j;
 				struct token utok;
 				for(j = 0; j < mi->first+1; ++j)
 					tokenizer_next(&cwae.t, &utok);
-				struct FILE_container t2 = {0}, tmp = {0};
-				t2.f = open_memstream(&t2.buf, &t2.len);
-				if(!expand_macro(cpp, &cwae.t, t2.f, mi->name, rec_level+1, visited))
-					return 0;
-				t2.f = freopen_r(t2.f, &t2.buf, &t2.len);
-				tokenizer_from_file(&t2.t, t2.f);
+				struct mem_container t2, tmp;
+				cpp_sink_init_mem(&t2.s);
+				if(!expand_macro(cpp, &cwae.t, &t2.s, mi->name, rec_level+1, visited)) {
+					cpp_sink_fini(&t2.s);
+					goto fail;
+				}
+				tokenizer_from_sink(&t2.t, &t2.s);
 				/* manipulating the stream in case more stuff has been consumed */
 				off_t cwae_pos = tokenizer_ftello(&cwae.t);
 				tokenizer_rewind(&cwae.t);
 #ifdef DEBUG
-				dprintf(2, "merging %s with %s\n", cwae.buf, t2.buf);
+				dprintf(2, "merging %s with %s\n", cpp_sink_data(&cwae.s, 0), cpp_sink_data(&t2.s, 0));
 #endif
-				int diff = mem_tokenizers_join(&cwae, &t2, &tmp, mi->first, cwae_pos);
-				free_file_container(&cwae);
-				free_file_container(&t2);
+				int diff = mem_tokenizers_join(cpp, &cwae, &t2, &tmp, mi->first, cwae_pos);
+				free_mem_container(&cwae);
+				free_mem_container(&t2);
 				cwae = tmp;
 #ifdef DEBUG
-				dprintf(2, "result: %s\n", cwae.buf);
+				dprintf(2, "result: %s\n", cpp_sink_data(&cwae.s, 0));
 #endif
 				if(diff == 0) continue;
 				for(j = 0; j < mac_cnt; ++j) {
@@ -872,82 +1717,92 @@ static int expand_macro(struct cpp* cpp, struct tokenizer *t, FILE* out, const c
 			   (ma = get_macro(cpp, cwae.t.buf)) && FUNCTIONLIKE(ma) && tchain_parens_follows(cpp, rec_level) != -1
 			) {
 				int ret = expand_macro(cpp, &cwae.t, out, cwae.t.buf, rec_level+1, visited);
-				if(!ret) return ret;
+				if(!ret) goto fail;
 			} else
 				emit_token(out, &tok, cwae.t.buf);
 		}
-		free(mcs);
 	}
+	goto cleanup;
 
-	free_file_container(&cwae);
-
+fail:
+	ok = 0;
 cleanup:
-	for(i=0; i < num_args; i++) {
-		fclose(argvalues[i].f);
-		free(argvalues[i].buf);
-	}
+	for(i=0; i < nmcs; i++)
+		free((char*) mcs[i].name);
+	free(mcs);
+	free_mem_container(&cwae);
+	for(i=0; i < num_args; i++)
+		cpp_sink_fini(&argvalues[i].s);
 	free(argvalues);
-	return 1;
+	return ok;
 }
 
-#define TT_LAND TT_CUSTOM+0
-#define TT_LOR TT_CUSTOM+1
-#define TT_LTE TT_CUSTOM+2
-#define TT_GTE TT_CUSTOM+3
-#define TT_SHL TT_CUSTOM+4
-#define TT_SHR TT_CUSTOM+5
-#define TT_EQ TT_CUSTOM+6
-#define TT_NEQ TT_CUSTOM+7
-#define TT_LT TT_CUSTOM+8
-#define TT_GT TT_CUSTOM+9
-#define TT_BAND TT_CUSTOM+10
-#define TT_BOR TT_CUSTOM+11
-#define TT_XOR TT_CUSTOM+12
-#define TT_NEG TT_CUSTOM+13
-#define TT_PLUS TT_CUSTOM+14
-#define TT_MINUS TT_CUSTOM+15
-#define TT_MUL TT_CUSTOM+16
-#define TT_DIV TT_CUSTOM+17
-#define TT_MOD TT_CUSTOM+18
-#define TT_LPAREN TT_CUSTOM+19
-#define TT_RPAREN TT_CUSTOM+20
-#define TT_LNOT TT_CUSTOM+21
-
-#define TTINT(X) X-TT_CUSTOM
-#define TTENT(X, Y) [TTINT(X)] = Y
-
-static int bp(int tokentype) {
-	static const int bplist[] = {
-		TTENT(TT_LOR, 1 << 4),
-		TTENT(TT_LAND, 1 << 5),
-		TTENT(TT_BOR, 1 << 6),
-		TTENT(TT_XOR, 1 << 7),
-		TTENT(TT_BAND, 1 << 8),
-		TTENT(TT_EQ, 1 << 9),
-		TTENT(TT_NEQ, 1 << 9),
-		TTENT(TT_LTE, 1 << 10),
-		TTENT(TT_GTE, 1 << 10),
-		TTENT(TT_LT, 1 << 10),
-		TTENT(TT_GT, 1 << 10),
-		TTENT(TT_SHL, 1 << 11),
-		TTENT(TT_SHR, 1 << 11),
-		TTENT(TT_PLUS, 1 << 12),
-		TTENT(TT_MINUS, 1 << 12),
-		TTENT(TT_MUL, 1 << 13),
-		TTENT(TT_DIV, 1 << 13),
-		TTENT(TT_MOD, 1 << 13),
-		TTENT(TT_NEG, 1 << 14),
-		TTENT(TT_LNOT, 1 << 14),
-		TTENT(TT_LPAREN, 1 << 15),
-//		TTENT(TT_RPAREN, 1 << 15),
-//		TTENT(TT_LPAREN, 0),
-		TTENT(TT_RPAREN, 0),
-	};
-	if(TTINT(tokentype) < sizeof(bplist)/sizeof(bplist[0])) return bplist[TTINT(tokentype)];
-	return 0;
+/* #if expressions are evaluated straight from the expanded text. */
+enum eval_token {
+	ET_END, ET_OTHER, ET_NUM, ET_FLOAT, ET_BAD,
+	ET_LOR, ET_LAND, ET_BOR, ET_XOR, ET_BAND, ET_EQ, ET_NEQ,
+	ET_LTE, ET_GTE, ET_LT, ET_GT, ET_SHL, ET_SHR,
+	ET_PLUS, ET_MINUS, ET_MUL, ET_DIV, ET_MOD,
+	ET_NEG, ET_LNOT, ET_LPAREN, ET_RPAREN,
+};
+
+/* longer operators first */
+static const struct { char str[3]; unsigned char type; } eval_ops[] = {
+	{"&&", ET_LAND}, {"||", ET_LOR}, {"<=", ET_LTE}, {">=", ET_GTE},
+	{"<<", ET_SHL}, {">>", ET_SHR}, {"==", ET_EQ}, {"!=", ET_NEQ},
+	{"<", ET_LT}, {">", ET_GT}, {"&", ET_BAND}, {"|", ET_BOR},
+	{"^", ET_XOR}, {"~", ET_NEG}, {"+", ET_PLUS}, {"-", ET_MINUS},
+	{"*", ET_MUL}, {"/", ET_DIV}, {"%", ET_MOD}, {"(", ET_LPAREN},
+	{")", ET_RPAREN}, {"!", ET_LNOT},
+};
+
+static const unsigned short eval_bp[] = {
+	[ET_LOR] = 1 << 4,
+	[ET_LAND] = 1 << 5,
+	[ET_BOR] = 1 << 6,
+	[ET_XOR] = 1 << 7,
+	[ET_BAND] = 1 << 8,
+	[ET_EQ] = 1 << 9, [ET_NEQ] = 1 << 9,
+	[ET_LTE] = 1 << 10, [ET_GTE] = 1 << 10, [ET_LT] = 1 << 10, [ET_GT] = 1 << 10,
+	[ET_SHL] = 1 << 11, [ET_SHR] = 1 << 11,
+	[ET_PLUS] = 1 << 12, [ET_MINUS] = 1 << 12,
+	[ET_MUL] = 1 << 13, [ET_DIV] = 1 << 13, [ET_MOD] = 1 << 13,
+	[ET_NEG] = 1 << 14, [ET_LNOT] = 1 << 14,
+	[ET_LPAREN] = 1 << 15,
+	[ET_RPAREN] = 0,
+};
+
+struct eval_tok {
+	enum eval_token type;
+	intmax_t value;
+	const char *text;
+	size_t len;
+};
+
+struct eval {
+	const char *p, *end;
+	struct cpp *cpp;
+	struct tokenizer *t; /* for diagnostics */
+	struct token *where;
+	int err;
+	int unevaluated; /* inside the dead operand of && or || */
+};
+
+#define EVAL_WIDTH (sizeof(intmax_t) * CHAR_BIT)
+/* two's complement arithmetic without signed overflow */
+#define WRAP(A, OP, B) ((intmax_t) ((uintmax_t) (A) OP (uintmax_t) (B)))
+
+static void eval_error(struct eval *ev, const char *msg, struct eval_tok *tok) {
+	size_t len = tok->len < MAX_TOK_LEN ? tok->len : MAX_TOK_LEN - 1;
+	memcpy(ev->t->buf, tok->text, len);
+	ev->t->buf[len] = 0;
+	error(ev->cpp, msg, ev->t, ev->where);
+	ev->err = 1;
 }
 
-static int expr(struct tokenizer *t, int rbp, int *err);
+static int eval_sep(int c) {
+	return c && strchr(" \t\n!\"#%&'()*+,-./:;<=>?[\\]{|}~^", c);
+}
 
 static int charlit_to_int(const char *lit) {
 	if(lit[1] == '\\') switch(lit[2]) {
@@ -961,157 +1816,195 @@ static int charlit_to_int(const char *lit) {
 	return lit[1];
 }
 
-static int nud(struct tokenizer *t, struct token *tok, int *err) {
-	switch((unsigned) tok->type) {
-		case TT_IDENTIFIER: return 0;
-		case TT_WIDECHAR_LIT:
-		case TT_SQSTRING_LIT:  return charlit_to_int(t->buf);
-		case TT_HEX_INT_LIT:
-		case TT_OCT_INT_LIT:
-		case TT_DEC_INT_LIT:
-			return strtol(t->buf, NULL, 0);
-		case TT_NEG:   return ~ expr(t, bp(tok->type), err);
-		case TT_PLUS:  return expr(t, bp(tok->type), err);
-		case TT_MINUS: return - expr(t, bp(tok->type), err);
-		case TT_LNOT:  return !expr(t, bp(tok->type), err);
-		case TT_LPAREN: {
-			int inner = expr(t, 0, err);
-			if(0!=expect(t, TT_RPAREN, (const char*[]){")", 0}, tok)) {
-				error("missing ')'", t, tok);
-				return 0;
-			}
-			return inner;
-		}
-		case TT_FLOAT_LIT:
-			error("floating constant in preprocessor expression", t, tok);
-			*err = 1;
-			return 0;
-		case TT_RPAREN:
-		default:
-			error("unexpected token", t, tok);
-			*err = 1;
-			return 0;
+/* integer suffixes, as the tokenizer accepts them */
+static int int_suffix(const char *p) {
+	static const char *const ok[] = {"", "u", "l", "ul", "lu", "ll", "ull", "llu", 0};
+	char tail[4];
+	size_t i;
+	for(i = 0; p[i]; i++) {
+		if(i == 3) return 0;
+		tail[i] = ascii_tolower((unsigned char) p[i]);
+	}
+	tail[i] = 0;
+	for(i = 0; ok[i]; i++)
+		if(!strcmp(ok[i], tail)) return 1;
+	return 0;
+}
+
+static void eval_number(struct eval_tok *tok) {
+	char buf[128], *end;
+	int c;
+	tok->type = ET_BAD;
+	if(tok->len >= sizeof buf) return;
+	memcpy(buf, tok->text, tok->len);
+	buf[tok->len] = 0;
+	c = (unsigned char) buf[0];
+	if(ascii_isalpha(c) || c == '_') {
+		for(end = buf; *end == '_' || ascii_isalnum((unsigned char) *end); end++);
+		/* identifiers left after expansion are 0 */
+		if(!*end) tok->type = ET_NUM, tok->value = 0;
+		return;
+	}
+	if(!ascii_isdigit(c)) {
+		if(c == '.') tok->type = ET_FLOAT;
+		return;
+	}
+	tok->value = strtoumax(buf, &end, 0);
+	if(int_suffix(end)) tok->type = ET_NUM;
+	else if(strchr(buf, '.') || (!strpbrk(buf, "xX") && strpbrk(buf, "eE")))
+		tok->type = ET_FLOAT;
+}
+
+static void eval_scan(struct eval *ev, struct eval_tok *tok) {
+	const char *p = ev->p, *e = ev->end;
+	size_t i;
+	while(p < e && (*p == ' ' || *p == '\t')) p++;
+	tok->text = p;
+	tok->type = ET_END;
+	if(p == e) goto out;
+	if(*p == '\'' || *p == '"' || (*p == 'L' && p + 1 < e && p[1] == '\'')) {
+		const char *lit = *p == 'L' ? p + 1 : p;
+		for(p = lit + 1; p < e && *p != *lit; p++)
+			if(*p == '\\' && p + 1 < e) p++;
+		if(p == e) {
+			tok->type = ET_BAD;
+			goto out;
+		}
+		p++;
+		tok->type = *lit == '"' ? ET_OTHER : ET_NUM;
+		if(tok->type == ET_NUM) tok->value = charlit_to_int(lit);
+	} else if(eval_sep((unsigned char) *p) && !(*p == '.' && p + 1 < e && ascii_isdigit((unsigned char) p[1]))) {
+		tok->type = ET_OTHER;
+		for(i = 0; i < sizeof eval_ops / sizeof eval_ops[0]; i++) {
+			size_t n = eval_ops[i].str[1] ? 2 : 1;
+			if(n <= (size_t) (e - p) && !memcmp(p, eval_ops[i].str, n)) {
+				tok->type = eval_ops[i].type;
+				p += n;
+				goto out;
+			}
+		}
+		p++;
+	} else {
+		/* a run of non-separators, with the tokenizer's float rules */
+		int digits = ascii_isdigit((unsigned char) *p) || *p == '.';
+		for(p++; p < e; p++) {
+			if(!eval_sep((unsigned char) *p)) continue;
+			if(digits && *p == '.') continue;
+			if(digits && (*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E')) continue;
+			break;
+		}
+		tok->len = p - tok->text;
+		eval_number(tok);
 	}
+out:
+	tok->len = p - tok->text;
+	ev->p = p;
 }
 
-static int led(struct tokenizer *t, int left, struct token *tok, int *err) {
-	int right;
-	switch((unsigned) tok->type) {
-		case TT_LAND:
-		case TT_LOR:
-			right = expr(t, bp(tok->type), err);
-			if(tok->type == TT_LAND) return left && right;
-			return left || right;
-		case TT_LTE:  return left <= expr(t, bp(tok->type), err);
-		case TT_GTE:  return left >= expr(t, bp(tok->type), err);
-		case TT_SHL:  return left << expr(t, bp(tok->type), err);
-		case TT_SHR:  return left >> expr(t, bp(tok->type), err);
-		case TT_EQ:   return left == expr(t, bp(tok->type), err);
-		case TT_NEQ:  return left != expr(t, bp(tok->type), err);
-		case TT_LT:   return left <  expr(t, bp(tok->type), err);
-		case TT_GT:   return left >  expr(t, bp(tok->type), err);
-		case TT_BAND: return left &  expr(t, bp(tok->type), err);
-		case TT_BOR:  return left |  expr(t, bp(tok->type), err);
-		case TT_XOR:  return left ^  expr(t, bp(tok->type), err);
-		case TT_PLUS: return left +  expr(t, bp(tok->type), err);
-		case TT_MINUS:return left -  expr(t, bp(tok->type), err);
-		case TT_MUL:  return left *  expr(t, bp(tok->type), err);
-		case TT_DIV:
-		case TT_MOD:
-			right = expr(t, bp(tok->type), err);
-			if(right == 0)  {
-				error("eval: div by zero", t, tok);
-				*err = 1;
+static intmax_t expr(struct eval *ev, int rbp);
+
+static intmax_t nud(struct eval *ev, struct eval_tok *tok) {
+	switch(tok->type) {
+		case ET_NUM:   return tok->value;
+		case ET_NEG:   return ~ expr(ev, eval_bp[tok->type]);
+		case ET_PLUS:  return expr(ev, eval_bp[tok->type]);
+		case ET_MINUS: return WRAP(0, -, expr(ev, eval_bp[tok->type]));
+		case ET_LNOT:  return !expr(ev, eval_bp[tok->type]);
+		case ET_LPAREN: {
+			intmax_t inner = expr(ev, 0);
+			eval_scan(ev, tok);
+			if(tok->type != ET_RPAREN) {
+				eval_error(ev, "missing ')'", tok);
+				return 0;
 			}
-			else if(tok->type == TT_DIV) return left / right;
-			else if(tok->type == TT_MOD) return left % right;
+			return inner;
+		}
+		case ET_FLOAT:
+			eval_error(ev, "floating constant in preprocessor expression", tok);
 			return 0;
 		default:
-			error("eval: unexpect token", t, tok);
-			*err = 1;
+			eval_error(ev, "unexpected token", tok);
 			return 0;
 	}
 }
 
-
-static int tokenizer_peek_next_non_ws(struct tokenizer *t, struct token *tok)
-{
-	int ret;
-	while(1) {
-		ret = tokenizer_peek_token(t, tok);
-		if(is_whitespace_token(tok))
-			x_tokenizer_next(t, tok);
-		else break;
+static intmax_t led(struct eval *ev, intmax_t left, struct eval_tok *tok) {
+	intmax_t right;
+	int bp = eval_bp[tok->type];
+	switch(tok->type) {
+		case ET_LAND:
+		case ET_LOR:
+			/* the other operand only counts for its syntax */
+			if(tok->type == ET_LAND ? !left : !!left) {
+				ev->unevaluated++;
+				expr(ev, bp);
+				ev->unevaluated--;
+				return tok->type == ET_LOR;
+			}
+			return !!expr(ev, bp);
+		case ET_LTE:  return left <= expr(ev, bp);
+		case ET_GTE:  return left >= expr(ev, bp);
+		case ET_SHL:
+		case ET_SHR:
+			right = expr(ev, bp);
+			if(right < 0 || right >= (intmax_t) EVAL_WIDTH)
+				return tok->type == ET_SHR && left < 0 ? -1 : 0;
+			if(tok->type == ET_SHL) return WRAP(left, <<, right);
+			return left >> right;
+		case ET_EQ:   return left == expr(ev, bp);
+		case ET_NEQ:  return left != expr(ev, bp);
+		case ET_LT:   return left <  expr(ev, bp);
+		case ET_GT:   return left >  expr(ev, bp);
+		case ET_BAND: return left &  expr(ev, bp);
+		case ET_BOR:  return left |  expr(ev, bp);
+		case ET_XOR:  return left ^  expr(ev, bp);
+		case ET_PLUS: return WRAP(left, +, expr(ev, bp));
+		case ET_MINUS:return WRAP(left, -, expr(ev, bp));
+		case ET_MUL:  return WRAP(left, *, expr(ev, bp));
+		case ET_DIV:
+		case ET_MOD:
+			right = expr(ev, bp);
+			if(right == 0) {
+				if(!ev->unevaluated) eval_error(ev, "eval: div by zero", tok);
+				return 0;
+			}
+			/* INTMAX_MIN / -1 */
+			if(right == -1) return tok->type == ET_DIV ? WRAP(0, -, left) : 0;
+			if(tok->type == ET_DIV) return left / right;
+			return left % right;
+		default:
+			eval_error(ev, "eval: unexpect token", tok);
+			return 0;
 	}
-	return ret;
 }
 
-static int expr(struct tokenizer *t, int rbp, int*err) {
-	struct token tok;
-	int ret = skip_next_and_ws(t, &tok);
-	if(tok.type == TT_EOF) return 0;
-	int left = nud(t, &tok, err);
+static intmax_t expr(struct eval *ev, int rbp) {
+	struct eval_tok tok;
+	const char *p;
+	eval_scan(ev, &tok);
+	if(tok.type == ET_END) return 0;
+	intmax_t left = nud(ev, &tok);
 	while(1) {
-		ret = tokenizer_peek_next_non_ws(t, &tok);
-		if(bp(tok.type) <= rbp) break;
-		ret = tokenizer_next(t, &tok);
-		if(tok.type == TT_EOF) break;
-		left = led(t, left, &tok, err);
+		p = ev->p;
+		eval_scan(ev, &tok);
+		if(eval_bp[tok.type] <= rbp) {
+			ev->p = p;
+			break;
+		}
+		left = led(ev, left, &tok);
 	}
-	(void) ret;
 	return left;
 }
 
-static int do_eval(struct tokenizer *t, int *result) {
-	tokenizer_register_custom_token(t, TT_LAND, "&&");
-	tokenizer_register_custom_token(t, TT_LOR, "||");
-	tokenizer_register_custom_token(t, TT_LTE, "<=");
-	tokenizer_register_custom_token(t, TT_GTE, ">=");
-	tokenizer_register_custom_token(t, TT_SHL, "<<");
-	tokenizer_register_custom_token(t, TT_SHR, ">>");
-	tokenizer_register_custom_token(t, TT_EQ, "==");
-	tokenizer_register_custom_token(t, TT_NEQ, "!=");
-
-	tokenizer_register_custom_token(t, TT_LT, "<");
-	tokenizer_register_custom_token(t, TT_GT, ">");
-
-	tokenizer_register_custom_token(t, TT_BAND, "&");
-	tokenizer_register_custom_token(t, TT_BOR, "|");
-	tokenizer_register_custom_token(t, TT_XOR, "^");
-	tokenizer_register_custom_token(t, TT_NEG, "~");
-
-	tokenizer_register_custom_token(t, TT_PLUS, "+");
-	tokenizer_register_custom_token(t, TT_MINUS, "-");
-	tokenizer_register_custom_token(t, TT_MUL, "*");
-	tokenizer_register_custom_token(t, TT_DIV, "/");
-	tokenizer_register_custom_token(t, TT_MOD, "%");
-
-	tokenizer_register_custom_token(t, TT_LPAREN, "(");
-	tokenizer_register_custom_token(t, TT_RPAREN, ")");
-	tokenizer_register_custom_token(t, TT_LNOT, "!");
-
-	int err = 0;
-	*result = expr(t, 0, &err);
-#ifdef DEBUG
-	dprintf(2, "eval result: %d\n", *result);
-#endif
-	return !err;
-}
-
-static int evaluate_condition(struct cpp *cpp, struct tokenizer *t, int *result, char *visited[]) {
+/* expand the rest of the line and evaluate it */
+static int expand_condition(struct cpp *cpp, struct tokenizer *t, int *result, char *visited[]) {
 	int ret, backslash_seen = 0;
 	struct token curr;
-	char *bufp;
+	/* the buffer is kept, so most conditions need no allocation */
+	struct cpp_sink *f = &cpp->cond;
+	const char *buf;
 	size_t size;
-	int tflags = tokenizer_get_flags(t);
-	tokenizer_set_flags(t, tflags | TF_PARSE_WIDE_STRINGS);
-	ret = tokenizer_next(t, &curr);
-	if(!ret) return ret;
-	if(!is_whitespace_token(&curr)) {
-		error("expected whitespace after if/elif", t, &curr);
-		return 0;
-	}
-	FILE *f = open_memstream(&bufp, &size);
+	cpp_sink_clear(f);
 	while(1) {
 		ret = tokenizer_next(t, &curr);
 		if(!ret) return ret;
@@ -1132,19 +2025,111 @@ static int evaluate_condition(struct cpp *cpp, struct tokenizer *t, int *result,
 			emit_token(f, &curr, t->buf);
 		}
 	}
-	f = freopen_r(f, &bufp, &size);
-	if(!f || size == 0) {
-		error("#(el)if with no expression", t, &curr);
+	buf = cpp_sink_data(f, &size);
+	if(size == 0) {
+		error(cpp, "#(el)if with no expression", t, &curr);
 		return 0;
 	}
 #ifdef DEBUG
-	dprintf(2, "evaluating condition %s\n", bufp);
+	dprintf(2, "evaluating condition %s\n", buf);
 #endif
-	struct tokenizer t2;
-	tokenizer_from_file(&t2, f);
-	ret = do_eval(&t2, result);
-	fclose(f);
-	free(bufp);
+	struct eval ev = {
+		.p = buf, .end = buf + size,
+		.cpp = cpp, .t = t, .where = &curr,
+	};
+	*result = expr(&ev, 0) != 0;
+#ifdef DEBUG
+	dprintf(2, "eval result: %d\n", *result);
+#endif
+	return !ev.err;
+}
+
+/* look up the condition by its unexpanded text. on a hit the line is
+   consumed. otherwise t is put back, and if the text could be used as
+   key, it is left in cond_key and *end is set to where the line ends. */
+static int find_condition(struct cpp *cpp, struct tokenizer *t, int *result, size_t *end) {
+	size_t start = t->mem_pos - t->getc_buf.buffered, len, i;
+	uint32_t line = t->line, column = t->column;
+	int backslash_seen = 0;
+	struct token tok;
+	struct cond_entry **e;
+	while(1) {
+		if(!tokenizer_next(t, &tok) || tok.type == TT_EOF) goto miss;
+		if(tok.type == TT_SEP && tok.value == '\n' && !backslash_seen) break;
+		backslash_seen = tok.type == TT_SEP && tok.value == '\\';
+	}
+	len = t->mem_pos - t->getc_buf.buffered - start;
+	if(memchr(t->mem + start, 0, len)) goto miss;
+	if(len >= cpp->cond_key_cap) {
+		char *n = realloc(cpp->cond_key, len + 1);
+		if(!n) goto miss;
+		cpp->cond_key = n;
+		cpp->cond_key_cap = len + 1;
+	}
+	memcpy(cpp->cond_key, t->mem + start, len);
+	cpp->cond_key[len] = 0;
+	*end = start + len;
+	if((e = hbmap_get(cpp->conds, cpp->cond_key))) {
+		for(i = 0; i < (*e)->ndeps && (*e)->deps[i].g->gen == (*e)->deps[i].gen; i++);
+		if(i == (*e)->ndeps) {
+			/* the names it depends on are read all the same */
+			for(i = 0; cpp->spec && i < (*e)->ndeps; i++)
+				spec_read(cpp, (*e)->deps[i].g->name);
+			*result = (*e)->result;
+			cpp->stats.condition_cache_hits++;
+			return 1;
+		}
+	}
+miss:
+	tokenizer_seek(t, start, line, column);
+	return 0;
+}
+
+static void store_condition(struct cpp *cpp, int result) {
+	size_t n = cpp->cond_ndeps;
+	struct cond_entry *e = malloc(sizeof *e + n * sizeof e->deps[0]), **old;
+	char *key;
+	if(!e) return;
+	e->result = result;
+	e->ndeps = n;
+	if(n) memcpy(e->deps, cpp->cond_deps, n * sizeof e->deps[0]);
+	if((old = hbmap_get(cpp->conds, cpp->cond_key))) {
+		free(*old);
+		*old = e;
+	} else if((key = strdup(cpp->cond_key))) {
+		hbmap_insert(cpp->conds, key, e);
+	} else free(e);
+}
+
+static int evaluate_condition(struct cpp *cpp, struct tokenizer *t, int *result, char *visited[]) {
+	int ret;
+	struct token curr;
+	int tflags = tokenizer_get_flags(t);
+	tokenizer_set_flags(t, tflags | TF_PARSE_WIDE_STRINGS);
+	ret = tokenizer_next(t, &curr);
+	if(!ret) return ret;
+	if(!is_whitespace_token(&curr)) {
+		error(cpp, "expected whitespace after if/elif", t, &curr);
+		return 0;
+	}
+	/* a condition read from memory is cached on its text and the
+	   generations of the macros its expansion looked up */
+	size_t end = -1;
+	int cacheable = !t->input && !t->peeking;
+	if(cacheable && find_condition(cpp, t, result, &end)) {
+		ret = 1;
+	} else {
+		/* the lookup already passed the line to the recorder */
+		tokenizer_recorder recorder = t->recorder;
+		t->recorder = 0;
+		cpp->cond_recording = cacheable;
+		cpp->cond_ndeps = 0;
+		ret = expand_condition(cpp, t, result, visited);
+		if(ret && cpp->cond_recording == 1 && t->mem_pos - t->getc_buf.buffered == end)
+			store_condition(cpp, *result);
+		cpp->cond_recording = 0;
+		t->recorder = recorder;
+	}
 	tokenizer_set_flags(t, tflags);
 	return ret;
 }
@@ -1156,175 +2141,645 @@ static void free_visited(char *visited[]) {
 
 }
 
-int parse_file(struct cpp *cpp, FILE *f, const char *fn, FILE *out) {
+/* states of the include guard detection in parse_step() */
+enum guard_state {
+	GUARD_NONE,   /* the file isn't guarded */
+	GUARD_BEFORE, /* only whitespace so far */
+	GUARD_INSIDE, /* inside the #ifndef block */
+	GUARD_AFTER,  /* only whitespace since the closing #endif */
+};
+
+/* whitespace outside the guard block is the only output a guarded
+   header produces when it's skipped, so remember it */
+static void guard_output(struct token *tok, int ws_count, char *buf, size_t *len, enum guard_state *gs) {
+	if(!(is_whitespace_token(tok) || is_char(tok, '\n')) ||
+	   *len + ws_count + 2 > 256) {
+		*gs = GUARD_NONE;
+		return;
+	}
+	while(ws_count--) buf[(*len)++] = ' ';
+	buf[(*len)++] = tok->value;
+}
+
+static const char* directives[] = {"include", "error", "warning", "define", "undef", "if", "elif", "else", "ifdef", "ifndef", "endif", "line", "pragma", 0};
+
+static void register_comment_markers(struct tokenizer *t) {
+	tokenizer_register_marker(t, MT_MULTILINE_COMMENT_START, "/*"); /**/
+	tokenizer_register_marker(t, MT_MULTILINE_COMMENT_END, "*/");
+	tokenizer_register_marker(t, MT_SINGLELINE_COMMENT_START, "//");
+}
+
+/* the directives of a file, as parse_step() sees them in inactive
+   blocks. lets it go straight from a conditional to the next #elif,
+   #else or #endif on the same level instead of lexing the block. */
+struct skeleton_entry {
+	size_t hash_pos; /* offset of the # */
+	size_t line_pos; /* offset of the start of its line */
+	uint32_t hash_line, line; /* line numbers at hash_pos and line_pos */
+	uint32_t next; /* conditionals: the next directive on the same level, or 0 */
+	uint32_t ladder; /* #if: index + 1 into ladders, or 0 */
+	int directive; /* index into directives[] */
+};
+
+#define LADDER_MIN 4
+
+struct ladder_branch {
+	size_t body_pos; /* start of the line after the directive */
+	uint32_t body_line;
+	intmax_t value;
+};
+
+/* #if X == 1 / #elif X == 2 / ...: one macro compared to constants */
+struct ladder {
+	char *macro;
+	uint32_t fallback; /* first directive of the chain that isn't part of it */
+	size_t mask;
+	uint32_t *slots; /* by value, branch index + 1 or 0 */
+	size_t count;
+	struct ladder_branch branches[];
+};
+
+struct skeleton {
+	tglist(struct skeleton_entry) entries;
+	tglist(struct ladder*) ladders;
+};
+
+static void free_ladder(struct ladder *l) {
+	free(l->macro);
+	free(l->slots);
+	free(l);
+}
+
+static void free_skeleton(void *p) {
+	struct skeleton *sk = p;
+	size_t i;
+	tglist_foreach(&sk->ladders, i)
+		free_ladder(tglist_get(&sk->ladders, i));
+	tglist_free_items(&sk->ladders);
+	tglist_free_items(&sk->entries);
+	free(sk);
+}
+
+static int is_identifier_start(int c) {
+	return c == '_' || ascii_isalpha(c);
+}
+
+/* match "X == constant" on the line of the directive whose # is at
+   hash_pos, without comments or continuation lines. */
+static int ladder_condition(const struct filecache_file *f, size_t hash_pos, int directive, struct eval_tok *name, struct ladder_branch *b) {
+	const char *p = f->data + hash_pos + 1, *end = f->data + f->size, *nl;
+	size_t len = strlen(directives[directive]);
+	struct eval_tok tok;
+	int parens = 0;
+	while(p < end && (*p == ' ' || *p == '\t')) p++;
+	if((size_t) (end - p) < len || memcmp(p, directives[directive], len)) return 0;
+	p += len;
+	if(!(nl = memchr(p, '\n', end - p)) || (*p != ' ' && *p != '\t')) return 0;
+	struct eval ev = {.p = p, .end = nl};
+	eval_scan(&ev, &tok);
+	if(tok.type == ET_LPAREN) {
+		parens = 1;
+		eval_scan(&ev, &tok);
+	}
+	if(tok.type != ET_NUM || !is_identifier_start((unsigned char) *tok.text) ||
+	   memchr(tok.text, '\'', tok.len)) return 0;
+	*name = tok;
+	eval_scan(&ev, &tok);
+	if(tok.type != ET_EQ) return 0;
+	eval_scan(&ev, &tok);
+	if(tok.type != ET_NUM || !ascii_isdigit((unsigned char) *tok.text)) return 0;
+	b->value = tok.value;
+	eval_scan(&ev, &tok);
+	if(parens) {
+		if(tok.type != ET_RPAREN) return 0;
+		eval_scan(&ev, &tok);
+	}
+	if(tok.type != ET_END) return 0;
+	b->body_pos = nl + 1 - f->data;
+	return 1;
+}
+
+static size_t ladder_slot(const struct ladder *l, intmax_t value) {
+	return ((uint64_t) value * 0x9e3779b97f4a7c15ULL >> 32) & l->mask;
+}
+
+static struct ladder *build_ladder(const struct filecache_file *f, struct skeleton *sk, uint32_t first) {
+	struct skeleton_entry *e;
+	struct ladder *l;
+	struct ladder_branch b;
+	struct eval_tok name, other;
+	size_t n = 0, slot;
+	uint32_t i;
+	for(i = first; (e = &tglist_get(&sk->entries, i))->directive != 10; i = e->next, n++)
+		if(!e->next) return 0;
+	if(n < LADDER_MIN || !(l = calloc(1, sizeof *l + n * sizeof *l->branches))) return 0;
+	for(l->mask = 1; l->mask < n * 2; l->mask *= 2);
+	if(!(l->slots = calloc(l->mask--, sizeof *l->slots))) {
+		free(l);
+		return 0;
+	}
+	for(i = first; (e = &tglist_get(&sk->entries, i))->directive == 5 || e->directive == 6; i = e->next) {
+		if(!ladder_condition(f, e->hash_pos, e->directive, i == first ? &name : &other, &b)) break;
+		if(i != first && (other.len != name.len || memcmp(other.text, name.text, name.len))) break;
+		b.body_line = e->hash_line + 1;
+		/* a repeated value can't be taken */
+		for(slot = ladder_slot(l, b.value); l->slots[slot]; slot = (slot + 1) & l->mask)
+			if(l->branches[l->slots[slot] - 1].value == b.value) break;
+		if(!l->slots[slot]) {
+			l->branches[l->count++] = b;
+			l->slots[slot] = l->count;
+		}
+	}
+	l->fallback = i;
+	if(i == first || l->count < LADDER_MIN || !(l->macro = strndup(name.text, name.len))) {
+		free_ladder(l);
+		return 0;
+	}
+	return l;
+}
+
+/* lex f the way parse_step() skips inactive blocks. anything unusual
+   leaves the skeleton empty, so no block is skipped based on it. */
+static struct skeleton *build_skeleton(const struct filecache_file *f) {
+	struct skeleton *sk = calloc(1, sizeof *sk);
+	tglist(uint32_t) open;
 	struct tokenizer t;
-	struct token curr;
-	tokenizer_init(&t, f, TF_PARSE_STRINGS);
-	tokenizer_set_filename(&t, fn);
-	tokenizer_register_marker(&t, MT_MULTILINE_COMMENT_START, "/*"); /**/
-	tokenizer_register_marker(&t, MT_MULTILINE_COMMENT_END, "*/");
-	tokenizer_register_marker(&t, MT_SINGLELINE_COMMENT_START, "//");
-	int ret, newline=1, ws_count = 0;
+	struct token tok;
+	struct skeleton_entry e;
+	size_t n;
+	int i;
+	if(!sk) return 0;
+	tglist_init(&sk->entries);
+	tglist_init(&sk->ladders);
+	tglist_init(&open);
+	tokenizer_init_mem(&t, f->data, f->size, TF_PARSE_STRINGS);
+	register_comment_markers(&t);
+	/* the raw tokenizer_next(), so nothing is reported twice. unknown
+	   tokens only matter where parse_step() uses x_tokenizer_next(). */
+#define scan_next() ((tokenizer_next)(&t, &tok) && tok.type != TT_OVERFLOW)
+	while(1) {
+		e.line_pos = tokenizer_ftello(&t);
+		e.line = t.line;
+		(tokenizer_next)(&t, &tok);
+		if(tok.type == TT_OVERFLOW) goto fail;
+		if(tok.type == TT_EOF) break;
+		if(is_char(&tok, '\n')) {
+			tokenizer_skip_plain_lines(&t);
+			continue;
+		}
+		if(tok.column) continue;
+		while(is_whitespace_token(&tok))
+			if(!scan_next()) goto fail;
+		if(!is_char(&tok, '#')) continue;
+		e.hash_pos = tokenizer_ftello(&t) - 1;
+		e.hash_line = t.line;
+		e.next = 0;
+		e.ladder = 0;
+		do if(!scan_next()) goto fail;
+		while(is_whitespace_token(&tok));
+		if(tok.type != TT_IDENTIFIER) continue;
+		for(i = 0; directives[i] && strcmp(directives[i], t.buf); i++);
+		if(!directives[i]) continue;
+		e.directive = i;
+		n = tglist_getsize(&sk->entries);
+		switch(i) {
+		case 6: case 7: case 10: // elif, else, endif
+			if(!tglist_getsize(&open)) goto fail;
+			tglist_get(&sk->entries, tglist_get(&open, tglist_getsize(&open) - 1)).next = n;
+			tglist_delete(&open, tglist_getsize(&open) - 1);
+			if(i == 10) break;
+			/* fall through */
+		case 5: case 8: case 9: // if, ifdef, ifndef
+			tglist_add(&open, n);
+			break;
+		}
+		tglist_add(&sk->entries, e);
+	}
+#undef scan_next
+	tglist_free_items(&open);
+	tglist_foreach(&sk->entries, n) {
+		struct ladder *l;
+		if(tglist_get(&sk->entries, n).directive == 5 && (l = build_ladder(f, sk, n))) {
+			tglist_add(&sk->ladders, l);
+			tglist_get(&sk->entries, n).ladder = tglist_getsize(&sk->ladders);
+		}
+	}
+	return sk;
+fail:
+	tglist_free_items(&open);
+	tglist_free_items(&sk->entries);
+	return sk;
+}
+
+/* the skeleton entry of the directive at hash_pos, building the
+   skeleton if needed */
+static struct skeleton_entry *find_skeleton_entry(const struct filecache_file *f, size_t hash_pos, int directive, struct skeleton **skp) {
+	struct skeleton *sk = filecache_get_aux(f, FILECACHE_AUX_SKELETON);
+	struct skeleton_entry *e;
+	size_t lo = 0, hi, mid;
+	if(!sk && (sk = build_skeleton(f)))
+		sk = filecache_set_aux(f, FILECACHE_AUX_SKELETON, sk, free_skeleton);
+	if(!sk) return 0;
+	hi = tglist_getsize(&sk->entries);
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(tglist_get(&sk->entries, mid).hash_pos < hash_pos) lo = mid + 1;
+		else hi = mid;
+	}
+	if(lo == tglist_getsize(&sk->entries)) return 0;
+	e = &tglist_get(&sk->entries, lo);
+	if(e->hash_pos != hash_pos || e->directive != directive) return 0;
+	*skp = sk;
+	return e;
+}
+
+/* called when the conditional whose # is at hash_pos starts an inactive
+   block: move t to the next directive on the same level. */
+static void skip_block(struct cpp *cpp, struct tokenizer *t, const struct filecache_file *f, size_t hash_pos, uint32_t hash_line, int directive) {
+	struct skeleton *sk;
+	struct skeleton_entry *e, *next;
+	if(t->peeking || !(e = find_skeleton_entry(f, hash_pos, directive, &sk)) || !e->next) return;
+	next = &tglist_get(&sk->entries, e->next);
+	if(next->line_pos < (size_t) tokenizer_ftello(t)) return;
+	tokenizer_seek(t, next->line_pos, hash_line + (next->line - e->hash_line), 0);
+	cpp->stats.skeleton_skips++;
+}
+
+/* the #if at hash_pos may start a ladder. if it does, and the value of
+   its macro is a plain constant, move t to the branch that value selects
+   and return 1, with *taken set to 1. if no branch is taken, *taken is 0
+   and t is at the first directive after the ladder. */
+static int jump_ladder(struct cpp *cpp, struct tokenizer *t, const struct filecache_file *f, size_t hash_pos, uint32_t hash_line, int *taken) {
+	struct skeleton *sk;
+	struct skeleton_entry *e, *to;
+	struct ladder *l;
+	struct ladder_branch b;
+	struct eval_tok tok;
+	struct macro *m;
+	intmax_t value = 0;
+	size_t slot;
+	if(t->peeking) return 0;
+	/* only build a skeleton for conditions that could head a ladder */
+	if(!filecache_get_aux(f, FILECACHE_AUX_SKELETON) && !ladder_condition(f, hash_pos, 5, &tok, &b))
+		return 0;
+	if(!(e = find_skeleton_entry(f, hash_pos, 5, &sk)) || !e->ladder) return 0;
+	l = tglist_get(&sk->ladders, e->ladder - 1);
+	if((m = get_macro(cpp, l->macro))) {
+		if(FUNCTIONLIKE(m) || (m->num_args & MACRO_FLAG_BUILTIN) || !m->str_contents_buf)
+			return 0;
+		struct eval ev = {.p = m->str_contents_buf, .end = m->str_contents_buf + m->str_contents_len};
+		eval_scan(&ev, &tok);
+		if(tok.type != ET_NUM || !ascii_isdigit((unsigned char) *tok.text)) return 0;
+		value = tok.value;
+		eval_scan(&ev, &tok);
+		if(tok.type != ET_END) return 0;
+	}
+	for(slot = ladder_slot(l, value); l->slots[slot]; slot = (slot + 1) & l->mask) {
+		b = l->branches[l->slots[slot] - 1];
+		if(b.value != value) continue;
+		if(b.body_pos < (size_t) tokenizer_ftello(t)) return 0;
+		tokenizer_seek(t, b.body_pos, hash_line + (b.body_line - e->hash_line), 0);
+		*taken = 1;
+		cpp->stats.ladder_jumps++;
+		return 1;
+	}
+	to = &tglist_get(&sk->entries, l->fallback);
+	if(to->line_pos < (size_t) tokenizer_ftello(t)) return 0;
+	tokenizer_seek(t, to->line_pos, hash_line + (to->line - e->hash_line), 0);
+	*taken = 0;
+	cpp->stats.ladder_jumps++;
+	return 1;
+}
+
+/* a file being processed. #include pushes one, parse_step() works on
+   the innermost one and pops it at its end. frames belong to the cpp
+   that pushed them and are freed when popped. */
+struct parse_frame {
+	struct parse_frame *parent;
+	struct tokenizer t;
+	const struct filecache_file *f; /* 0 for the main file */
+	struct virtual_file *vf;
+	int once;
+	int if_level, if_level_active, if_level_satisfied;
+	int ws_count;
+	enum guard_state gs;
+	char guard_macro[256], guard_ws[256];
+	size_t guard_ws_len;
+	struct include_guard guard;
+	struct tokcache_writer *w;
+	struct prelex *prelex;
+	char *dir; /* cur_dir of the includer */
+	char path[PATH_MAX];
+	struct filecache_key id;
+	unsigned inclusion; /* see struct cpp_token */
+};
+
+/* lex the memory input of fr ahead on other threads */
+static void start_prelex(struct cpp *cpp, struct parse_frame *fr) {
+	if(wants_prelex(cpp, fr->t.mem_size) && !fr->t.replay && !fr->w &&
+	   (fr->prelex = prelex_start(&fr->t, cpp->lex_threads)))
+		cpp->stats.prelexed++;
+}
+
+static int push_frame(struct cpp *cpp, FILE *in, const struct filecache_file *f, const char *fn, const char *path, const struct filecache_key *id) {
+	struct parse_frame *fr;
+	char *slash;
+	if(strlen(path) >= sizeof fr->path || !(fr = calloc(1, sizeof *fr))) return 0;
+	if(f) {
+		tokenizer_init_mem(&fr->t, f->data, f->size, TF_PARSE_STRINGS);
+		fr->w = setup_token_cache(cpp, &fr->t, f);
+		fr->f = f;
+		fr->gs = GUARD_BEFORE;
+		fr->id = *id;
+	} else if(in) tokenizer_init(&fr->t, in, TF_PARSE_STRINGS);
+	/* fed through cpp_feed() */
+	else tokenizer_init_mem(&fr->t, 0, 0, TF_PARSE_STRINGS);
+	strcpy(fr->path, path);
+	fr->inclusion = ++cpp->inclusions;
+	tokenizer_set_filename(&fr->t, fn);
+	register_comment_markers(&fr->t);
+	/* "" includes are relative to the directory of the includer */
+	fr->dir = cpp->cur_dir;
+	cpp->cur_dir = strdup(path);
+	if((slash = strrchr(cpp->cur_dir, '/'))) *(slash == cpp->cur_dir ? slash + 1 : slash) = 0;
+	else {
+		free(cpp->cur_dir);
+		cpp->cur_dir = strdup(".");
+	}
+	if(f) start_prelex(cpp, fr);
+	fr->parent = cpp->frame;
+	cpp->frame = fr;
+	return 1;
+}
+
+/* start on a registered header. its path is its name. */
+static int push_virtual(struct cpp *cpp, struct virtual_file *vf, const char *name) {
+	if(!push_frame(cpp, 0, 0, name, name, 0)) return 0;
+	cpp->frame->t.mem = vf->data;
+	cpp->frame->t.mem_size = vf->size;
+	cpp->frame->vf = vf;
+	cpp->frame->gs = GUARD_BEFORE;
+	return 1;
+}
+
+/* ok is 0 if processing stopped due to an error */
+static void pop_frame(struct cpp *cpp, int ok) {
+	struct parse_frame *fr = cpp->frame;
+	const struct filecache_file *f = fr->f;
+	struct tokcache *tc;
+	cpp->frame = fr->parent;
+	free(cpp->cur_dir);
+	cpp->cur_dir = fr->dir;
+	cpp->stats.tokens_replayed += fr->t.replayed;
+	if(fr->prelex) prelex_free(fr->prelex);
+	if(f) {
+		if(fr->w && !ok) tokcache_writer_free(fr->w);
+		else if(fr->w && (tc = tokcache_writer_finish(fr->w, cpp->token_cache, f->data, f->size))) {
+			filecache_set_aux(f, FILECACHE_AUX_TOKENS, tc, free_tokcache);
+			cpp->stats.token_cache_writes++;
+		}
+		filecache_release(f);
+		if(fr->once) mark_once(cpp, fr->path, &fr->id);
+		if(fr->guard.macro && hbmap_find(cpp->guards, fr->path) == (hbmap_iter) -1)
+			hbmap_insert(cpp->guards, strdup(fr->path), fr->guard);
+		else {
+			free(fr->guard.macro);
+			free(fr->guard.output);
+		}
+	} else if(fr->vf) {
+		if(fr->once) fr->vf->once = 1;
+		if(fr->guard.macro && !fr->vf->guard.macro) fr->vf->guard = fr->guard;
+		else {
+			free(fr->guard.macro);
+			free(fr->guard.output);
+		}
+	}
+	free(fr);
+}
+
+static int end_file(struct cpp *cpp, struct token *curr) {
+	struct parse_frame *fr = cpp->frame;
+	if(fr->if_level) {
+		error(cpp, "unterminated #if", &fr->t, curr);
+		return 0;
+	}
+	if(fr->gs == GUARD_AFTER) {
+		fr->guard_ws[fr->guard_ws_len] = 0;
+		fr->guard.macro = strdup(fr->guard_macro);
+		fr->guard.output = strdup(fr->guard_ws);
+	}
+	pop_frame(cpp, 1);
+	return 1;
+}
+
+static int include_run(struct cpp *cpp, struct cpp_sink *out, size_t hash_pos, uint32_t hash_line);
 
-	int if_level = 0, if_level_active = 0, if_level_satisfied = 0;
+/* process the next token or directive of the innermost file.
+   returns 0 on error. */
+static int parse_step(struct cpp *cpp, struct cpp_sink *out) {
+	struct parse_frame *fr = cpp->frame;
+	struct tokenizer *t = &fr->t;
+	const struct filecache_file *f = fr->f;
+	struct token curr;
+	int ret, newline;
 
-#define all_levels_active() (if_level_active == if_level)
-#define prev_level_active() (if_level_active == if_level-1)
+#define all_levels_active() (fr->if_level_active == fr->if_level)
+#define prev_level_active() (fr->if_level_active == fr->if_level-1)
 #define set_level(X, V) do { \
-		if(if_level_active > X) if_level_active = X; \
-		if(if_level_satisfied > X) if_level_satisfied = X; \
+		int l_ = X; \
+		if(fr->if_level_active > l_) fr->if_level_active = l_; \
+		if(fr->if_level_satisfied > l_) fr->if_level_satisfied = l_; \
 		if(V != -1) { \
-			if(V) if_level_active = X; \
-			else if(if_level_active == X) if_level_active = X-1; \
-			if(V && if_level_active == X) if_level_satisfied = X; \
+			if(V) fr->if_level_active = l_; \
+			else if(fr->if_level_active == l_) fr->if_level_active = l_-1; \
+			if(V && fr->if_level_active == l_) fr->if_level_satisfied = l_; \
 		} \
-		if_level = X; \
+		fr->if_level = l_; \
 	} while(0)
-#define skip_conditional_block (if_level > if_level_active)
+#define skip_conditional_block (fr->if_level > fr->if_level_active)
 
-	static const char* directives[] = {"include", "error", "warning", "define", "undef", "if", "elif", "else", "ifdef", "ifndef", "endif", "line", "pragma", 0};
-	while((ret = tokenizer_next(&t, &curr)) && curr.type != TT_EOF) {
-		newline = curr.column == 0;
-		if(newline) {
-			ret = eat_whitespace(&t, &curr, &ws_count);
-			if(!ret) return ret;
+	if(!(ret = tokenizer_next(t, &curr)) || curr.type == TT_EOF)
+		return end_file(cpp, &curr);
+	newline = curr.column == 0;
+	if(newline) {
+		ret = eat_whitespace(cpp, t, &curr, &fr->ws_count);
+		if(!ret) return ret;
+	}
+	if(curr.type == TT_EOF) return end_file(cpp, &curr);
+	if(skip_conditional_block && !(newline && is_char(&curr, '#'))) {
+		if(is_char(&curr, '\n') && !t->input) tokenizer_skip_plain_lines(t);
+		return 1;
+	}
+	if(is_char(&curr, '#')) {
+		if(!newline) {
+			error(cpp, "stray #", t, &curr);
+			return 0;
 		}
-		if(curr.type == TT_EOF) break;
-		if(skip_conditional_block && !(newline && is_char(&curr, '#'))) continue;
-		if(is_char(&curr, '#')) {
-			if(!newline) {
-				error("stray #", &t, &curr);
-				return 0;
-			}
-			int index = expect(&t, TT_IDENTIFIER, directives, &curr);
-			if(index == -1) {
-				if(skip_conditional_block) continue;
-				error("invalid preprocessing directive", &t, &curr);
+		size_t hash_pos = tokenizer_ftello(t) - 1;
+		uint32_t hash_line = t->line;
+		int index = expect(cpp, t, TT_IDENTIFIER, directives, &curr);
+		if(index == -1) {
+			if(skip_conditional_block) return 1;
+			error(cpp, "invalid preprocessing directive", t, &curr);
+			return 0;
+		}
+		if(skip_conditional_block) switch(index) {
+			case 0: case 1: case 2: case 3: case 4: case 12:
+				return 1;
+			default: break;
+		}
+		if(out->tokens) token_origin(out, t->filename, hash_line, fr->inclusion, 0);
+		if(fr->gs == GUARD_INSIDE && fr->if_level == 1) {
+			if(index == 10) fr->gs = GUARD_AFTER;
+			else if(index == 6 || index == 7) fr->gs = GUARD_NONE;
+		} else if(fr->gs == GUARD_BEFORE && index == 9) {
+			fr->gs = GUARD_INSIDE;
+		} else if(fr->gs != GUARD_INSIDE) {
+			fr->gs = GUARD_NONE;
+		}
+		switch(index) {
+		case 0:
+			if((ret = include_run(cpp, out, hash_pos, hash_line)) == -1)
+				ret = include_file(cpp, t, out);
+			if(!ret) return ret;
+			break;
+		case 1:
+			ret = emit_error_or_warning(cpp, t, 1);
+			if(!ret) return ret;
+			break;
+		case 2:
+			ret = emit_error_or_warning(cpp, t, 0);
+			if(!ret) return ret;
+			break;
+		case 3:
+			ret = parse_macro(cpp, t);
+			if(!ret) return ret;
+			break;
+		case 4:
+			if(!skip_next_and_ws(cpp, t, &curr)) return 0;
+			if(curr.type != TT_IDENTIFIER) {
+				error(cpp, "expected identifier", t, &curr);
 				return 0;
 			}
-			if(skip_conditional_block) switch(index) {
-				case 0: case 1: case 2: case 3: case 4:
-					continue;
-				default: break;
+			undef_macro(cpp, t->buf);
+			break;
+		case 5: // if
+			if(all_levels_active() && f && jump_ladder(cpp, t, f, hash_pos, hash_line, &ret)) {
+				/* whichever branch it is, the levels end up the same */
+				set_level(fr->if_level + 1, ret);
+				return 1;
+			} else if(all_levels_active()) {
+				char* visited[MAX_RECURSION] = {0};
+				int ok = evaluate_condition(cpp, t, &ret, visited);
+				free_visited(visited);
+				if(!ok) return 0;
+				set_level(fr->if_level + 1, ret);
+			} else {
+				set_level(fr->if_level + 1, 0);
 			}
-			switch(index) {
-			case 0:
-				ret = include_file(cpp, &t, out);
-				if(!ret) return ret;
-				break;
-			case 1:
-				ret = emit_error_or_warning(&t, 1);
-				if(!ret) return ret;
-				break;
-			case 2:
-				ret = emit_error_or_warning(&t, 0);
-				if(!ret) return ret;
-				break;
-			case 3:
-				ret = parse_macro(cpp, &t);
-				if(!ret) return ret;
-				break;
-			case 4:
-				if(!skip_next_and_ws(&t, &curr)) return 0;
-				if(curr.type != TT_IDENTIFIER) {
-					error("expected identifier", &t, &curr);
-					return 0;
-				}
-				undef_macro(cpp, t.buf);
-				break;
-			case 5: // if
-				if(all_levels_active()) {
-					char* visited[MAX_RECURSION] = {0};
-					if(!evaluate_condition(cpp, &t, &ret, visited)) return 0;
-					free_visited(visited);
-					set_level(if_level + 1, ret);
-				} else {
-					set_level(if_level + 1, 0);
-				}
-				break;
-			case 6: // elif
-				if(prev_level_active() && if_level_satisfied < if_level) {
-					char* visited[MAX_RECURSION] = {0};
-					if(!evaluate_condition(cpp, &t, &ret, visited)) return 0;
-					free_visited(visited);
-					if(ret) {
-						if_level_active = if_level;
-						if_level_satisfied = if_level;
-					}
-				} else if(if_level_active == if_level) {
-					--if_level_active;
-				}
-				break;
-			case 7: // else
-				if(prev_level_active() && if_level_satisfied < if_level) {
-					if(1) {
-						if_level_active = if_level;
-						if_level_satisfied = if_level;
-					}
-				} else if(if_level_active == if_level) {
-					--if_level_active;
-				}
-				break;
-			case 8: // ifdef
-			case 9: // ifndef
-				if(!skip_next_and_ws(&t, &curr) || curr.type == TT_EOF) return 0;
-				ret = !!get_macro(cpp, t.buf);
-				if(index == 9) ret = !ret;
-
-				if(all_levels_active()) {
-					set_level(if_level + 1, ret);
-				} else {
-					set_level(if_level + 1, 0);
+			break;
+		case 6: // elif
+			if(prev_level_active() && fr->if_level_satisfied < fr->if_level) {
+				char* visited[MAX_RECURSION] = {0};
+				int ok = evaluate_condition(cpp, t, &ret, visited);
+				free_visited(visited);
+				if(!ok) return 0;
+				if(ret) {
+					fr->if_level_active = fr->if_level;
+					fr->if_level_satisfied = fr->if_level;
 				}
-				break;
-			case 10: // endif
-				set_level(if_level-1, -1);
-				break;
-			case 11: // line
-				ret = tokenizer_read_until(&t, "\n", 1);
-				if(!ret) {
-					error("unknown", &t, &curr);
-					return 0;
-				}
-				break;
-			case 12: // pragma
-				emit(out, "#pragma");
-				while((ret = x_tokenizer_next(&t, &curr)) && curr.type != TT_EOF) {
-					emit_token(out, &curr, t.buf);
-					if(is_char(&curr, '\n')) break;
+			} else if(fr->if_level_active == fr->if_level) {
+				--fr->if_level_active;
+			}
+			break;
+		case 7: // else
+			if(prev_level_active() && fr->if_level_satisfied < fr->if_level) {
+				if(1) {
+					fr->if_level_active = fr->if_level;
+					fr->if_level_satisfied = fr->if_level;
 				}
-				if(!ret) return ret;
-				break;
-			default:
-				break;
+			} else if(fr->if_level_active == fr->if_level) {
+				--fr->if_level_active;
 			}
-			continue;
-		} else {
-			while(ws_count) {
-				emit(out, " ");
-				--ws_count;
+			break;
+		case 8: // ifdef
+		case 9: // ifndef
+			if(!skip_next_and_ws(cpp, t, &curr) || curr.type == TT_EOF) return 0;
+			ret = !!get_macro(cpp, t->buf);
+			if(index == 9) ret = !ret;
+			if(fr->gs == GUARD_INSIDE && fr->if_level == 0) {
+				if(strlen(t->buf) < sizeof fr->guard_macro)
+					strcpy(fr->guard_macro, t->buf);
+				else fr->gs = GUARD_NONE;
+			}
+
+			if(all_levels_active()) {
+				set_level(fr->if_level + 1, ret);
+			} else {
+				set_level(fr->if_level + 1, 0);
 			}
+			break;
+		case 10: // endif
+			set_level(fr->if_level-1, -1);
+			break;
+		case 11: // line
+			ret = tokenizer_read_until(t, "\n", 1);
+			if(!ret) {
+				error(cpp, "unknown", t, &curr);
+				return 0;
+			}
+			break;
+		case 12: // pragma
+			ret = parse_pragma(cpp, t, out, &fr->once);
+			if(!ret) return ret;
+			break;
+		default:
+			break;
 		}
+		if(f && skip_conditional_block && index >= 5 && index <= 9)
+			skip_block(cpp, t, f, hash_pos, hash_line, index);
+		return 1;
+	} else {
+		if(fr->gs == GUARD_BEFORE || fr->gs == GUARD_AFTER)
+			guard_output(&curr, fr->ws_count, fr->guard_ws, &fr->guard_ws_len, &fr->gs);
+		if(out->tokens) token_origin(out, t->filename, curr.line, fr->inclusion, 0);
+		flush_whitespace(out, &fr->ws_count);
+	}
 #if DEBUG
-		dprintf(2, "(stdin:%u,%u) ", curr.line, curr.column);
-		if(curr.type == TT_SEP)
-			dprintf(2, "separator: %c\n", curr.value == '\n'? ' ' : curr.value);
-		else
-			dprintf(2, "%s: %s\n", tokentype_to_str(curr.type), t.buf);
+	dprintf(2, "(stdin:%u,%u) ", curr.line, curr.column);
+	if(curr.type == TT_SEP)
+		dprintf(2, "separator: %c\n", curr.value == '\n'? ' ' : curr.value);
+	else
+		dprintf(2, "%s: %s\n", tokentype_to_str(curr.type), t->buf);
 #endif
-		if(curr.type == TT_IDENTIFIER) {
-			char* visited[MAX_RECURSION] = {0};
-			if(!expand_macro(cpp, &t, out, t.buf, 0, visited))
+	if(curr.type == TT_IDENTIFIER) {
+		char* visited[MAX_RECURSION] = {0};
+		size_t len, start = 0;
+		int seekable = 0;
+		if(fr == cpp->feed_frame) {
+			/* a name spelled across a line splice can't be found again */
+			len = strlen(t->buf);
+			start = tokenizer_ftello(t) - len;
+			seekable = !memcmp(t->mem + start, t->buf, len);
+		}
+		int ok = expand_macro(cpp, t, out, t->buf, 0, visited);
+		free_visited(visited);
+		if(!ok) return 0;
+		if(cpp->feed_wait) {
+			if(!seekable) {
+				error(cpp, "macro call runs past the input processed so far", t, &curr);
 				return 0;
-			free_visited(visited);
-		} else {
-			emit_token(out, &curr, t.buf);
+			}
+			tokenizer_seek(t, start, curr.line, curr.column);
 		}
+	} else {
+		emit_token(out, &curr, t->buf);
 	}
-	if(if_level) {
-		error("unterminated #if", &t, &curr);
-		return 0;
-	}
+
+#undef all_levels_active
+#undef prev_level_active
+#undef set_level
+#undef skip_conditional_block
 	return 1;
 }
 
@@ -1332,37 +2787,1571 @@ struct cpp * cpp_new(void) {
 	struct cpp* ret = calloc(1, sizeof(struct cpp));
 	if(!ret) return ret;
 	tglist_init(&ret->includedirs);
+	tglist_init(&ret->mappings);
 	cpp_add_includedir(ret, ".");
 	ret->macros = hbmap_new(strptrcmp, string_hash, 128);
-	struct macro m = {.num_args = 1};
+	ret->macro_gens = hbmap_new(strptrcmp, string_hash, 128);
+	ret->conds = hbmap_new(strptrcmp, string_hash, 64);
+	ret->deps = hbmap_new(strptrcmp, string_hash, 32);
+	ret->guards = hbmap_new(strptrcmp, string_hash, 32);
+	ret->stat_cache = hbmap_new(strptrcmp, string_hash, 64);
+	ret->once = hbmap_new(strptrcmp, string_hash, 32);
+	ret->resolved = hbmap_new(strptrcmp, string_hash, 64);
+	ret->dirs = hbmap_new(strptrcmp, string_hash, 16);
+	ret->virtuals = hbmap_new(strptrcmp, string_hash, 16);
+	ret->names = hbmap_new(strptrcmp, string_hash, 32);
+	ret->cur_dir = strdup(".");
+	cpp_sink_init_mem(&ret->cond);
+	struct macro m = {.num_args = 1 | MACRO_FLAG_BUILTIN};
 	add_macro(ret, strdup("defined"), &m);
-	m.num_args = MACRO_FLAG_OBJECTLIKE;
+	m.num_args = MACRO_FLAG_OBJECTLIKE | MACRO_FLAG_BUILTIN;
 	add_macro(ret, strdup("__FILE__"), &m);
 	add_macro(ret, strdup("__LINE__"), &m);
 	return ret;
 }
 
+static void free_virtual(struct virtual_file *vf) {
+	free(vf->data);
+	free(vf->guard.macro);
+	free(vf->guard.output);
+	free(vf);
+}
+
 void cpp_free(struct cpp*cpp) {
+	size_t i;
+	hbmap_iter k;
 	free_macros(cpp);
+	hbmap_foreach(cpp->conds, k) {
+		free(hbmap_getkey(cpp->conds, k));
+		free(hbmap_getval(cpp->conds, k));
+	}
+	hbmap_fini(cpp->conds, 1);
+	free(cpp->conds);
+	/* the keys live in the values */
+	hbmap_foreach(cpp->macro_gens, k)
+		free(hbmap_getval(cpp->macro_gens, k));
+	hbmap_fini(cpp->macro_gens, 1);
+	free(cpp->macro_gens);
+	free(cpp->cond_key);
+	free(cpp->cond_deps);
+	hbmap_foreach(cpp->deps, k)
+		free(hbmap_getkey(cpp->deps, k));
+	hbmap_fini(cpp->deps, 1);
+	free(cpp->deps);
+	hbmap_foreach(cpp->guards, k) {
+		free(hbmap_getkey(cpp->guards, k));
+		free(hbmap_getval(cpp->guards, k).macro);
+		free(hbmap_getval(cpp->guards, k).output);
+	}
+	hbmap_fini(cpp->guards, 1);
+	free(cpp->guards);
+	hbmap_foreach(cpp->stat_cache, k)
+		free(hbmap_getkey(cpp->stat_cache, k));
+	hbmap_fini(cpp->stat_cache, 1);
+	free(cpp->stat_cache);
+	hbmap_foreach(cpp->once, k) {
+		free(hbmap_getkey(cpp->once, k));
+		free(hbmap_getval(cpp->once, k).path);
+	}
+	hbmap_fini(cpp->once, 1);
+	free(cpp->once);
+	free_resolved(cpp);
+	hbmap_fini(cpp->resolved, 1);
+	free(cpp->resolved);
+	free_dirs(cpp);
+	hbmap_fini(cpp->dirs, 1);
+	free(cpp->dirs);
+	hbmap_foreach(cpp->virtuals, k) {
+		free(hbmap_getkey(cpp->virtuals, k));
+		free_virtual(hbmap_getval(cpp->virtuals, k));
+	}
+	hbmap_fini(cpp->virtuals, 1);
+	free(cpp->virtuals);
+	hbmap_foreach(cpp->names, k)
+		free(hbmap_getkey(cpp->names, k));
+	hbmap_fini(cpp->names, 1);
+	free(cpp->names);
+	free(cpp->cur_dir);
+	free(cpp->token_cache);
+	cpp_sink_fini(&cpp->cond);
+	tglist_foreach(&cpp->mappings, i) {
+		munmap(tglist_get(&cpp->mappings, i).addr, tglist_get(&cpp->mappings, i).size);
+		free(tglist_get(&cpp->mappings, i).args);
+	}
+	tglist_free_items(&cpp->mappings);
+	free(cpp->profile_shadow);
 	tglist_free_values(&cpp->includedirs);
 	tglist_free_items(&cpp->includedirs);
 }
 
+void cpp_destroy(struct cpp *cpp) {
+	cpp_free(cpp);
+	free(cpp);
+}
+
 void cpp_add_includedir(struct cpp *cpp, const char* includedir) {
 	tglist_add(&cpp->includedirs, strdup(includedir));
+	/* cached lookups may have missed the new dir */
+	if(cpp->resolved) {
+		hbmap_iter k;
+		free_resolved(cpp);
+		hbmap_foreach(cpp->resolved, k) {
+			while(hbmap_iter_index_valid(cpp->resolved, k))
+				hbmap_delete(cpp->resolved, k);
+		}
+	}
 }
 
-int cpp_add_define(struct cpp *cpp, const char *mdecl) {
-	struct FILE_container tmp = {0};
-	tmp.f = open_memstream(&tmp.buf, &tmp.len);
-	fprintf(tmp.f, "%s\n", mdecl);
-	tmp.f = freopen_r(tmp.f, &tmp.buf, &tmp.len);
-	tokenizer_from_file(&tmp.t, tmp.f);
-	int ret = parse_macro(cpp, &tmp.t);
-	free_file_container(&tmp);
-	return ret;
+void cpp_set_flags(struct cpp *cpp, int flags) {
+	cpp->flags = flags;
 }
 
-int cpp_run(struct cpp *cpp, FILE* in, FILE* out, const char* inname) {
-	return parse_file(cpp, in, inname, out);
+void cpp_set_diag(struct cpp *cpp, cpp_diag_func fn, void *ctx) {
+	cpp->diag = fn;
+	cpp->diag_ctx = ctx;
+}
+
+void cpp_set_lex_threads(struct cpp *cpp, unsigned n) {
+	cpp->lex_threads = n;
+}
+
+void cpp_set_spec_threads(struct cpp *cpp, unsigned n) {
+	cpp->spec_threads = n;
+}
+
+void cpp_set_token_cache(struct cpp *cpp, const char *dir) {
+	free(cpp->token_cache);
+	cpp->token_cache = dir ? strdup(dir) : 0;
+}
+
+int cpp_add_include_buffer(struct cpp *cpp, const char *name, const char *data, size_t len) {
+	struct virtual_file *vf = calloc(1, sizeof *vf);
+	hbmap_iter k;
+	if(!vf || !(vf->data = malloc(len ? len : 1))) {
+		free(vf);
+		return 0;
+	}
+	memcpy(vf->data, data, len);
+	vf->size = len;
+	if((k = hbmap_find(cpp->virtuals, name)) != (hbmap_iter) -1) {
+		free_virtual(hbmap_getval(cpp->virtuals, k));
+		hbmap_getval(cpp->virtuals, k) = vf;
+	} else hbmap_insert(cpp->virtuals, strdup(name), vf);
+	return 1;
+}
+
+int cpp_add_define(struct cpp *cpp, const char *mdecl) {
+	struct mem_container tmp;
+	cpp_sink_init_mem(&tmp.s);
+	cpp_sink_puts(&tmp.s, mdecl);
+	cpp_sink_putc(&tmp.s, '\n');
+	tokenizer_from_sink(&tmp.t, &tmp.s);
+	int ret = parse_macro(cpp, &tmp.t);
+	free_mem_container(&tmp);
+	return ret;
+}
+
+/* hash of everything that was configured before the first input was
+   processed: include dirs and macros defined via cpp_add_define().
+   a snapshot is only valid for the configuration it was made with. */
+static uint64_t config_hash(struct cpp *cpp) {
+	if(cpp->have_config_hash) return cpp->config_hash;
+	uint64_t h = fnv1a(0, "", 0), mh = 0;
+	size_t i;
+	tglist_foreach(&cpp->includedirs, i) {
+		const char *dir = tglist_get(&cpp->includedirs, i);
+		h = fnv1a(h, dir, strlen(dir) + 1);
+	}
+	if(cpp->profile)
+		h = fnv1a(h, cpp->profile->name, strlen(cpp->profile->name) + 1);
+	hbmap_iter k;
+	hbmap_foreach(cpp->macros, k) {
+		/* the table is unordered, so combine per-macro hashes */
+		struct macro *m = &hbmap_getval(cpp->macros, k);
+		const char *name = hbmap_getkey(cpp->macros, k);
+		if(m->num_args & MACRO_FLAG_BUILTIN) continue;
+		uint64_t x = fnv1a(0, name, strlen(name) + 1);
+		x = fnv1a(x, &m->num_args, sizeof m->num_args);
+		if(m->str_contents_buf)
+			x = fnv1a(x, m->str_contents_buf, m->str_contents_len);
+		for(i = 0; i < MACRO_ARGCOUNT(m); i++)
+			x = fnv1a(x, m->argnames[i], strlen(m->argnames[i]) + 1);
+		mh += x;
+	}
+	cpp->config_hash = fnv1a(h, &mh, sizeof mh);
+	cpp->have_config_hash = 1;
+	return cpp->config_hash;
+}
+
+/* the main file is read from in, or from the len bytes at src */
+static int begin_run(struct cpp *cpp, FILE *in, const char *src, size_t len, const char *inname) {
+	config_hash(cpp);
+	cpp->inclusions = 0;
+	if(in) {
+		add_dependency(cpp, inname, fileno(in));
+		return push_frame(cpp, in, 0, inname, inname, 0);
+	}
+	if(!push_frame(cpp, 0, 0, inname, inname, 0)) return 0;
+	cpp->frame->t.mem = src;
+	cpp->frame->t.mem_size = len;
+	start_prelex(cpp, cpp->frame);
+	return 1;
+}
+
+static int run_steps(struct cpp *cpp, int ret, struct cpp_sink *out) {
+	while(ret && cpp->frame) ret = parse_step(cpp, out);
+	while(cpp->frame) pop_frame(cpp, 0);
+	return cpp_sink_flush(out) && ret;
+}
+
+/* speculative processing of a large main file. it is cut into chunks
+   at top level line ends, the first is processed as usual, the others
+   in batches: each chunk of a batch is processed on a worker instance
+   of its own thread, assuming the macros the base instance has at the
+   start of the batch. the workers note which names they looked up
+   there and which they changed. then the base takes the results in
+   order: a chunk that looked up none of the names the ones before it
+   changed, or that got the same meaning again, and whose includes go
+   the same way now, counts as processed. its output, diagnostics,
+   definitions and file state are taken over. any other chunk is
+   processed again by the base. a run of #include lines in any file is
+   done the same way, a line per chunk, see include_run(). */
+
+#define SPEC_MIN_SIZE (1024 * 1024)
+#define SPEC_CHUNK_SIZE (256 * 1024)
+
+struct spec_chunk {
+	size_t start, end;
+	uint32_t line; /* at start, which is at column 0 */
+	int ok;
+	struct cpp_sink out;
+	struct spec_access access;
+	tglist(struct cpp_diag) diags; /* copies */
+	struct cpp_stats stats;
+};
+
+struct spec_worker {
+	struct speculation *s;
+	struct cpp *cpp;
+	pthread_t thread;
+};
+
+struct speculation {
+	struct cpp *base;
+	const char *src, *inname;
+	const char *path; /* of the file, "" includes are relative to it */
+	struct spec_chunk *chunks; /* of the current batch */
+	size_t ready; /* chunk structs set up */
+	size_t count; /* in the batch */
+	size_t next; /* the chunk to process next */
+	size_t done;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* the first is used by the calling thread, the others each by a
+	   thread of their own */
+	struct spec_worker *workers;
+	unsigned nworkers, nthreads;
+};
+
+static int is_ident_char(int c) {
+	return ascii_isalnum(c) || c == '_' || c == '$';
+}
+
+/* the end of the chunk starting at pos: the first line end at least
+   SPEC_CHUNK_SIZE later outside of comments, literals, parentheses,
+   conditionals and continued lines, after which no macro call can go
+   on. adds the lines passed to *line. a # that isn't the first thing
+   on its line leaves the rest of the input in one chunk. */
+static size_t spec_cut(const char *p, size_t pos, size_t size, uint32_t *line) {
+	enum { CODE, BLOCK_COMMENT, LINE_COMMENT, QUOTE } state = CODE;
+	size_t want = pos + SPEC_CHUNK_SIZE, i, j, n;
+	int quote = 0, depth = 0, ifs = 0, line_start = 1, directive = 0;
+	int last = '\n'; /* last character of code outside of directives */
+	for(i = pos; i < size; i++) {
+		int c = p[i];
+		if(c == '\n') ++*line;
+		switch(state) {
+		case BLOCK_COMMENT:
+			if(c == '*' && i + 1 < size && p[i+1] == '/') {
+				state = CODE;
+				i++;
+			}
+			continue;
+		case LINE_COMMENT:
+			if(c == '\n') {
+				state = CODE;
+				goto newline;
+			}
+			continue;
+		case QUOTE:
+			if(c == '\\' && i + 1 < size) {
+				if(p[++i] == '\n') ++*line;
+			} else if(c == quote) state = CODE;
+			else if(c == '\n') {
+				state = CODE;
+				goto newline;
+			}
+			continue;
+		case CODE:
+			break;
+		}
+		if(c == '#' && !directive) {
+			if(!line_start) return size;
+			directive = 1;
+			for(j = i + 1; j < size && (p[j] == ' ' || p[j] == '\t'); j++);
+			for(n = 0; j + n < size && is_ident_char(p[j+n]); n++);
+			if((n == 2 && !memcmp(p + j, "if", 2)) ||
+			   (n == 5 && !memcmp(p + j, "ifdef", 5)) ||
+			   (n == 6 && !memcmp(p + j, "ifndef", 6)))
+				ifs++;
+			else if(n == 5 && !memcmp(p + j, "endif", 5))
+				ifs--;
+			else if(!n && j < size && p[j] != '\n') return size;
+			continue;
+		}
+		if(c != ' ' && c != '\t') line_start = 0;
+		switch(c) {
+		case '/':
+			if(i + 1 < size && p[i+1] == '*') state = BLOCK_COMMENT;
+			else if(i + 1 < size && p[i+1] == '/') state = LINE_COMMENT;
+			else goto code;
+			i++;
+			continue;
+		case '"': case '\'':
+			state = QUOTE;
+			quote = c;
+			goto code;
+		case '\\':
+			if(i + 1 < size && p[i+1] == '\n') {
+				++*line;
+				i++;
+				continue;
+			}
+			goto code;
+		case '(':
+			if(!directive) depth++;
+			goto code;
+		case ')':
+			if(!directive && depth) depth--;
+			goto code;
+		case '\n':
+		newline:
+			if(directive) last = '\n';
+			directive = 0;
+			line_start = 1;
+			if(i + 1 < want || depth || ifs) continue;
+			/* a function-like macro name at the end of the line
+			   would take a ( from the next one */
+			if(is_ident_char(last) || last == ')') {
+				for(j = i + 1; j < size && (p[j] == ' ' || p[j] == '\t'); j++);
+				if(j == size || p[j] == '(' || p[j] == '/' || p[j] == '\\' ||
+				   p[j] == '\n' || p[j] == '\r' || p[j] == '\f' || p[j] == '\v')
+					continue;
+			}
+			return i + 1;
+		case ' ': case '\t': case '\r': case '\f': case '\v':
+			continue;
+		default:
+		code:
+			if(!directive) last = c;
+		}
+	}
+	return size;
+}
+
+/* process the chunk of the file as if it was all there is, in a frame
+   of its own on top of the current ones */
+static int run_chunk(struct cpp *cpp, struct speculation *s, struct spec_chunk *c, struct cpp_sink *out) {
+	struct parse_frame *parent = cpp->frame;
+	struct tokenizer *t;
+	int ret = 1;
+	if(!push_frame(cpp, 0, 0, s->inname, s->path, 0)) return 0;
+	t = &cpp->frame->t;
+	t->mem = s->src;
+	t->mem_size = c->end;
+	tokenizer_seek(t, c->start, c->line, 0);
+	while(ret && cpp->frame != parent) ret = parse_step(cpp, out);
+	while(cpp->frame != parent) pop_frame(cpp, 0);
+	return ret;
+}
+
+static void spec_diag(void *ctx, const struct cpp_diag *d) {
+	struct spec_chunk *c = ctx;
+	struct cpp_diag copy = *d;
+	/* one that can't be kept lets the chunk be processed again */
+	if(!(copy.file = strdup(d->file))) c->ok = 0;
+	else if(!(copy.msg = strdup(d->msg))) c->ok = 0;
+	else if(!(copy.text = strdup(d->text))) c->ok = 0;
+	else {
+		tglist_add(&c->diags, copy);
+		return;
+	}
+	free((char*) copy.file);
+	free((char*) copy.msg);
+}
+
+/* move what the includes of a chunk left behind on worker w along
+   with it, in order */
+static void spec_take_files(struct cpp *w, struct spec_access *a) {
+	hbmap_iter k;
+	hbmap_foreach(w->guards, k)
+		hbmap_insert(a->guards, hbmap_getkey(w->guards, k), hbmap_getval(w->guards, k));
+	hbmap_foreach(w->once, k)
+		hbmap_insert(a->once, hbmap_getkey(w->once, k), hbmap_getval(w->once, k));
+	hbmap_foreach(w->deps, k)
+		hbmap_insert(a->deps, hbmap_getkey(w->deps, k), hbmap_getval(w->deps, k));
+	/* deleting from the end moves nothing */
+	while(hbmap_getsize(w->guards)) hbmap_delete(w->guards, hbmap_getsize(w->guards) - 1);
+	while(hbmap_getsize(w->once)) hbmap_delete(w->once, hbmap_getsize(w->once) - 1);
+	while(hbmap_getsize(w->deps)) hbmap_delete(w->deps, hbmap_getsize(w->deps) - 1);
+}
+
+/* on worker w, which has no macros or file state of its own outside
+   of a chunk */
+static void spec_process(struct speculation *s, struct cpp *w, struct spec_chunk *c) {
+	struct cpp *base = s->base;
+	struct macro_def *d;
+	hbmap_iter k, m;
+	size_t n;
+	/* the base may have changed since the last chunk */
+	hbmap_foreach(w->macro_gens, k)
+		hbmap_getval(w->macro_gens, k)->gen++;
+	w->spec_failed = 0;
+	if(base->profile_shadow) {
+		n = (base->profile->count + 7) / 8;
+		if(w->profile_shadow || (w->profile_shadow = malloc(n)))
+			memcpy(w->profile_shadow, base->profile_shadow, n);
+		else w->spec_failed = 1;
+	} else if(w->profile_shadow) {
+		free(w->profile_shadow);
+		w->profile_shadow = 0;
+	}
+	memset(&w->stats, 0, sizeof w->stats);
+	w->diag_ctx = c;
+	w->spec = &c->access;
+	c->ok = 1;
+	c->ok = !w->spec_failed && run_chunk(w, s, c, &c->out) && !c->out.error && c->ok;
+	w->spec = 0;
+	/* take the definitions along */
+	hbmap_foreach(c->access.writes, k) {
+		m = hbmap_find(w->macros, hbmap_getkey(c->access.writes, k));
+		if(m == (hbmap_iter) -1) continue;
+		if(!(d = malloc(sizeof *d))) {
+			c->ok = 0;
+			break;
+		}
+		d->name = hbmap_getkey(w->macros, m);
+		d->m = hbmap_getval(w->macros, m);
+		hbmap_delete(w->macros, m);
+		hbmap_getval(c->access.writes, k) = d;
+	}
+	spec_take_files(w, &c->access);
+	c->ok = c->ok && !w->spec_failed;
+	clear_macros(w);
+	c->stats = w->stats;
+}
+
+static void *spec_work(void *arg) {
+	struct spec_worker *sw = arg;
+	struct speculation *s = sw->s;
+	struct spec_chunk *c;
+	pthread_mutex_lock(&s->lock);
+	while(!s->stop) {
+		if(s->next >= s->count) {
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+		c = &s->chunks[s->next++];
+		pthread_mutex_unlock(&s->lock);
+		spec_process(s, sw->cpp, c);
+		pthread_mutex_lock(&s->lock);
+		if(++s->done == s->count) pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+/* process the chunks of the batch ahead, the calling thread helps */
+static void spec_batch(struct speculation *s, size_t count) {
+	struct spec_chunk *c;
+	pthread_mutex_lock(&s->lock);
+	s->count = count;
+	s->next = s->done = 0;
+	pthread_cond_broadcast(&s->cond);
+	while(s->next < s->count) {
+		c = &s->chunks[s->next++];
+		pthread_mutex_unlock(&s->lock);
+		spec_process(s, s->workers[0].cpp, c);
+		pthread_mutex_lock(&s->lock);
+		s->done++;
+	}
+	while(s->done < s->count) pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* it holds if none of the names looked up changed meaning before it */
+static int spec_valid(struct cpp *cpp, struct spec_chunk *c) {
+	struct macro buf;
+	hbmap_iter k;
+	const char *name;
+	if(!c->ok || cpp->spec_failed) return 0;
+	hbmap_foreach(cpp->spec_saved, k) {
+		name = hbmap_getkey(cpp->spec_saved, k);
+		if(hbmap_find(c->access.reads, name) != (hbmap_iter) -1 &&
+		   !same_macro(find_macro(cpp, name, &buf), hbmap_getval(cpp->spec_saved, k)))
+			return 0;
+	}
+	/* the worker saw the base's guards and once files as they were,
+	   and not the copies a file may be of */
+	hbmap_foreach(c->access.files, k)
+		if(include_outcome(cpp, hbmap_getkey(c->access.files, k)) != hbmap_getval(c->access.files, k))
+			return 0;
+	return 1;
+}
+
+static void spec_commit(struct cpp *cpp, struct spec_chunk *c, struct cpp_sink *out) {
+	struct macro_def *d;
+	const char *data;
+	char *key;
+	size_t len, i;
+	hbmap_iter k;
+	data = cpp_sink_data(&c->out, &len);
+	cpp_sink_write(out, data, len);
+	tglist_foreach(&c->diags, i)
+		report_diag(cpp, &tglist_get(&c->diags, i));
+	hbmap_foreach(c->access.writes, k) {
+		if(!(d = hbmap_getval(c->access.writes, k))) {
+			undef_macro(cpp, hbmap_getkey(c->access.writes, k));
+			continue;
+		}
+		add_macro(cpp, d->name, &d->m);
+		free(d);
+		hbmap_getval(c->access.writes, k) = 0;
+	}
+	/* like pop_frame() and add_dependency_stamp(), what is there stays */
+	hbmap_foreach(c->access.guards, k) {
+		key = hbmap_getkey(c->access.guards, k);
+		if(hbmap_find(cpp->guards, key) != (hbmap_iter) -1) continue;
+		hbmap_insert(cpp->guards, key, hbmap_getval(c->access.guards, k));
+		hbmap_getkey(c->access.guards, k) = 0;
+		hbmap_getval(c->access.guards, k) = (struct include_guard) {0};
+	}
+	hbmap_foreach(c->access.once, k) {
+		key = hbmap_getkey(c->access.once, k);
+		if(hbmap_find(cpp->once, key) != (hbmap_iter) -1) continue;
+		hbmap_insert(cpp->once, key, hbmap_getval(c->access.once, k));
+		hbmap_getkey(c->access.once, k) = 0;
+		hbmap_getval(c->access.once, k).path = 0;
+	}
+	hbmap_foreach(c->access.deps, k) {
+		key = hbmap_getkey(c->access.deps, k);
+		if(hbmap_find(cpp->deps, key) != (hbmap_iter) -1) continue;
+		hbmap_insert(cpp->deps, key, hbmap_getval(c->access.deps, k));
+		hbmap_getkey(c->access.deps, k) = 0;
+	}
+	cpp_stats_add(&cpp->stats, &c->stats);
+}
+
+static void spec_reset(struct spec_chunk *c) {
+	struct macro_def *d;
+	hbmap_iter k;
+	size_t i;
+	hbmap_foreach(c->access.reads, k) {
+		while(hbmap_iter_index_valid(c->access.reads, k)) {
+			free(hbmap_getkey(c->access.reads, k));
+			hbmap_delete(c->access.reads, k);
+		}
+	}
+	hbmap_foreach(c->access.writes, k) {
+		while(hbmap_iter_index_valid(c->access.writes, k)) {
+			if((d = hbmap_getval(c->access.writes, k))) {
+				free(d->name);
+				release_macro(&d->m);
+				free(d);
+			}
+			free(hbmap_getkey(c->access.writes, k));
+			hbmap_delete(c->access.writes, k);
+		}
+	}
+	hbmap_foreach(c->access.files, k) {
+		while(hbmap_iter_index_valid(c->access.files, k)) {
+			free(hbmap_getkey(c->access.files, k));
+			hbmap_delete(c->access.files, k);
+		}
+	}
+	hbmap_foreach(c->access.guards, k) {
+		while(hbmap_iter_index_valid(c->access.guards, k)) {
+			free(hbmap_getkey(c->access.guards, k));
+			free(hbmap_getval(c->access.guards, k).macro);
+			free(hbmap_getval(c->access.guards, k).output);
+			hbmap_delete(c->access.guards, k);
+		}
+	}
+	hbmap_foreach(c->access.once, k) {
+		while(hbmap_iter_index_valid(c->access.once, k)) {
+			free(hbmap_getkey(c->access.once, k));
+			free(hbmap_getval(c->access.once, k).path);
+			hbmap_delete(c->access.once, k);
+		}
+	}
+	hbmap_foreach(c->access.deps, k) {
+		while(hbmap_iter_index_valid(c->access.deps, k)) {
+			free(hbmap_getkey(c->access.deps, k));
+			hbmap_delete(c->access.deps, k);
+		}
+	}
+	tglist_foreach(&c->diags, i) {
+		free((char*) tglist_get(&c->diags, i).file);
+		free((char*) tglist_get(&c->diags, i).msg);
+		free((char*) tglist_get(&c->diags, i).text);
+	}
+	tglist_free_items(&c->diags);
+	cpp_sink_clear(&c->out);
+}
+
+static void spec_clear_saved(struct cpp *cpp) {
+	struct macro *m;
+	hbmap_iter k;
+	hbmap_foreach(cpp->spec_saved, k) {
+		while(hbmap_iter_index_valid(cpp->spec_saved, k)) {
+			if((m = hbmap_getval(cpp->spec_saved, k))) {
+				release_macro(m);
+				free(m);
+			}
+			free(hbmap_getkey(cpp->spec_saved, k));
+			hbmap_delete(cpp->spec_saved, k);
+		}
+	}
+	cpp->spec_failed = 0;
+}
+
+static void access_fini(struct spec_access *a) {
+	if(a->reads) hbmap_fini(a->reads, 1);
+	if(a->writes) hbmap_fini(a->writes, 1);
+	if(a->files) hbmap_fini(a->files, 1);
+	if(a->guards) hbmap_fini(a->guards, 1);
+	if(a->once) hbmap_fini(a->once, 1);
+	if(a->deps) hbmap_fini(a->deps, 1);
+	free(a->reads);
+	free(a->writes);
+	free(a->files);
+	free(a->guards);
+	free(a->once);
+	free(a->deps);
+}
+
+static int access_init(struct spec_access *a) {
+	if((a->reads = hbmap_new(strptrcmp, string_hash, 1024)) &&
+	   (a->writes = hbmap_new(strptrcmp, string_hash, 32)) &&
+	   (a->files = hbmap_new(strptrcmp, string_hash, 64)) &&
+	   (a->guards = hbmap_new(strptrcmp, string_hash, 32)) &&
+	   (a->once = hbmap_new(strptrcmp, string_hash, 32)) &&
+	   (a->deps = hbmap_new(strptrcmp, string_hash, 32)))
+		return 1;
+	access_fini(a);
+	return 0;
+}
+
+/* batch is the number of chunks. returns 0 if out of memory. */
+static int spec_start(struct speculation *s, size_t batch, unsigned nthreads) {
+	struct cpp *w;
+	size_t i;
+	pthread_mutex_init(&s->lock, 0);
+	pthread_cond_init(&s->cond, 0);
+	if(!(s->base->spec_saved = hbmap_new(strptrcmp, string_hash, 32)) ||
+	   !(s->chunks = calloc(batch, sizeof *s->chunks)) ||
+	   !(s->workers = calloc(nthreads + 1, sizeof *s->workers)))
+		return 0;
+	for(; s->ready < batch; s->ready++) {
+		struct spec_chunk *c = &s->chunks[s->ready];
+		cpp_sink_init_mem(&c->out);
+		tglist_init(&c->diags);
+		if(!access_init(&c->access)) return 0;
+	}
+	for(; s->nworkers <= nthreads; s->nworkers++) {
+		if(!(w = s->workers[s->nworkers].cpp = cpp_new())) return 0;
+		/* the builtins are looked up in the base like the rest */
+		clear_macros(w);
+		/* the first include dir is "." in both */
+		for(i = 1; i < tglist_getsize(&s->base->includedirs); i++)
+			cpp_add_includedir(w, tglist_get(&s->base->includedirs, i));
+		cpp_set_token_cache(w, s->base->token_cache);
+		w->flags = s->base->flags;
+		w->profile = s->base->profile;
+		w->spec_base = s->base;
+		cpp_set_diag(w, spec_diag, 0);
+		s->workers[s->nworkers].s = s;
+	}
+	/* with fewer threads, the calling one does more */
+	for(; s->nthreads < nthreads; s->nthreads++)
+		if(pthread_create(&s->workers[s->nthreads + 1].thread, 0, spec_work, &s->workers[s->nthreads + 1]))
+			break;
+	return 1;
+}
+
+/* stop the threads and free what spec_start() set up */
+static void spec_stop(struct speculation *s) {
+	struct spec_chunk *c;
+	size_t i;
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	for(i = 0; i < s->nthreads; i++) pthread_join(s->workers[i + 1].thread, 0);
+	for(i = 0; i < s->nworkers; i++) cpp_destroy(s->workers[i].cpp);
+	for(i = 0; i < s->ready; i++) {
+		c = &s->chunks[i];
+		spec_reset(c);
+		cpp_sink_fini(&c->out);
+		access_fini(&c->access);
+	}
+	if(s->base->spec_saved) {
+		spec_clear_saved(s->base);
+		hbmap_fini(s->base->spec_saved, 1);
+		free(s->base->spec_saved);
+		s->base->spec_saved = 0;
+	}
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s->chunks);
+	free(s->workers);
+}
+
+/* process the count chunks set up, then take them in order */
+static int spec_round(struct speculation *s, size_t count, struct cpp_sink *out) {
+	struct cpp *cpp = s->base;
+	struct spec_chunk *c;
+	size_t i;
+	int ret = 1;
+	spec_batch(s, count);
+	for(i = 0; i < count; i++) {
+		c = &s->chunks[i];
+		if(ret && spec_valid(cpp, c)) {
+			spec_commit(cpp, c, out);
+			cpp->stats.spec_chunks++;
+		} else if(ret) {
+			ret = run_chunk(cpp, s, c, out);
+			cpp->stats.spec_reruns++;
+		}
+		spec_reset(c);
+	}
+	spec_clear_saved(cpp);
+	return ret;
+}
+
+static int run_speculative(struct cpp *cpp, const char *src, size_t len, struct cpp_sink *out, const char *inname) {
+	struct speculation s = {.base = cpp, .src = src, .inname = inname, .path = inname};
+	struct spec_chunk first = {.line = 1}, *c;
+	size_t batch = 2 * (cpp->spec_threads + 1), pos, count;
+	uint32_t line = 1;
+	int ret;
+	config_hash(cpp);
+	/* it usually sets up what the rest relies on */
+	first.end = pos = spec_cut(src, 0, len, &line);
+	ret = run_chunk(cpp, &s, &first, out);
+	if(ret && pos < len && !spec_start(&s, batch, cpp->spec_threads)) {
+		spec_stop(&s);
+		first = (struct spec_chunk) {.start = pos, .end = len, .line = line};
+		return run_chunk(cpp, &s, &first, out) && cpp_sink_flush(out);
+	}
+	while(ret && pos < len) {
+		for(count = 0; count < batch && pos < len; count++) {
+			c = &s.chunks[count];
+			c->start = pos;
+			c->line = line;
+			c->end = pos = spec_cut(src, pos, len, &line);
+		}
+		ret = spec_round(&s, count, out);
+	}
+	if(s.chunks) spec_stop(&s);
+	return cpp_sink_flush(out) && ret;
+}
+
+/* the end of the #include line at pos and the blank lines after it, or
+   pos if there is none or it may go on in the next line. adds the lines
+   passed to *line. */
+static size_t include_cut(const char *p, size_t pos, size_t size, uint32_t *line) {
+	size_t i = pos, end;
+	while(i < size && (p[i] == ' ' || p[i] == '\t')) i++;
+	if(i == size || p[i++] != '#') return pos;
+	while(i < size && (p[i] == ' ' || p[i] == '\t')) i++;
+	if(size - i < 8 || memcmp(p + i, "include", 7) || is_ident_char(p[i + 7])) return pos;
+	for(; i < size && p[i] != '\n'; i++)
+		if((p[i] == '/' && i + 1 < size && p[i+1] == '*') ||
+		   (p[i] == '\\' && (i + 1 == size || p[i+1] == '\n' || p[i+1] == '\r')))
+			return pos;
+	if(i == size) return pos;
+	end = ++i;
+	++*line;
+	for(; i < size; i++) {
+		if(p[i] == '\n') {
+			end = i + 1;
+			++*line;
+		} else if(p[i] != ' ' && p[i] != '\t') break;
+	}
+	return end;
+}
+
+/* at the # at hash_pos of a directive line that starts a run of two or
+   more #include lines in the innermost file, process them like chunks
+   and go on after them. returns -1 without doing anything if that
+   doesn't apply, else 0 on error. the first line may as well be done
+   ahead, it is only taken if the base's once files didn't change how
+   it goes. */
+static int include_run(struct cpp *cpp, struct cpp_sink *out, size_t hash_pos, uint32_t hash_line) {
+	struct parse_frame *fr = cpp->frame;
+	struct tokenizer *t = &fr->t;
+	struct speculation s = {.base = cpp, .src = t->mem, .inname = t->filename, .path = fr->path};
+	size_t batch = 2 * (cpp->spec_threads + 1), pos = hash_pos, end, count;
+	uint32_t line = hash_line, l;
+	struct spec_chunk *c;
+	int ret = 1;
+	/* not within speculation, and where the tokenizer can be moved on */
+	if(!cpp->spec_threads || cpp->spec || cpp->spec_saved || out->tokens ||
+	   !t->mem || t->input || t->peeking || fr->w || fr->prelex || fr == cpp->feed_frame)
+		return -1;
+	while(pos > 0 && (t->mem[pos-1] == ' ' || t->mem[pos-1] == '\t')) pos--;
+	if(pos > 0 && t->mem[pos-1] != '\n') return -1;
+	l = line;
+	if((end = include_cut(t->mem, pos, t->mem_size, &l)) == pos ||
+	   include_cut(t->mem, end, t->mem_size, &l) == end)
+		return -1;
+	if(!spec_start(&s, batch, cpp->spec_threads)) {
+		spec_stop(&s);
+		return -1;
+	}
+	cpp->stats.include_runs++;
+	do {
+		for(count = 0; count < batch; count++) {
+			l = line;
+			if((end = include_cut(t->mem, pos, t->mem_size, &l)) == pos) break;
+			c = &s.chunks[count];
+			c->start = pos;
+			c->line = line;
+			c->end = pos = end;
+			line = l;
+		}
+		ret = spec_round(&s, count, out);
+	} while(ret && count == batch);
+	spec_stop(&s);
+	if(ret) tokenizer_seek(t, pos, line, 0);
+	return ret;
+}
+
+static int run_tokens(struct cpp *cpp, FILE *in, const char *src, size_t len, cpp_token_func fn, void *ctx, const char *inname) {
+	struct cpp_sink s;
+	struct token_out *to = calloc(1, sizeof *to);
+	int ret;
+	if(!to) return 0;
+	to->fn = fn;
+	to->ctx = ctx;
+	to->origin_file = inname;
+	to->origin_inclusion = 1;
+	to->file_off = -1;
+	cpp_sink_init_mem(&to->strings);
+	cpp_sink_init_mem(&s);
+	s.tokens = to;
+	ret = run_steps(cpp, begin_run(cpp, in, src, len, inname), &s);
+	flush_text(&s);
+	deliver_tokens(to);
+	ret = ret && !to->error && !to->strings.error && !s.error;
+	cpp_sink_fini(&s);
+	cpp_sink_fini(&to->strings);
+	free(to);
+	return ret;
+}
+
+/* CPP_FLAG_COMPACT output, written as the tokens come in */
+struct compact_out {
+	struct cpp_sink *out;
+	int markers;
+	char *file; /* where the current output line comes from */
+	unsigned line, inclusion;
+	int col; /* something was written on the current line */
+	int space, blank; /* pending */
+	int started;
+};
+
+/* most blank lines written instead of a #line marker */
+#define COMPACT_MAX_GAP 8
+
+static void compact_line_start(struct compact_out *c, const struct cpp_token *tok) {
+	char buf[32];
+	if(!c->markers) {
+		if(c->blank && c->started) cpp_sink_putc(c->out, '\n');
+	} else if(tok->inclusion != c->inclusion || strcmp(c->file, tok->file)) {
+		/* another file, or the same one entered again */
+		snprintf(buf, sizeof buf, "#line %u \"", tok->line);
+		cpp_sink_puts(c->out, buf);
+		cpp_sink_puts(c->out, tok->file);
+		cpp_sink_puts(c->out, "\"\n");
+		free(c->file);
+		c->file = strdup(tok->file);
+		c->line = tok->line;
+		c->inclusion = tok->inclusion;
+	} else if(tok->line < c->line && tok->from_macro) {
+		/* the rest of a macro call that spans lines */
+	} else if(tok->line < c->line || tok->line - c->line > COMPACT_MAX_GAP) {
+		snprintf(buf, sizeof buf, "#line %u\n", tok->line);
+		cpp_sink_puts(c->out, buf);
+		c->line = tok->line;
+	} else {
+		cpp_sink_fill(c->out, '\n', tok->line - c->line);
+		c->line = tok->line;
+	}
+	c->blank = 0;
+	c->started = 1;
+}
+
+static int compact_write(void *ctx, const struct cpp_token *toks, size_t count) {
+	struct compact_out *c = ctx;
+	size_t i;
+	for(i = 0; i < count; i++) {
+		const struct cpp_token *tok = &toks[i];
+		if(tok->type == TT_SEP && tok->value == '\n') {
+			if(c->col) {
+				cpp_sink_putc(c->out, '\n');
+				c->line++;
+			} else c->blank = 1;
+			c->col = c->space = 0;
+			continue;
+		}
+		if(tok->type == TT_SEP && (tok->value == ' ' || tok->value == '\t')) {
+			c->space = c->col;
+			continue;
+		}
+		if(!c->col) compact_line_start(c, tok);
+		else if(c->space) cpp_sink_putc(c->out, ' ');
+		cpp_sink_write(c->out, tok->text, tok->len);
+		c->col = 1;
+		c->space = 0;
+	}
+	return !c->out->error && c->file;
+}
+
+static int run_compact(struct cpp *cpp, FILE *in, const char *src, size_t len, struct cpp_sink *out, const char *inname) {
+	struct compact_out c = {
+		.out = out, .markers = !!(cpp->flags & CPP_FLAG_LINE_MARKERS),
+		.file = strdup(inname), .line = 1, .inclusion = 1,
+	};
+	int ret = c.file && run_tokens(cpp, in, src, len, compact_write, &c, inname);
+	free(c.file);
+	return cpp_sink_flush(out) && ret;
+}
+
+int cpp_run_sink(struct cpp *cpp, FILE* in, struct cpp_sink *out, const char* inname) {
+	if(cpp->flags & CPP_FLAG_COMPACT) return run_compact(cpp, in, 0, 0, out, inname);
+	return run_steps(cpp, begin_run(cpp, in, 0, 0, inname), out);
+}
+
+int cpp_run_buffer(struct cpp *cpp, const char *src, size_t len, struct cpp_sink *out, const char* inname) {
+	if(cpp->flags & CPP_FLAG_COMPACT) return run_compact(cpp, 0, src, len, out, inname);
+	if(cpp->spec_threads && len >= SPEC_MIN_SIZE) return run_speculative(cpp, src, len, out, inname);
+	return run_steps(cpp, begin_run(cpp, 0, src, len, inname), out);
+}
+
+int cpp_open(struct cpp *cpp, FILE* in, const char* inname) {
+	cpp_sink_init_mem(&cpp->pull);
+	cpp->pull_pos = 0;
+	cpp->pull_failed = 0;
+	return begin_run(cpp, in, 0, 0, inname);
+}
+
+ssize_t cpp_read(struct cpp *cpp, char *buf, size_t n) {
+	struct cpp_sink *s = &cpp->pull;
+	while(s->len - cpp->pull_pos < n && cpp->frame && !cpp->pull_failed) {
+		/* what's left is less than n */
+		if(cpp->pull_pos) {
+			memmove(s->buf, s->buf + cpp->pull_pos, s->len - cpp->pull_pos);
+			s->len -= cpp->pull_pos;
+			cpp->pull_pos = 0;
+		}
+		if(!parse_step(cpp, s) || s->error) {
+			while(cpp->frame) pop_frame(cpp, 0);
+			cpp->pull_failed = 1;
+		}
+	}
+	if(n > s->len - cpp->pull_pos) n = s->len - cpp->pull_pos;
+	if(!n) return cpp->pull_failed ? -1 : 0;
+	memcpy(buf, s->buf + cpp->pull_pos, n);
+	cpp->pull_pos += n;
+	return n;
+}
+
+int cpp_close(struct cpp *cpp) {
+	int ret = !cpp->pull_failed && !cpp->frame;
+	while(cpp->frame) pop_frame(cpp, 0);
+	cpp_sink_fini(&cpp->pull);
+	return ret;
+}
+
+/* how much input an open parenthesis may hold back. past it, a stray
+   one (in #if 0, say) would keep all the rest buffered, so the scan
+   cuts at the last line. a macro call that runs past the cut waits
+   for more input, see feed_steps(). */
+#define FEED_HOLD_MAX (1024 * 1024)
+
+static void scan_input(struct input_scan *s, const char *p, size_t len) {
+	size_t i;
+	for(i = s->pos; i < len; i++) {
+		int c = p[i];
+		/* sequences of two need both */
+		if((c == '\\' || c == '/' || c == '*') && i + 1 == len) break;
+		if(c == '\\' && p[i+1] == '\n') {
+			i++;
+			continue;
+		}
+		switch(s->state) {
+		case SCAN_BLOCK_COMMENT:
+			if(c == '*' && p[i+1] == '/') {
+				s->state = SCAN_CODE;
+				i++;
+			}
+			continue;
+		case SCAN_LINE_COMMENT:
+			/* the lexer takes the newline as part of the comment
+			   and goes on with the next line */
+			if(c == '\n') {
+				s->state = SCAN_CODE;
+				s->line_start = 1;
+				s->directive = 0;
+			}
+			continue;
+		case SCAN_QUOTE:
+			if(c == '\\') i++;
+			else if(c == s->quote) s->state = SCAN_CODE;
+			else if(c == '\n') goto newline;
+			continue;
+		case SCAN_CODE:
+			break;
+		}
+		if(s->line_start && c != ' ' && c != '\t') {
+			s->line_start = 0;
+			s->directive = c == '#';
+		}
+		switch(c) {
+		case '/':
+			if(p[i+1] == '*') s->state = SCAN_BLOCK_COMMENT;
+			else if(p[i+1] == '/') s->state = SCAN_LINE_COMMENT;
+			else break;
+			i++;
+			break;
+		case '"': case '\'':
+			s->state = SCAN_QUOTE;
+			s->quote = c;
+			break;
+		case '(':
+			if(!s->directive) s->depth++;
+			break;
+		case ')':
+			if(!s->directive && s->depth) s->depth--;
+			break;
+		case '\n':
+		newline:
+			s->state = SCAN_CODE;
+			s->line_start = 1;
+			s->directive = 0;
+			s->eol = i + 1;
+			if(!s->depth) s->safe = i + 1;
+			break;
+		}
+	}
+	s->pos = i;
+	if(s->depth && s->eol - s->safe > FEED_HOLD_MAX) s->safe = s->eol;
+}
+
+/* whether the end t is at is only where the fed input was cut */
+static int feed_cut(struct cpp *cpp, struct tokenizer *t) {
+	return cpp->feed_frame && t == &cpp->feed_frame->t && !cpp->feed_finish;
+}
+
+/* process the fed input up to limit, or all of it. a macro call whose
+   arguments run past limit is taken up again from its name once the
+   limit has moved on. */
+static int feed_steps(struct cpp *cpp, size_t limit, int finish) {
+	struct tokenizer *t = &cpp->feed_frame->t;
+	if(!finish && cpp->feed_wait && limit <= cpp->feed_wait) return 1;
+	cpp->feed_wait = 0;
+	cpp->feed_finish = finish;
+	t->mem = cpp->feed.buf;
+	t->mem_size = limit;
+	while(cpp->frame && !cpp->feed_wait &&
+	      (finish || cpp->frame != cpp->feed_frame || tokenizer_ftello(t) < (off_t) limit))
+		if(!parse_step(cpp, cpp->feed_out)) {
+			while(cpp->frame) pop_frame(cpp, 0);
+			cpp->feed_failed = 1;
+			return 0;
+		}
+	return 1;
+}
+
+int cpp_start(struct cpp *cpp, struct cpp_sink *out, const char* inname) {
+	config_hash(cpp);
+	cpp_sink_init_mem(&cpp->feed);
+	cpp->scan = (struct input_scan) {.line_start = 1};
+	cpp->feed_out = out;
+	cpp->feed_failed = 0;
+	cpp->feed_wait = 0;
+	if(!push_frame(cpp, 0, 0, inname, inname, 0)) return 0;
+	cpp->feed_frame = cpp->frame;
+	return 1;
+}
+
+int cpp_feed(struct cpp *cpp, const char *data, size_t len) {
+	struct tokenizer *t = &cpp->feed_frame->t;
+	size_t used;
+	if(cpp->feed_failed) return 0;
+	/* drop what was processed, once it's most of the buffer */
+	used = tokenizer_ftello(t);
+	if(used >= 4096 && used >= cpp->feed.len / 2 && !t->peeking) {
+		memmove(cpp->feed.buf, cpp->feed.buf + used, cpp->feed.len - used);
+		cpp->feed.len -= used;
+		t->mem_pos -= used;
+		cpp->scan.pos -= used;
+		cpp->scan.safe -= used;
+		cpp->scan.eol -= used;
+	}
+	cpp_sink_write(&cpp->feed, data, len);
+	if(cpp->feed.error) {
+		cpp->feed_failed = 1;
+		return 0;
+	}
+	scan_input(&cpp->scan, cpp->feed.buf, cpp->feed.len);
+	return feed_steps(cpp, cpp->scan.safe, 0);
+}
+
+int cpp_finish(struct cpp *cpp) {
+	int ret = !cpp->feed_failed && feed_steps(cpp, cpp->feed.len, 1);
+	cpp_sink_fini(&cpp->feed);
+	cpp->feed_frame = 0;
+	return cpp_sink_flush(cpp->feed_out) && ret;
+}
+
+static int file_write(void *f, const char *data, size_t len) {
+	return fwrite(data, 1, len, f) == len;
+}
+
+int cpp_run(struct cpp *cpp, FILE* in, FILE* out, const char* inname) {
+	struct cpp_sink s;
+	cpp_sink_init(&s, file_write, out);
+	int ret = cpp_run_sink(cpp, in, &s, inname);
+	return cpp_sink_fini(&s) && ret;
+}
+
+int cpp_run_tokens(struct cpp *cpp, FILE* in, cpp_token_func fn, void *ctx, const char* inname) {
+	return run_tokens(cpp, in, 0, 0, fn, ctx, inname);
+}
+
+const struct cpp_stats *cpp_get_stats(struct cpp *cpp) {
+	return &cpp->stats;
+}
+
+void cpp_stats_add(struct cpp_stats *to, const struct cpp_stats *from) {
+	to->includes += from->includes;
+	to->guard_skips += from->guard_skips;
+	to->once_skips += from->once_skips;
+	to->resolve_hits += from->resolve_hits;
+	to->stat_calls += from->stat_calls;
+	to->token_cache_hits += from->token_cache_hits;
+	to->token_cache_writes += from->token_cache_writes;
+	to->tokens_replayed += from->tokens_replayed;
+	to->skeleton_skips += from->skeleton_skips;
+	to->condition_cache_hits += from->condition_cache_hits;
+	to->ladder_jumps += from->ladder_jumps;
+	to->prelexed += from->prelexed;
+	to->spec_chunks += from->spec_chunks;
+	to->spec_reruns += from->spec_reruns;
+	to->include_runs += from->include_runs;
+}
+
+void cpp_set_profile(struct cpp *cpp, const struct cpp_profile *profile) {
+	hbmap_iter k;
+	free(cpp->profile_shadow);
+	cpp->profile_shadow = 0;
+	cpp->profile = profile;
+	/* any name may have changed meaning */
+	hbmap_foreach(cpp->macro_gens, k)
+		hbmap_getval(cpp->macro_gens, k)->gen++;
+}
+
+static void write_c_string(FILE *out, const char *s, size_t len) {
+	size_t i;
+	fputc('"', out);
+	for(i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if(c == '"' || c == '\\') fprintf(out, "\\%c", c);
+		else if(c == '\n') fputs("\\n", out);
+		/* don't let "??" form a trigraph */
+		else if(c == '?' && i && s[i-1] == '?') fputs("\\?", out);
+		else if(c < ' ' || c > '~') fprintf(out, "\\%03o", c);
+		else fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+int cpp_write_profile(struct cpp *cpp, FILE *out, const char *name, const char *cname) {
+	size_t count = 0, nbuckets = 1, i, j;
+	hbmap_iter k;
+	char **names;
+	hbmap_foreach(cpp->macros, k)
+		if(!(hbmap_getval(cpp->macros, k).num_args & MACRO_FLAG_BUILTIN)) ++count;
+	if(!(names = malloc((count + 1) * sizeof(char*)))) return 0;
+	count = 0;
+	hbmap_foreach(cpp->macros, k)
+		if(!(hbmap_getval(cpp->macros, k).num_args & MACRO_FLAG_BUILTIN))
+			names[count++] = hbmap_getkey(cpp->macros, k);
+	/* sorted, so the generated file only changes with the profile */
+	qsort(names, count, sizeof(char*), strptrcmp);
+	while(nbuckets < count * 2) nbuckets *= 2;
+	unsigned *buckets = calloc(nbuckets, sizeof(unsigned));
+	if(!buckets) {
+		free(names);
+		return 0;
+	}
+
+	fprintf(out, "/* profile %s, %zu macros */\n\n", name, count);
+	for(i = 0; i < count; i++) {
+		struct macro *m = get_macro(cpp, names[i]);
+		if(!MACRO_ARGCOUNT(m)) continue;
+		fprintf(out, "static const char *const %s_args%zu[] = { ", cname, i);
+		for(j = 0; j < MACRO_ARGCOUNT(m); j++) {
+			write_c_string(out, m->argnames[j], strlen(m->argnames[j]));
+			fputs(", ", out);
+		}
+		fputs("};\n", out);
+	}
+	fprintf(out, "\nstatic const struct cpp_profile_macro %s_macros[] = {\n", cname);
+	for(i = 0; i < count; i++) {
+		struct macro *m = get_macro(cpp, names[i]);
+		unsigned h = string_hash(names[i]);
+		fputs("\t{ ", out);
+		write_c_string(out, names[i], strlen(names[i]));
+		fputs(", ", out);
+		if(m->str_contents_buf)
+			write_c_string(out, m->str_contents_buf, m->str_contents_len);
+		else
+			fputs("0", out);
+		if(MACRO_ARGCOUNT(m))
+			fprintf(out, ", %s_args%zu", cname, i);
+		else
+			fputs(", 0", out);
+		fprintf(out, ", %zu, %#xU, %#xU },\n", m->str_contents_len,
+			m->num_args & ~MACRO_FLAG_BORROWED, h);
+		for(j = h & (nbuckets - 1); buckets[j]; j = (j + 1) & (nbuckets - 1));
+		buckets[j] = i + 1;
+	}
+	if(!count) fputs("\t{ 0 },\n", out);
+	fprintf(out, "};\n\nstatic const unsigned %s_buckets[] = {", cname);
+	for(i = 0; i < nbuckets; i++)
+		fprintf(out, "%s%u,", i % 16 ? " " : "\n\t", buckets[i]);
+	fprintf(out, "\n};\n\n"
+		"const struct cpp_profile cpp_profile_%s = {\n"
+		"\t.name = ", cname);
+	write_c_string(out, name, strlen(name));
+	fprintf(out, ",\n"
+		"\t.macros = %s_macros,\n"
+		"\t.count = %zu,\n"
+		"\t.buckets = %s_buckets,\n"
+		"\t.nbuckets = %zu,\n"
+		"};\n\n", cname, count, cname, nbuckets);
+	free(buckets);
+	free(names);
+	return !ferror(out);
+}
+
+/* snapshot file layout (native byte order, all offsets from file start):
+   header, deps[ndeps], macros[nmacros], args[nargs], guards[nguards],
+   once[nonce], string table.
+   string references are offsets into the string table. */
+
+#define SNAPSHOT_MAGIC "tcppsnap"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BYTE_ORDER 0x01020304U
+#define SNAPSHOT_NONE 0xffffffffU
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t config_hash;
+	uint32_t ndeps, nmacros, nargs, nguards, nonce;
+	uint32_t deps_off, macros_off, args_off, guards_off, once_off;
+	uint32_t strings_off, strings_size;
+};
+
+struct snapshot_dep {
+	uint32_t path;
+	uint32_t pad;
+	struct file_stamp stamp;
+};
+
+struct snapshot_macro {
+	uint32_t name;
+	uint32_t num_args;
+	uint32_t body;   /* SNAPSHOT_NONE for content-less macros */
+	uint32_t body_len;
+	uint32_t args;   /* index of the first argname in args[] */
+};
+
+struct snapshot_guard {
+	uint32_t path;
+	uint32_t macro;
+	uint32_t output;
+};
+
+struct growbuf {
+	char *data;
+	size_t len, cap;
+};
+
+static uint32_t growbuf_add(struct growbuf *b, const void *data, size_t len) {
+	size_t off = b->len;
+	if(b->len + len > b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 4096;
+		while(cap < b->len + len) cap *= 2;
+		char *n = realloc(b->data, cap);
+		if(!n) return SNAPSHOT_NONE;
+		b->data = n;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return off;
+}
+
+static uint32_t growbuf_addstr(struct growbuf *b, const char *s) {
+	return growbuf_add(b, s, strlen(s) + 1);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+	const char *p = data;
+	while(len) {
+		ssize_t n = write(fd, p, len);
+		if(n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+int cpp_save_snapshot(struct cpp *cpp, const char *fn) {
+	struct growbuf deps = {0}, macros = {0}, args = {0}, guards = {0}, once = {0}, strs = {0};
+	struct snapshot_header h = {
+		.magic = SNAPSHOT_MAGIC,
+		.version = SNAPSHOT_VERSION,
+		.byte_order = SNAPSHOT_BYTE_ORDER,
+		.config_hash = config_hash(cpp),
+	};
+	hbmap_iter k;
+	size_t i;
+	int ret = 0;
+	if(cpp->profile) for(i = 0; i < cpp->profile->count; i++)
+		get_macro(cpp, cpp->profile->macros[i].name);
+	hbmap_foreach(cpp->deps, k) {
+		struct snapshot_dep d = {
+			.path = growbuf_addstr(&strs, hbmap_getkey(cpp->deps, k)),
+			.stamp = hbmap_getval(cpp->deps, k),
+		};
+		growbuf_add(&deps, &d, sizeof d);
+		h.ndeps++;
+	}
+	hbmap_foreach(cpp->macros, k) {
+		struct macro *m = &hbmap_getval(cpp->macros, k);
+		if(m->num_args & MACRO_FLAG_BUILTIN) continue;
+		struct snapshot_macro sm = {
+			.name = growbuf_addstr(&strs, hbmap_getkey(cpp->macros, k)),
+			.num_args = m->num_args & ~MACRO_FLAG_BORROWED,
+			.body = SNAPSHOT_NONE,
+			.body_len = m->str_contents_len,
+			.args = h.nargs,
+		};
+		if(m->str_contents_buf)
+			sm.body = growbuf_add(&strs, m->str_contents_buf, m->str_contents_len + 1);
+		for(i = 0; i < MACRO_ARGCOUNT(m); i++) {
+			uint32_t a = growbuf_addstr(&strs, m->argnames[i]);
+			growbuf_add(&args, &a, sizeof a);
+			h.nargs++;
+		}
+		growbuf_add(&macros, &sm, sizeof sm);
+		h.nmacros++;
+	}
+	hbmap_foreach(cpp->guards, k) {
+		struct snapshot_guard sg = {
+			.path = growbuf_addstr(&strs, hbmap_getkey(cpp->guards, k)),
+			.macro = growbuf_addstr(&strs, hbmap_getval(cpp->guards, k).macro),
+			.output = growbuf_addstr(&strs, hbmap_getval(cpp->guards, k).output),
+		};
+		growbuf_add(&guards, &sg, sizeof sg);
+		h.nguards++;
+	}
+	/* file identities can change, so only the paths are stored */
+	hbmap_foreach(cpp->once, k) {
+		uint32_t path = growbuf_addstr(&strs, hbmap_getval(cpp->once, k).path);
+		growbuf_add(&once, &path, sizeof path);
+		h.nonce++;
+	}
+	h.deps_off = sizeof h;
+	h.macros_off = h.deps_off + deps.len;
+	h.args_off = h.macros_off + macros.len;
+	h.guards_off = h.args_off + args.len;
+	h.once_off = h.guards_off + guards.len;
+	h.strings_off = h.once_off + once.len;
+	h.strings_size = strs.len;
+	if(deps.len != h.ndeps * sizeof(struct snapshot_dep) ||
+	   macros.len != h.nmacros * sizeof(struct snapshot_macro) ||
+	   args.len != h.nargs * sizeof(uint32_t) ||
+	   guards.len != h.nguards * sizeof(struct snapshot_guard) ||
+	   once.len != h.nonce * sizeof(uint32_t) ||
+	   (uint64_t) h.strings_off + strs.len > SNAPSHOT_NONE)
+		goto out; /* allocation failure or too big */
+
+	/* write to a temporary and rename, so concurrent readers never see
+	   a partially written snapshot */
+	char tmp[PATH_MAX];
+	if((size_t) snprintf(tmp, sizeof tmp, "%s.%ld.tmp", fn, (long) getpid()) >= sizeof tmp) goto out;
+	int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd == -1) goto out;
+	ret = write_all(fd, &h, sizeof h) &&
+		write_all(fd, deps.data, deps.len) &&
+		write_all(fd, macros.data, macros.len) &&
+		write_all(fd, args.data, args.len) &&
+		write_all(fd, guards.data, guards.len) &&
+		write_all(fd, once.data, once.len) &&
+		write_all(fd, strs.data, strs.len);
+	if(close(fd)) ret = 0;
+	if(ret) ret = !rename(tmp, fn);
+	if(!ret) unlink(tmp);
+out:
+	free(deps.data);
+	free(macros.data);
+	free(args.data);
+	free(guards.data);
+	free(once.data);
+	free(strs.data);
+	return ret;
+}
+
+static int snapshot_string_ok(const struct snapshot_header *h, uint32_t off) {
+	return off < h->strings_size;
+}
+
+static int snapshot_valid(const char *map, size_t size) {
+	const struct snapshot_header *h = (const void*) map;
+	if(memcmp(h->magic, SNAPSHOT_MAGIC, sizeof h->magic) ||
+	   h->version != SNAPSHOT_VERSION ||
+	   h->byte_order != SNAPSHOT_BYTE_ORDER) return 0;
+	if((uint64_t) h->deps_off + (uint64_t) h->ndeps * sizeof(struct snapshot_dep) > size ||
+	   (uint64_t) h->macros_off + (uint64_t) h->nmacros * sizeof(struct snapshot_macro) > size ||
+	   (uint64_t) h->args_off + (uint64_t) h->nargs * sizeof(uint32_t) > size ||
+	   (uint64_t) h->guards_off + (uint64_t) h->nguards * sizeof(struct snapshot_guard) > size ||
+	   (uint64_t) h->once_off + (uint64_t) h->nonce * sizeof(uint32_t) > size ||
+	   (uint64_t) h->strings_off + h->strings_size != size ||
+	   h->deps_off % 8 || h->macros_off % 4 || h->args_off % 4 || h->guards_off % 4 || h->once_off % 4)
+		return 0;
+	/* a terminated string table means every string in it is terminated */
+	if(!h->strings_size || map[size-1]) return 0;
+	const struct snapshot_dep *d = (const void*)(map + h->deps_off);
+	const struct snapshot_macro *m = (const void*)(map + h->macros_off);
+	const uint32_t *a = (const void*)(map + h->args_off);
+	const struct snapshot_guard *g = (const void*)(map + h->guards_off);
+	const uint32_t *o = (const void*)(map + h->once_off);
+	uint32_t i, j;
+	for(i = 0; i < h->nonce; i++)
+		if(!snapshot_string_ok(h, o[i])) return 0;
+	for(i = 0; i < h->ndeps; i++)
+		if(!snapshot_string_ok(h, d[i].path)) return 0;
+	for(i = 0; i < h->nguards; i++)
+		if(!snapshot_string_ok(h, g[i].path) ||
+		   !snapshot_string_ok(h, g[i].macro) ||
+		   !snapshot_string_ok(h, g[i].output)) return 0;
+	for(i = 0; i < h->nmacros; i++) {
+		unsigned argc = m[i].num_args & MACRO_ARGCOUNT_MASK;
+		if(!snapshot_string_ok(h, m[i].name) ||
+		   (m[i].num_args & (MACRO_FLAG_BORROWED|MACRO_FLAG_BUILTIN)) ||
+		   (uint64_t) m[i].args + argc > h->nargs) return 0;
+		if(m[i].body != SNAPSHOT_NONE &&
+		   ((uint64_t) m[i].body + m[i].body_len >= h->strings_size ||
+		    map[h->strings_off + m[i].body + m[i].body_len])) return 0;
+		for(j = 0; j < argc; j++)
+			if(!snapshot_string_ok(h, a[m[i].args + j])) return 0;
+	}
+	return 1;
+}
+
+/* check that none of the files the snapshot was made from changed */
+static int snapshot_fresh(struct cpp *cpp, const char *map) {
+	const struct snapshot_header *h = (const void*) map;
+	const struct snapshot_dep *d = (const void*)(map + h->deps_off);
+	const char *strs = map + h->strings_off;
+	uint32_t i;
+	if(h->config_hash != config_hash(cpp)) return 0;
+	for(i = 0; i < h->ndeps; i++) {
+		struct stat st;
+		if(stat(strs + d[i].path, &st) ||
+		   st.st_size != d[i].stamp.size ||
+		   st.st_mtim.tv_sec != d[i].stamp.mtime_sec ||
+		   st.st_mtim.tv_nsec != d[i].stamp.mtime_nsec) return 0;
+	}
+	return 1;
+}
+
+int cpp_load_snapshot(struct cpp *cpp, const char *fn) {
+	struct stat st;
+	void *map = MAP_FAILED;
+	int fd = open(fn, O_RDONLY);
+	if(fd == -1) return 0;
+	if(!fstat(fd, &st) && st.st_size >= (off_t) sizeof(struct snapshot_header))
+		map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return 0;
+	if(!snapshot_valid(map, st.st_size) || !snapshot_fresh(cpp, map)) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+	const char *base = map;
+	const struct snapshot_header *h = map;
+	const struct snapshot_dep *d = (const void*)(base + h->deps_off);
+	const struct snapshot_macro *sm = (const void*)(base + h->macros_off);
+	const uint32_t *a = (const void*)(base + h->args_off);
+	const struct snapshot_guard *sg = (const void*)(base + h->guards_off);
+	const uint32_t *so = (const void*)(base + h->once_off);
+	char *strs = (char*) base + h->strings_off;
+	uint32_t i;
+	struct mapping mp = {.addr = map, .size = st.st_size};
+	if(h->nargs && !(mp.args = malloc(h->nargs * sizeof(char*)))) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+	for(i = 0; i < h->nargs; i++)
+		mp.args[i] = strs + a[i];
+	for(i = 0; i < h->ndeps; i++)
+		if(hbmap_find(cpp->deps, strs + d[i].path) == (hbmap_iter) -1)
+			hbmap_insert(cpp->deps, strdup(strs + d[i].path), d[i].stamp);
+	/* the guarded files are among the deps, so these are still valid */
+	for(i = 0; i < h->nguards; i++)
+		if(hbmap_find(cpp->guards, strs + sg[i].path) == (hbmap_iter) -1) {
+			struct include_guard g = {
+				.macro = strdup(strs + sg[i].macro),
+				.output = strdup(strs + sg[i].output),
+			};
+			hbmap_insert(cpp->guards, strdup(strs + sg[i].path), g);
+		}
+	for(i = 0; i < h->nonce; i++) {
+		struct filecache_key id;
+		if(stat_file(cpp, strs + so[i], &id))
+			mark_once(cpp, strs + so[i], &id);
+	}
+	/* names and bodies are used in place, only the table is built */
+	for(i = 0; i < h->nmacros; i++) {
+		struct macro m = {
+			.num_args = sm[i].num_args | MACRO_FLAG_BORROWED,
+			.str_contents_buf = sm[i].body == SNAPSHOT_NONE ? 0 : strs + sm[i].body,
+			.str_contents_len = sm[i].body_len,
+			.argnames = mp.args + sm[i].args,
+		};
+		add_macro(cpp, strs + sm[i].name, &m);
+	}
+	tglist_add(&cpp->mappings, mp);
+	return 1;
 }
@@ -2,19 +2,239 @@
 #define PREPROC_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 struct cpp;
 
+/* a const table of predefined macros, emitted at build time by
+   cpp_write_profile() (see mkprofile.c) and linked into the binary. */
+struct cpp_profile_macro {
+	const char *name;
+	const char *body; /* 0 for content-less macros */
+	const char *const *argnames;
+	unsigned body_len;
+	unsigned num_args; /* argument count and flags as used by preproc.c */
+	unsigned hash;
+};
+
+struct cpp_profile {
+	const char *name;
+	const struct cpp_profile_macro *macros;
+	unsigned count;
+	const unsigned *buckets; /* macro index + 1, or 0 for an empty slot */
+	unsigned nbuckets; /* power of 2 */
+};
+
+/* 0-terminated list of the profiles in the generated profiles.c */
+extern const struct cpp_profile *const cpp_profiles[];
+
+/* counters, for tuning */
+struct cpp_stats {
+	unsigned long includes; /* #include directives processed */
+	unsigned long guard_skips; /* includes skipped due to an include guard */
+	unsigned long once_skips; /* includes skipped due to #pragma once */
+	unsigned long resolve_hits; /* includes found in the lookup cache */
+	unsigned long stat_calls; /* files looked up on disk */
+	unsigned long token_cache_hits; /* headers with cached tokens */
+	unsigned long token_cache_writes; /* headers stored in the token cache */
+	unsigned long tokens_replayed; /* tokens taken from the token cache */
+	unsigned long skeleton_skips; /* inactive blocks skipped without lexing */
+	unsigned long condition_cache_hits; /* #if results reused */
+	unsigned long ladder_jumps; /* #if/#elif ladders resolved by lookup */
+	unsigned long prelexed; /* files lexed ahead in parallel */
+	unsigned long spec_chunks; /* chunks processed speculatively and kept */
+	unsigned long spec_reruns; /* chunks processed again as their assumptions broke */
+	unsigned long include_runs; /* runs of #include lines processed as chunks */
+};
+/* add the counters of from to to */
+void cpp_stats_add(struct cpp_stats *to, const struct cpp_stats *from);
+
+/* where output goes. it is collected in a buffer and passed on in large
+   blocks, or kept in memory. the fields are private, set a sink up with
+   one of the cpp_sink_init functions and release it with cpp_sink_fini(). */
+typedef int (*cpp_sink_func)(void *ctx, const char *data, size_t len);
+
+struct cpp_sink {
+	char *buf;
+	size_t len, cap;
+	cpp_sink_func write; /* 0 for fd and memory sinks */
+	void *ctx;
+	int fd; /* -1 unless writing to a file descriptor */
+	int error;
+	void *tokens; /* set by cpp_run_tokens() */
+};
+
+/* hand output to write(), which returns 0 on failure */
+void cpp_sink_init(struct cpp_sink *s, cpp_sink_func write, void *ctx);
+/* write to fd. data that doesn't fit the buffer goes out in the same
+   writev() as the buffered part. */
+void cpp_sink_init_fd(struct cpp_sink *s, int fd);
+/* keep everything in a growing buffer */
+void cpp_sink_init_mem(struct cpp_sink *s);
+void cpp_sink_write(struct cpp_sink *s, const char *data, size_t len);
+void cpp_sink_puts(struct cpp_sink *s, const char *str);
+void cpp_sink_putc(struct cpp_sink *s, int c);
+/* append n copies of c */
+void cpp_sink_fill(struct cpp_sink *s, int c, size_t n);
+/* pass on what is buffered. returns 0 if any write failed so far. */
+int cpp_sink_flush(struct cpp_sink *s);
+/* memory sinks: the contents so far, 0-terminated. stays valid until
+   the next write. */
+const char *cpp_sink_data(struct cpp_sink *s, size_t *len);
+/* memory sinks: the contents as a malloc()ed string, the sink is empty
+   afterwards. */
+char *cpp_sink_take(struct cpp_sink *s, size_t *len);
+/* memory sinks: drop the contents but keep the buffer */
+void cpp_sink_clear(struct cpp_sink *s);
+/* flush and release. returns 0 if any write failed. */
+int cpp_sink_fini(struct cpp_sink *s);
+
+/* an error or warning. file and line are where it was found, text is
+   the token or line it is about. */
+struct cpp_diag {
+	int is_error;
+	const char *file;
+	unsigned line, column;
+	const char *msg;
+	const char *text;
+};
+
+/* receives the diagnostics of one struct cpp. the strings are only
+   valid during the call. */
+typedef void (*cpp_diag_func)(void *ctx, const struct cpp_diag *d);
+
+enum cpp_flags {
+	/* read each include dir once, so lookups of files that aren't in it
+	   need no syscalls. pays off with many include dirs. */
+	CPP_FLAG_LIST_DIRS = 1 << 0,
+	/* cpp_run(), cpp_run_sink() and cpp_run_buffer() write each run of
+	   whitespace as one space and leave out leading and trailing
+	   whitespace. runs of blank lines become one. */
+	CPP_FLAG_COMPACT = 1 << 1,
+	/* with CPP_FLAG_COMPACT, leave out blank lines entirely and write
+	   #line markers where needed to keep the first token of each line
+	   at its original file and line. */
+	CPP_FLAG_LINE_MARKERS = 1 << 2,
+};
+
+/* an instance is used by one thread at a time; distinct instances
+   may run in parallel, the file cache they share is locked. there is
+   no other global state, so a process can have any number of them. */
 struct cpp *cpp_new(void);
+/* releases what the instance owns. freeing the instance itself is
+   left to the caller, as it always was. */
 void cpp_free(struct cpp*);
+/* cpp_free(), then free() the instance */
+void cpp_destroy(struct cpp*);
 void cpp_add_includedir(struct cpp *cpp, const char* includedir);
+void cpp_set_flags(struct cpp *cpp, int flags);
+/* pass diagnostics to fn instead of printing them to stderr. 0
+   restores the default. */
+void cpp_set_diag(struct cpp *cpp, cpp_diag_func fn, void *ctx);
+/* store the tokens of included headers in dir, keyed by their contents,
+   and take them from there instead of lexing again. the directory may
+   be shared by concurrent runs. 0 turns the cache off. */
+void cpp_set_token_cache(struct cpp *cpp, const char *dir);
+/* lex memory input of 1 MiB and more ahead on n threads besides the
+   one processing it: the main file of cpp_run_buffer() and included
+   files that aren't in the token cache. 0, the default, turns it off. */
+void cpp_set_lex_threads(struct cpp *cpp, unsigned n);
+/* process the main file of cpp_run_buffer() of 1 MiB and more in
+   chunks cut at top level line ends, processing the later ones ahead
+   on n threads besides the calling one. each assumes the macros and
+   the include guards and once files as they were before the chunks
+   processed along with it, and is done again where one of those it
+   looked up was changed in between. runs of #include lines in memory
+   input are processed the same way, a line per chunk. the output is
+   the same. doesn't apply with CPP_FLAG_COMPACT. 0, the default,
+   turns it off. */
+void cpp_set_spec_threads(struct cpp *cpp, unsigned n);
 int cpp_add_define(struct cpp *cpp, const char *mdecl);
+/* make #include "name" and #include <name> read the len bytes at data,
+   which are copied, instead of looking for a file. name must be
+   spelled exactly as in the directive. registering a name again
+   replaces its contents. returns 0 if out of memory. */
+int cpp_add_include_buffer(struct cpp *cpp, const char *name, const char *data, size_t len);
 int cpp_run(struct cpp *cpp, FILE* in, FILE* out, const char* inname);
+/* like cpp_run(), writing to out, which is flushed before returning.
+   returns 0 on errors, including failed writes. */
+int cpp_run_sink(struct cpp *cpp, FILE* in, struct cpp_sink *out, const char* inname);
+/* like cpp_run_sink(), reading the input from the len bytes at src,
+   which needn't be 0-terminated. */
+int cpp_run_buffer(struct cpp *cpp, const char *src, size_t len, struct cpp_sink *out, const char* inname);
+/* pull interface: after cpp_open(), each cpp_read() processes just
+   enough of the input to return up to n bytes of output. returns the
+   byte count, 0 at the end, or -1 after an error. the output of a
+   single token or macro expansion is buffered as a whole. cpp_close()
+   ends processing even if not all was read, and returns 0 if there
+   were errors. no other run may use cpp in between. */
+int cpp_open(struct cpp *cpp, FILE* in, const char* inname);
+ssize_t cpp_read(struct cpp *cpp, char *buf, size_t n);
+int cpp_close(struct cpp *cpp);
+
+/* push interface, for input that arrives in pieces: after cpp_start(),
+   each cpp_feed() processes as much of the input passed so far as is
+   complete, i.e. up to the last line that doesn't end inside a comment,
+   a continued line or an open parenthesis. the latter holds back at
+   most 1 MiB, except in the arguments of a macro call, which wait for
+   the end of the call. a call that starts in the expansion of another
+   macro (#define G x F, then G(...)) fails there instead.
+   cpp_finish() processes the rest, flushes out and ends the run. all
+   return 0 after errors. no other run may use cpp in between. */
+int cpp_start(struct cpp *cpp, struct cpp_sink *out, const char* inname);
+int cpp_feed(struct cpp *cpp, const char *data, size_t len);
+int cpp_finish(struct cpp *cpp);
+const struct cpp_stats *cpp_get_stats(struct cpp *cpp);
+
+/* a token of the output, as delivered by cpp_run_tokens(). whitespace
+   and newlines are passed on too, as one TT_SEP token per character. */
+struct cpp_token {
+	int type; /* enum tokentype, see tokenizer.h */
+	int value; /* the character of TT_SEP tokens */
+	const char *text; /* spelling, 0-terminated */
+	size_t len;
+	const char *file; /* where the token, or the macro it came from, is */
+	unsigned line;
+	unsigned inclusion; /* numbers the files entered in a run, 1 is the
+	                       input. tells two inclusions of a file apart. */
+	int from_macro; /* produced by expanding a macro */
+};
+
+/* receives count tokens, which stay valid until it returns. returning
+   0 makes cpp_run_tokens() fail, no more tokens are passed on then. */
+typedef int (*cpp_token_func)(void *ctx, const struct cpp_token *toks, size_t count);
+
+/* like cpp_run_sink(), but passes the output on in batches of tokens
+   instead of text, so it needn't be lexed again. */
+int cpp_run_tokens(struct cpp *cpp, FILE* in, cpp_token_func fn, void *ctx, const char* inname);
+
+/* make the macros of profile visible without parsing them. a macro is
+   added to the macro table lazily, the first time it is looked up,
+   borrowing the profile's data, so only the table entry is allocated.
+   meant to be called right after cpp_new(); macros defined later take
+   precedence. */
+void cpp_set_profile(struct cpp *cpp, const struct cpp_profile *profile);
+/* write the current macro table as C source of a struct cpp_profile
+   named cpp_profile_<cname>, with name as its profile name. */
+int cpp_write_profile(struct cpp *cpp, FILE *out, const char *name, const char *cname);
+
+/* serialize the macro table into a versioned binary file.
+   the snapshot records size and mtime of every file processed so far,
+   as well as the include dirs and defines configured before the first
+   cpp_run(). returns 1 on success. */
+int cpp_save_snapshot(struct cpp *cpp, const char *fn);
+/* map a snapshot and use its macros in place.
+   returns 0 if it doesn't exist, is damaged, or any of the files it was
+   made from or the configuration changed. the caller should then
+   process the original headers instead. */
+int cpp_load_snapshot(struct cpp *cpp, const char *fn);
 
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wunknown-pragmas"
 #endif
 #pragma RcB2 DEP "preproc.c"
+#pragma RcB2 DEP "sink.c"
 
 #endif
 
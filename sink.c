@@ -0,0 +1,150 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "preproc.h"
+
+#define SINK_BUFSIZE (64 * 1024)
+#define SINK_MEM_MIN 64
+
+#define is_mem(S) (!(S)->write && (S)->fd == -1)
+
+void cpp_sink_init(struct cpp_sink *s, cpp_sink_func write, void *ctx) {
+	*s = (struct cpp_sink) {.write = write, .ctx = ctx, .fd = -1};
+}
+
+void cpp_sink_init_fd(struct cpp_sink *s, int fd) {
+	*s = (struct cpp_sink) {.fd = fd};
+}
+
+void cpp_sink_init_mem(struct cpp_sink *s) {
+	*s = (struct cpp_sink) {.fd = -1};
+}
+
+static int write_fd(int fd, struct iovec *iov, int cnt) {
+	while(cnt) {
+		ssize_t n = writev(fd, iov, cnt);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return 0;
+		}
+		while(cnt && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if(cnt) {
+			iov->iov_base = (char*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 1;
+}
+
+/* pass on the buffer, followed by data */
+static void pass_on(struct cpp_sink *s, const char *data, size_t len) {
+	if(s->error) ;
+	else if(s->fd != -1) {
+		struct iovec iov[2] = {
+			{.iov_base = s->buf, .iov_len = s->len},
+			{.iov_base = (void*) data, .iov_len = len},
+		};
+		if(!write_fd(s->fd, iov, 2)) s->error = 1;
+	} else if((s->len && !s->write(s->ctx, s->buf, s->len)) ||
+	          (len && !s->write(s->ctx, data, len))) s->error = 1;
+	s->len = 0;
+}
+
+/* room for len more bytes and a 0 */
+static int mem_reserve(struct cpp_sink *s, size_t len) {
+	size_t cap = s->cap ? s->cap : SINK_MEM_MIN;
+	char *n;
+	if(s->error) return 0;
+	if(len < s->cap - s->len) return 1;
+	while(len >= cap - s->len) cap *= 2;
+	if(!(n = realloc(s->buf, cap))) {
+		s->error = 1;
+		return 0;
+	}
+	s->buf = n;
+	s->cap = cap;
+	return 1;
+}
+
+void cpp_sink_write(struct cpp_sink *s, const char *data, size_t len) {
+	if(len < s->cap - s->len) {
+		memcpy(s->buf + s->len, data, len);
+		s->len += len;
+	} else if(is_mem(s)) {
+		if(!mem_reserve(s, len)) return;
+		memcpy(s->buf + s->len, data, len);
+		s->len += len;
+	} else if(!s->buf && !s->error && len < SINK_BUFSIZE) {
+		/* unbuffered if this fails */
+		if((s->buf = malloc(SINK_BUFSIZE))) s->cap = SINK_BUFSIZE;
+		cpp_sink_write(s, data, len);
+	} else pass_on(s, data, len);
+}
+
+void cpp_sink_puts(struct cpp_sink *s, const char *str) {
+	cpp_sink_write(s, str, strlen(str));
+}
+
+void cpp_sink_putc(struct cpp_sink *s, int c) {
+	char ch = c;
+	if(s->len + 1 < s->cap) s->buf[s->len++] = ch;
+	else cpp_sink_write(s, &ch, 1);
+}
+
+void cpp_sink_fill(struct cpp_sink *s, int c, size_t n) {
+	char block[64];
+	size_t k;
+	if(n < s->cap - s->len) {
+		memset(s->buf + s->len, c, n);
+		s->len += n;
+		return;
+	}
+	memset(block, c, n < sizeof block ? n : sizeof block);
+	for(; n; n -= k) {
+		k = n < sizeof block ? n : sizeof block;
+		cpp_sink_write(s, block, k);
+	}
+}
+
+int cpp_sink_flush(struct cpp_sink *s) {
+	if(!is_mem(s) && s->len) pass_on(s, 0, 0);
+	return !s->error;
+}
+
+const char *cpp_sink_data(struct cpp_sink *s, size_t *len) {
+	if(len) *len = s->len;
+	if(!mem_reserve(s, 0)) {
+		if(len) *len = 0;
+		return "";
+	}
+	s->buf[s->len] = 0;
+	return s->buf;
+}
+
+char *cpp_sink_take(struct cpp_sink *s, size_t *len) {
+	char *ret;
+	if(len) *len = s->len;
+	if(!mem_reserve(s, 0)) return 0;
+	s->buf[s->len] = 0;
+	ret = s->buf;
+	cpp_sink_init_mem(s);
+	return ret;
+}
+
+void cpp_sink_clear(struct cpp_sink *s) {
+	s->len = 0;
+}
+
+int cpp_sink_fini(struct cpp_sink *s) {
+	int ret = cpp_sink_flush(s);
+	free(s->buf);
+	s->buf = 0;
+	s->len = s->cap = 0;
+	return ret;
+}
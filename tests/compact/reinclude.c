@@ -0,0 +1,7 @@
+#include "inc/abc.h"
+#include "inc/abc.h"
+#define F(x, y) x y
+F(1,
+  2) d
+#include "inc/abc.h"
+end
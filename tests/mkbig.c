@@ -0,0 +1,123 @@
+/* writes an input of more than 1 MiB and the headers it includes to a
+   directory, for checking that the threaded and streaming modes give
+   the output a serial run gives, see tests/modes.sh.
+   usage: mkbig dir
+   dir gets big.c and inc/h*.h, to be run with -I dir/inc. big.c starts
+   with a run of #include lines, redefines a macro its blocks look up
+   every so often and has macro calls across lines, comments and
+   literals with parentheses in them. the main file doesn't use
+   __FILE__, as piped input is called stdin.
+   long.c has a macro call with more than 1 MiB of arguments, after an
+   unbalanced ( in a skipped block. */
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define NHEADERS 24
+#define NBLOCKS 3600
+#define NLONG 80000
+
+static char dir[4096];
+
+static FILE *create(const char *name) {
+	char path[4200];
+	FILE *f;
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	if(!(f = fopen(path, "w"))) perror(path);
+	return f;
+}
+
+/* with include guards, #pragma once or neither, including each other */
+static int write_header(int i) {
+	char name[32];
+	FILE *f;
+	snprintf(name, sizeof name, "inc/h%d.h", i);
+	if(!(f = create(name))) return 0;
+	if(i % 3 == 0) fprintf(f, "#ifndef H%d_H\n#define H%d_H\n", i, i);
+	else if(i % 3 == 1) fprintf(f, "#pragma once\n");
+	if(i) fprintf(f, "#include \"h%d.h\"\n", (i * 7) % i);
+	fprintf(f,
+		"#undef M%d\n"
+		"#define M%d(x, y) ((x) * %d + (y))\n"
+		"static const char *file%d = __FILE__;\n"
+		"#if M%d(1, 0) %% 2\n"
+		"int odd%d = M%d(__LINE__, 1);\n"
+		"#else\n"
+		"int even%d;\n"
+		"#endif\n",
+		i, i, i + 1, i, i, i, i, i);
+	if(i % 3 == 0) fprintf(f, "#endif\n");
+	return !fclose(f);
+}
+
+static void write_block(FILE *f, int i) {
+	int m = i % NHEADERS;
+	if(i % 50 == 0) fprintf(f, "#undef SCALE\n#define SCALE %d\n", i / 50);
+	if(i % 97 == 0) fprintf(f, "#include <h%d.h>\n", m);
+	fprintf(f,
+		"/* block %d: a comment with ( and \" in it */\n"
+		"static int f%d(int x) {\n"
+		"\tint v = MAX(x, SCALE) + M%d(x, 1); // ) %d\n"
+		"\tconst char *s = STR(f%d) \"\\\" ( \" XSTR(SCALE);\n"
+		"\tchar c = '(';\n"
+		"#if SCALE %% 3 == 0\n"
+		"\treturn CAT(v, ) * 3 + c;\n"
+		"#elif SCALE %% 3 == 1\n"
+		"\treturn v + __LINE__ + *s;\n"
+		"#else\n"
+		"\treturn LIST(v, x, %d)[0];\n"
+		"#endif\n"
+		"}\n"
+		"int g%d = MAX(\n"
+		"\t%d,\n"
+		"\tSCALE);\n"
+		"#define LOCAL%d(a) \\\n"
+		"\t(a + %d)\n"
+		"int l%d = LOCAL%d(M%d(1, 2));\n"
+		"#undef LOCAL%d\n",
+		i, i, m, i, i, i, i, i, i, i, i, i, m, i);
+}
+
+static int write_long(void) {
+	FILE *f;
+	int i;
+	if(!(f = create("long.c"))) return 0;
+	fprintf(f,
+		"#if 0\n"
+		"a stray ( in a skipped block\n"
+		"#endif\n"
+		"#define F(x, ...) [x|__VA_ARGS__]\n"
+		"int a = F(\n");
+	for(i = 0; i < NLONG; i++) fprintf(f, "\t(%d + x%d),\n", i, i);
+	fprintf(f, "\t0);\n");
+	for(i = 0; i < NLONG / 4; i++) fprintf(f, "int b%d = F(%d,\n\t%d);\n", i, i, i);
+	return !fclose(f);
+}
+
+int main(int argc, char **argv) {
+	char inc[4200];
+	FILE *f;
+	int i;
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s dir\n", argv[0]);
+		return 1;
+	}
+	snprintf(dir, sizeof dir, "%s", argv[1]);
+	snprintf(inc, sizeof inc, "%s/inc", dir);
+	if(mkdir(inc, 0755)) {
+		perror(inc);
+		return 1;
+	}
+	for(i = 0; i < NHEADERS; i++)
+		if(!write_header(i)) return 1;
+	if(!(f = create("big.c"))) return 1;
+	for(i = 0; i < NHEADERS; i++) fprintf(f, "#include \"h%d.h\"\n", i);
+	fprintf(f,
+		"#define CAT(a, b) a ## b\n"
+		"#define STR(x) #x\n"
+		"#define XSTR(x) STR(x)\n"
+		"#define MAX(a, b) ((a) > (b) ? (a) : (b))\n"
+		"#define LIST(...) { __VA_ARGS__ }\n");
+	for(i = 0; i < NBLOCKS; i++) write_block(f, i);
+	return fclose(f) != 0 || !write_long();
+}
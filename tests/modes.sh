@@ -0,0 +1,63 @@
+#!/bin/sh
+# runs the modes that process an input on several threads or in pieces
+# over one of more than 1 MiB, written by tests/mkbig, and compares each
+# output with that of a serial run.
+# usage: tests/modes.sh prog mkbig tokcat
+prog=$1 mkbig=$2 tokcat=$3
+dir=$(mktemp -d /tmp/cppmodes.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+"$mkbig" "$dir" || exit 1
+big="$dir/big.c"
+inc="-I $dir/inc"
+ref="$dir/ref"
+"$prog" $inc "$big" > "$ref" || { echo "FAIL: serial run"; exit 1; }
+fail=0
+
+# name, then a command writing the output to stdout, which must match ref
+mode() {
+	name=$1
+	shift
+	if ! eval "$@" > "$dir/out" || ! cmp -s "$ref" "$dir/out"; then
+		echo "FAIL: $name"
+		fail=1
+	fi
+}
+
+# fails unless the statistic that -s prints as name is above 0, so the
+# input keeps exercising what a mode is about. name, then the command.
+used() {
+	name=$1
+	shift
+	if ! eval "$@" 2>&1 >/dev/null | grep -q "^$name: [1-9]"; then
+		echo "FAIL: no $name"
+		fail=1
+	fi
+}
+
+# mapped and lexed ahead, and read from a pipe through cpp_feed()
+mode "-t" '"$prog" -t $inc "$big"'
+mode "-t, piped" 'cat "$big" | "$prog" -t $inc'
+
+# lexed ahead on a thread pool
+mode "-L 2" '"$prog" -L 2 $inc "$big"'
+
+# processed in chunks on worker threads, some of them again as they
+# looked up the macro redefined in between
+mode "-x 2" '"$prog" -x 2 $inc "$big"'
+used "chunks processed speculatively/again" '"$prog" -x 2 -s $inc "$big"'
+
+# the run of #include lines at the top, a line per chunk, with the lexing
+# threads as well
+mode "-x 2 -L 2" '"$prog" -x 2 -L 2 $inc "$big"'
+used "runs of #include lines processed as chunks" '"$prog" -x 2 -s $inc "$big"'
+
+# a token stream, read back by tokstream_read()
+mode "-b" '"$prog" -b $inc "$big" | "$tokcat"'
+
+# a macro call with more than 1 MiB of arguments, which the input fed
+# in pieces is cut in, after a stray ( in a skipped block
+ref="$dir/ref.long"
+"$prog" "$dir/long.c" > "$ref" || { echo "FAIL: serial run of long.c"; exit 1; }
+mode "-t, piped, a long macro call" 'cat "$dir/long.c" | "$prog" -t'
+
+exit $fail
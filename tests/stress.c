@@ -0,0 +1,190 @@
+/* runs many struct cpp instances at once over one generated corpus,
+   sharing the file cache and a token cache, and checks that each run
+   gives the output and diagnostics a serial run gave. meant to be
+   built with -fsanitize=thread, see the stress target in the Makefile.
+   usage: stress [-j threads] [-n rounds] */
+
+#define _XOPEN_SOURCE 700
+#include "../preproc.h"
+#include "../filecache.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#define NHEADERS 40
+#define NMAINS 16
+
+struct result {
+	uint64_t hash; /* of the output */
+	unsigned errors, warnings;
+	int ok;
+};
+
+static char dir[] = "/tmp/cppstress.XXXXXX";
+static char tokdir[sizeof dir + 7];
+static struct result ref[NMAINS];
+static unsigned rounds = 4;
+
+static unsigned long seed = 1;
+static unsigned rnd(unsigned n) {
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (seed >> 33) % n;
+}
+
+static int write_file(const char *name, const char *data) {
+	char path[256];
+	FILE *f;
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	if(!(f = fopen(path, "w"))) return 0;
+	fputs(data, f);
+	return !fclose(f);
+}
+
+/* headers with include guards, #pragma once or neither, including
+   each other, and mains including them. a few warn, one main fails. */
+static int make_corpus(void) {
+	char name[32], buf[4096];
+	int i, j, n;
+	for(i = 0; i < NHEADERS; i++) {
+		n = 0;
+		if(i % 3 == 0) n += snprintf(buf + n, sizeof buf - n, "#ifndef H%d_H\n#define H%d_H\n", i, i);
+		else if(i % 3 == 1) n += snprintf(buf + n, sizeof buf - n, "#pragma once\n");
+		for(j = 0; i && j < 2; j++)
+			n += snprintf(buf + n, sizeof buf - n, "#include \"h%u.h\"\n", rnd(i));
+		n += snprintf(buf + n, sizeof buf - n,
+			"#undef M%d\n#define M%d(x, y) ((x) * %d + y)\n"
+			"#if M%d(1, 0) %% 2\nint odd%d = M%d(__LINE__, 1);\n#else\nint even%d;\n#endif\n",
+			i, i, i, i, i, i, i);
+		if(i % 10 == 5) n += snprintf(buf + n, sizeof buf - n, "#warning h%d\n", i);
+		if(i % 3 == 0) n += snprintf(buf + n, sizeof buf - n, "#endif\n");
+		snprintf(name, sizeof name, "h%d.h", i);
+		if(!write_file(name, buf)) return 0;
+	}
+	for(i = 0; i < NMAINS; i++) {
+		n = 0;
+		for(j = 0; j < 6; j++) {
+			unsigned h = rnd(NHEADERS);
+			n += snprintf(buf + n, sizeof buf - n, "#include <h%u.h>\nint m%d_%d = M%u(%d, M%u(1, 2));\n", h, i, j, h, j, h);
+		}
+		if(i == NMAINS - 1) n += snprintf(buf + n, sizeof buf - n, "#error m%d\n", i);
+		snprintf(name, sizeof name, "m%d.c", i);
+		if(!write_file(name, buf)) return 0;
+	}
+	return 1;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void) st; (void) type; (void) ftw;
+	return remove(path);
+}
+
+static void count_diag(void *ctx, const struct cpp_diag *d) {
+	struct result *r = ctx;
+	if(d->is_error) r->errors++;
+	else r->warnings++;
+}
+
+/* FNV-1a */
+static uint64_t hash(const char *p, size_t n) {
+	uint64_t h = 14695981039346656037ULL;
+	while(n--) h = (h ^ (unsigned char) *p++) * 1099511628211ULL;
+	return h;
+}
+
+/* odd rounds read the main file from memory */
+static void run(int i, unsigned round, struct result *r) {
+	struct cpp *cpp = cpp_new();
+	struct cpp_sink out;
+	char path[256], *src = 0;
+	size_t len;
+	FILE *in;
+	memset(r, 0, sizeof *r);
+	snprintf(path, sizeof path, "%s/m%d.c", dir, i);
+	if(!cpp || !(in = fopen(path, "r"))) {
+		if(cpp) cpp_destroy(cpp);
+		return;
+	}
+	cpp_add_includedir(cpp, dir);
+	cpp_set_token_cache(cpp, tokdir);
+	cpp_set_diag(cpp, count_diag, r);
+	cpp_sink_init_mem(&out);
+	if(round & 1) {
+		src = malloc(4096);
+		len = src ? fread(src, 1, 4096, in) : 0;
+		r->ok = src && cpp_run_buffer(cpp, src, len, &out, path);
+		free(src);
+	} else r->ok = cpp_run_sink(cpp, in, &out, path);
+	fclose(in);
+	src = (char*) cpp_sink_data(&out, &len);
+	r->hash = hash(src, len);
+	cpp_sink_fini(&out);
+	cpp_destroy(cpp);
+}
+
+static void *worker(void *arg) {
+	unsigned t = (uintptr_t) arg, round;
+	int i, failed = 0;
+	struct result r;
+	for(round = 0; round < rounds; round++)
+		for(i = 0; i < NMAINS; i++) {
+			/* each thread starts at another file */
+			int m = (i + t) % NMAINS;
+			run(m, round + t, &r);
+			if(r.hash != ref[m].hash || r.errors != ref[m].errors ||
+			   r.warnings != ref[m].warnings || r.ok != ref[m].ok) {
+				fprintf(stderr, "thread %u, round %u: m%d.c differs\n", t, round, m);
+				failed = 1;
+			}
+		}
+	return (void*) (uintptr_t) failed;
+}
+
+int main(int argc, char **argv) {
+	unsigned nthreads = 8, t;
+	pthread_t *threads;
+	void *failed;
+	int i, c, ret = 0;
+	while((c = getopt(argc, argv, "j:n:")) != EOF) switch(c) {
+		case 'j': nthreads = atoi(optarg); break;
+		case 'n': rounds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-j threads] [-n rounds]\n", argv[0]);
+			return 1;
+	}
+	if(!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(tokdir, sizeof tokdir, "%s/tokens", dir);
+	if(mkdir(tokdir, 0755) || !make_corpus()) {
+		perror("writing the corpus");
+		ret = 1;
+		goto out;
+	}
+	/* small enough that files are dropped while others use them */
+	filecache_set_limit(16 * 1024);
+	for(i = 0; i < NMAINS; i++) run(i, 0, &ref[i]);
+	if(!(threads = calloc(nthreads, sizeof *threads))) {
+		ret = 1;
+		goto out;
+	}
+	for(t = 0; t < nthreads; t++)
+		if(pthread_create(&threads[t], 0, worker, (void*) (uintptr_t) t)) {
+			fprintf(stderr, "pthread_create failed\n");
+			nthreads = t;
+			ret = 1;
+		}
+	for(t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], &failed);
+		if(failed) ret = 1;
+	}
+	free(threads);
+	if(!ret) printf("stress: %u threads, %u rounds of %d files, all identical\n", nthreads, rounds, NMAINS);
+out:
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
@@ -0,0 +1,37 @@
+/* reads a token stream, as written by cppmain -b, from stdin and writes
+   the text of its tokens to stdout. see tests/modes.sh. */
+
+#include "../tokstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void) {
+	struct tokstream_reader r;
+	struct cpp_token tok;
+	char *buf = 0, *p;
+	size_t len = 0, cap = 0, n;
+	int ret;
+	do {
+		if(len == cap) {
+			cap = cap ? cap * 2 : 1 << 16;
+			if(!(p = realloc(buf, cap))) {
+				free(buf);
+				return 1;
+			}
+			buf = p;
+		}
+		n = fread(buf + len, 1, cap - len, stdin);
+		len += n;
+	} while(n);
+	if(!tokstream_reader_init(&r, buf, len)) {
+		fprintf(stderr, "not a token stream\n");
+		free(buf);
+		return 1;
+	}
+	while((ret = tokstream_read(&r, &tok)) == 1)
+		fwrite(tok.text, 1, tok.len, stdout);
+	tokstream_reader_fini(&r);
+	free(buf);
+	if(ret) fprintf(stderr, "damaged token stream\n");
+	return ret != 0 || fflush(stdout) != 0;
+}
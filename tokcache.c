@@ -0,0 +1,238 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "tokcache.h"
+
+/* file layout (native byte order): header, records[count], strings.
+   the file name is derived from the hash and size of the contents. */
+
+#define TOKCACHE_MAGIC "tcpptok"
+#define TOKCACHE_VERSION 2
+#define TOKCACHE_BYTE_ORDER 0x01020304U
+
+struct tokcache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t content_hash;
+	uint64_t content_size;
+	uint32_t count;
+	uint32_t strings_size;
+	uint64_t image_hash; /* of everything after the header */
+};
+
+struct tokcache_writer {
+	struct token_record *records;
+	size_t count, cap;
+	char *strings;
+	size_t strings_size, strings_cap;
+	uint32_t *atoms; /* open addressing, string offset + 1 */
+	size_t natoms, atoms_cap;
+	int failed;
+};
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data;
+	if(!h) h = 0xcbf29ce484222325ULL;
+	while(len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void cache_name(char *buf, size_t size, const char *dir, const char *data, size_t len) {
+	snprintf(buf, size, "%s/%016llx-%llx.tok", dir,
+		(unsigned long long) fnv1a(0, data, len), (unsigned long long) len);
+}
+
+static int image_valid(const char *image, size_t size, const char *data, size_t len) {
+	const struct tokcache_header *h = (const void*) image;
+	const struct token_record *r = (const void*)(h + 1);
+	size_t i;
+	if(size < sizeof *h ||
+	   memcmp(h->magic, TOKCACHE_MAGIC, sizeof h->magic) ||
+	   h->version != TOKCACHE_VERSION ||
+	   h->byte_order != TOKCACHE_BYTE_ORDER ||
+	   h->content_size != len ||
+	   h->content_hash != fnv1a(0, data, len) ||
+	   sizeof *h + (uint64_t) h->count * sizeof *r + h->strings_size != size ||
+	   !h->strings_size || image[size - 1] ||
+	   h->image_hash != fnv1a(0, r, size - sizeof *h)) return 0;
+	for(i = 0; i < h->count; i++)
+		if(r[i].str >= h->strings_size || r[i].end > len ||
+		   (i && r[i].start < r[i-1].start)) return 0;
+	return 1;
+}
+
+static struct tokcache *tokcache_from_image(void *image, size_t size, int mapped) {
+	struct tokcache *tc = calloc(1, sizeof *tc);
+	const struct tokcache_header *h = image;
+	if(!tc) return 0;
+	tc->records = (const void*)(h + 1);
+	tc->count = h->count;
+	tc->strings = (const char*)(tc->records + h->count);
+	tc->image = image;
+	tc->image_size = size;
+	tc->mapped = mapped;
+	return tc;
+}
+
+struct tokcache *tokcache_open(const char *dir, const char *data, size_t size) {
+	char fn[4096];
+	struct stat st;
+	void *map = MAP_FAILED;
+	struct tokcache *tc;
+	cache_name(fn, sizeof fn, dir, data, size);
+	int fd = open(fn, O_RDONLY);
+	if(fd == -1) return 0;
+	if(!fstat(fd, &st) && st.st_size >= (off_t) sizeof(struct tokcache_header))
+		map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return 0;
+	if(!image_valid(map, st.st_size, data, size) ||
+	   !(tc = tokcache_from_image(map, st.st_size, 1))) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+	return tc;
+}
+
+void tokcache_free(struct tokcache *tc) {
+	if(!tc) return;
+	if(tc->mapped) munmap(tc->image, tc->image_size);
+	else free(tc->image);
+	free(tc);
+}
+
+struct tokcache_writer *tokcache_writer_new(void) {
+	return calloc(1, sizeof(struct tokcache_writer));
+}
+
+void tokcache_writer_free(struct tokcache_writer *w) {
+	if(!w) return;
+	free(w->records);
+	free(w->strings);
+	free(w->atoms);
+	free(w);
+}
+
+static int grow(void *p, size_t *cap, size_t need, size_t elem) {
+	void **ptr = p;
+	size_t n = *cap ? *cap : 256;
+	if(need <= *cap) return 1;
+	while(n < need) n *= 2;
+	void *q = realloc(*ptr, n * elem);
+	if(!q) return 0;
+	*ptr = q;
+	*cap = n;
+	return 1;
+}
+
+static int atoms_rehash(struct tokcache_writer *w) {
+	size_t i, j, cap = w->atoms_cap ? w->atoms_cap * 2 : 1024;
+	uint32_t *n = calloc(cap, sizeof *n);
+	if(!n) return 0;
+	for(i = 0; i < w->atoms_cap; i++) if(w->atoms[i]) {
+		const char *s = w->strings + w->atoms[i] - 1;
+		for(j = fnv1a(0, s, strlen(s)) & (cap - 1); n[j]; j = (j + 1) & (cap - 1));
+		n[j] = w->atoms[i];
+	}
+	free(w->atoms);
+	w->atoms = n;
+	w->atoms_cap = cap;
+	return 1;
+}
+
+/* offset of str in the string table, which stores each text once */
+static uint32_t atom(struct tokcache_writer *w, const char *str) {
+	size_t len = strlen(str), i;
+	if(w->natoms * 2 >= w->atoms_cap && !atoms_rehash(w)) goto fail;
+	for(i = fnv1a(0, str, len) & (w->atoms_cap - 1); w->atoms[i]; i = (i + 1) & (w->atoms_cap - 1))
+		if(!strcmp(w->strings + w->atoms[i] - 1, str)) return w->atoms[i] - 1;
+	if(!grow(&w->strings, &w->strings_cap, w->strings_size + len + 1, 1)) goto fail;
+	uint32_t off = w->strings_size;
+	memcpy(w->strings + off, str, len + 1);
+	w->strings_size += len + 1;
+	w->atoms[i] = off + 1;
+	w->natoms++;
+	return off;
+fail:
+	w->failed = 1;
+	return 0;
+}
+
+void tokcache_record(void *ctx, const struct token_record *r, const char *str) {
+	struct tokcache_writer *w = ctx;
+	if(w->failed) return;
+	if(!grow(&w->records, &w->cap, w->count + 1, sizeof *r)) {
+		w->failed = 1;
+		return;
+	}
+	w->records[w->count] = *r;
+	w->records[w->count].str = atom(w, str);
+	w->count++;
+}
+
+static int record_cmp(const void *a, const void *b) {
+	const struct token_record *x = a, *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+	const char *p = data;
+	while(len) {
+		ssize_t n = write(fd, p, len);
+		if(n <= 0) return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* write to a temporary and rename, so concurrent builds sharing dir
+   never see a partial file */
+static void store(struct tokcache_writer *w, char *image, size_t isize, const char *dir, const char *data, size_t size) {
+	char fn[4096], tmp[4096 + 32];
+	int fd, ok;
+	((struct tokcache_header*) image)->image_hash = fnv1a(0, image + sizeof(struct tokcache_header), isize - sizeof(struct tokcache_header));
+	cache_name(fn, sizeof fn, dir, data, size);
+	snprintf(tmp, sizeof tmp, "%s.%ld.%p.tmp", fn, (long) getpid(), (void*) w);
+	if((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) return;
+	ok = write_all(fd, image, isize);
+	if(close(fd)) ok = 0;
+	if(!ok || rename(tmp, fn)) unlink(tmp);
+}
+
+struct tokcache *tokcache_writer_finish(struct tokcache_writer *w, const char *dir, const char *data, size_t size) {
+	struct tokcache *tc = 0;
+	char *image = 0;
+	if(!w->strings_size) atom(w, "");
+	struct tokcache_header h = {
+		.magic = TOKCACHE_MAGIC,
+		.version = TOKCACHE_VERSION,
+		.byte_order = TOKCACHE_BYTE_ORDER,
+		.content_hash = dir ? fnv1a(0, data, size) : 0,
+		.content_size = size,
+		.count = w->count,
+		.strings_size = w->strings_size,
+	};
+	size_t rsize = w->count * sizeof(struct token_record);
+	size_t isize = sizeof h + rsize + w->strings_size;
+	if(w->failed || w->count > UINT32_MAX || !(image = malloc(isize))) goto out;
+	/* lexing only moves forward, this just keeps replay() honest */
+	qsort(w->records, w->count, sizeof *w->records, record_cmp);
+	memcpy(image, &h, sizeof h);
+	memcpy(image + sizeof h, w->records, rsize);
+	memcpy(image + sizeof h + rsize, w->strings, w->strings_size);
+	if(dir) store(w, image, isize, dir, data, size);
+	/* the records are usable even if they couldn't be stored */
+	if(!(tc = tokcache_from_image(image, isize, 0))) free(image);
+out:
+	tokcache_writer_free(w);
+	return tc;
+}
@@ -0,0 +1,39 @@
+#ifndef TOKCACHE_H
+#define TOKCACHE_H
+
+#include <stddef.h>
+#include "tokenizer.h"
+
+/* directory of token records of previously lexed headers, keyed by a
+   hash of their contents, so unchanged headers needn't be lexed again.
+   see tokenizer_set_replay(). */
+
+struct tokcache {
+	const struct token_record *records;
+	size_t count;
+	const char *strings;
+	void *image;
+	size_t image_size;
+	int mapped;
+};
+
+/* the records for data, or 0 if dir has none */
+struct tokcache *tokcache_open(const char *dir, const char *data, size_t size);
+void tokcache_free(struct tokcache *tc);
+
+/* collects records through tokenizer_set_recorder(tokcache_record) */
+struct tokcache_writer;
+struct tokcache_writer *tokcache_writer_new(void);
+void tokcache_record(void *w, const struct token_record *r, const char *str);
+/* store what was recorded for data in dir, replacing the file
+   atomically, or only keep it in memory if dir is 0. returns the
+   records, or 0 on error; w is freed. */
+struct tokcache *tokcache_writer_finish(struct tokcache_writer *w, const char *dir, const char *data, size_t size);
+void tokcache_writer_free(struct tokcache_writer *w);
+
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"
+#endif
+#pragma RcB2 DEP "tokcache.c"
+
+#endif
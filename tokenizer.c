@@ -1,6 +1,5 @@
 #include <stdint.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include <assert.h>
 
@@ -12,8 +11,25 @@ void tokenizer_set_filename(struct tokenizer *t, const char* fn) {
 
 #define ARRAY_SIZE(X) (sizeof(X)/sizeof(X[0]))
 
+/* classification doesn't depend on the locale, which another thread
+   may be changing */
+static int ascii_isdigit(int c) { return c >= '0' && c <= '9'; }
+static int ascii_isspace(int c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static int ascii_tolower(int c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
 off_t tokenizer_ftello(struct tokenizer *t) {
-	return ftello(t->input)-t->getc_buf.buffered;
+	off_t pos = t->input ? ftello(t->input) : (off_t) t->mem_pos;
+	return pos-t->getc_buf.buffered;
+}
+
+void tokenizer_seek(struct tokenizer *t, size_t pos, uint32_t line, uint32_t column) {
+	assert(!t->input && !t->peeking && pos <= t->mem_size);
+	t->mem_pos = pos;
+	t->getc_buf.buffered = 0;
+	t->line = line;
+	t->column = column;
+	/* pos may lie behind the records already passed */
+	t->replay_pos = 0;
 }
 
 static int tokenizer_ungetc(struct tokenizer *t, int c)
@@ -32,7 +48,8 @@ static int tokenizer_getc(struct tokenizer *t)
 		t->getc_buf.buffered--;
 		c = t->getc_buf.buf[(t->getc_buf.cnt) % ARRAY_SIZE(t->getc_buf.buf)];
 	} else {
-		c = getc(t->input);
+		if(t->input) c = getc(t->input);
+		else c = t->mem_pos < t->mem_size ? (unsigned char) t->mem[t->mem_pos++] : EOF;
 		t->getc_buf.buf[t->getc_buf.cnt % ARRAY_SIZE(t->getc_buf.buf)] = c;
 	}
 	++t->getc_buf.cnt;
@@ -85,7 +102,7 @@ static int has_ul_tail(const char *p) {
 	int tc = 0, c;
 	while(tc < 4 ) {
 		if(!*p) break;
-		c = tolower(*p);
+		c = ascii_tolower(*p);
 		if(c == 'u' || c == 'l') {
 			tail[tc++] = c;
 		} else {
@@ -111,7 +128,7 @@ static int is_hex_int_literal(const char *s) {
 	if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
 		const char* p = s+2;
 		while(*p) {
-			if(!strchr("0123456789abcdef", tolower(*p))) {
+			if(!strchr("0123456789abcdef", ascii_tolower(*p))) {
 				if(p == s+2) return 0;
 				return has_ul_tail(p);
 			}
@@ -131,10 +148,10 @@ static int is_dec_int_literal(const char *str) {
 	if(is_plus_or_minus(s[0])) s++;
 	if(s[0] == '0') {
 		if(s[1] == 0) return 1;
-		if(isdigit(s[1])) return 0;
+		if(ascii_isdigit(s[1])) return 0;
 	}
 	while(*s) {
-		if(!isdigit(*s)) {
+		if(!ascii_isdigit(*s)) {
 			if(s > str && (is_plus_or_minus(str[0]) ? s > str+1 : 1)) return has_ul_tail(s);
 			else return 0;
 		}
@@ -148,20 +165,20 @@ static int is_float_literal(const char *str) {
 	if(is_plus_or_minus(s[0])) s++;
 	int got_dot = 0, got_e = 0, got_digits = 0;
 	while(*s) {
-		int l = tolower(*s);
+		int l = ascii_tolower(*s);
 		if(*s == '.') {
 			if(got_dot) return 0;
 			got_dot = 1;
 		} else if(l == 'f') {
 			if(s[1] == 0 && (got_dot || got_e) && got_digits) return 1;
 			return 0;
-		} else if (isdigit(*s)) {
+		} else if (ascii_isdigit(*s)) {
 			got_digits = 1;
 		} else if(l == 'e') {
 			if(!got_digits) return 0;
 			s++;
 			if(is_plus_or_minus(*s)) s++;
-			if(!isdigit(*s)) return 0;
+			if(!ascii_isdigit(*s)) return 0;
 			got_e = 1;
 		} else return 0;
 		s++;
@@ -173,7 +190,7 @@ static int is_float_literal(const char *str) {
 static int is_valid_float_until(const char*s, const char* until) {
 	int got_digits = 0, got_dot = 0;
 	while(s < until) {
-		if(isdigit(*s)) got_digits = 1;
+		if(ascii_isdigit(*s)) got_digits = 1;
 		else if(*s == '.') {
 			if(got_dot) return 0;
 			got_dot = 1;
@@ -407,15 +424,9 @@ void tokenizer_skip_until(struct tokenizer *t, const char *marker)
 	ignore_until(t, marker, 0);
 }
 
-int tokenizer_next(struct tokenizer *t, struct token* out) {
+static int lex(struct tokenizer *t, struct token* out) {
 	char *s = t->buf;
-	out->value = 0;
 	int c = 0;
-	if(t->peeking) {
-		*out = t->peek_token;
-		t->peeking = 0;
-		return 1;
-	}
 	while(1) {
 		c = tokenizer_getc(t);
 		if(c == EOF) break;
@@ -430,7 +441,7 @@ int tokenizer_next(struct tokenizer *t, struct token* out) {
 			continue;
 		}
 		if(is_sep(c)) {
-			if(s != t->buf && c == '\\' && !isspace(s[-1])) {
+			if(s != t->buf && c == '\\' && !ascii_isspace(s[-1])) {
 				c = tokenizer_getc(t);
 				if(c == '\n') continue;
 				tokenizer_ungetc(t, c);
@@ -443,7 +454,7 @@ int tokenizer_next(struct tokenizer *t, struct token* out) {
 			} else if(c == '.' && s == t->buf) {
 				int jump = 0;
 				c = tokenizer_getc(t);
-				if(isdigit(c)) jump = 1;
+				if(ascii_isdigit(c)) jump = 1;
 				tokenizer_ungetc(t, c);
 				c = '.';
 				if(jump) goto process_char;
@@ -521,6 +532,145 @@ string_handling:
 	return apply_coords(t, out, s, out->type != TT_UNKNOWN);
 }
 
+/* move replay_pos to the first record at pos or after it */
+static void replay_skip(struct tokenizer *t, size_t pos) {
+	const struct token_record *r = t->replay;
+	/* usually the next record, otherwise skip ahead */
+	if(t->replay_pos < t->replay_count && r[t->replay_pos].start < pos) {
+		size_t lo = t->replay_pos, hi = t->replay_count;
+		while(lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if(r[mid].start < pos) lo = mid + 1;
+			else hi = mid;
+		}
+		t->replay_pos = lo;
+	}
+}
+
+static int replay(struct tokenizer *t, struct token* out) {
+	size_t pos = t->mem_pos - t->getc_buf.buffered, i;
+	const struct token_record *r;
+	replay_skip(t, pos);
+	if(t->replay_pos == t->replay_count && t->refill) {
+		t->refill(t->refill_ctx, t, pos);
+		replay_skip(t, pos);
+	}
+	r = t->replay;
+	for(i = t->replay_pos; i < t->replay_count && r[i].start == pos; i++) {
+		if(r[i].flags != t->flags || r[i].line != t->line || r[i].column != t->column)
+			continue;
+		r += i;
+		strcpy(t->buf, t->replay_strings + r->str);
+		out->type = r->type;
+		out->value = r->value;
+		out->line = r->tok_line;
+		out->column = r->tok_column;
+		t->mem_pos = r->end;
+		t->getc_buf.buffered = 0;
+		t->line = r->end_line;
+		t->column = r->end_column;
+		t->replay_pos = i + 1;
+		t->replayed++;
+		return r->ret;
+	}
+	return -1;
+}
+
+int tokenizer_next(struct tokenizer *t, struct token* out) {
+	int ret;
+	out->value = 0;
+	if(t->peeking) {
+		*out = t->peek_token;
+		t->peeking = 0;
+		return 1;
+	}
+	if((t->replay || t->refill) && (ret = replay(t, out)) != -1) return ret;
+	if(!t->recorder || t->input) return lex(t, out);
+	struct token_record r = {
+		.start = t->mem_pos - t->getc_buf.buffered,
+		.line = t->line,
+		.column = t->column,
+		.flags = t->flags,
+	};
+	ret = lex(t, out);
+	r.end = t->mem_pos - t->getc_buf.buffered;
+	r.end_line = t->line;
+	r.end_column = t->column;
+	r.tok_line = out->line;
+	r.tok_column = out->column;
+	r.value = out->value;
+	r.type = out->type;
+	r.ret = ret;
+	t->recorder(t->recorder_ctx, &r, t->buf);
+	return ret;
+}
+
+/* the first of p..end that is one of the n bytes in set, or end.
+   looks at a word at a time until one of them contains a match. */
+static const char *find_any(const char *p, const char *end, const unsigned char *set, int n) {
+	const uint64_t ones = ~(uint64_t) 0 / 255, highs = ones << 7;
+	uint64_t w, x, hit;
+	int i;
+	while(end - p >= 8) {
+		memcpy(&w, p, 8);
+		for(hit = 0, i = 0; i < n; i++) {
+			x = w ^ (ones * set[i]);
+			hit |= (x - ones) & ~x & highs;
+		}
+		if(hit) break;
+		p += 8;
+	}
+	for(; p < end; p++)
+		for(i = 0; i < n; i++)
+			if((unsigned char) *p == set[i]) return p;
+	return end;
+}
+
+void tokenizer_skip_plain_lines(struct tokenizer *t) {
+	unsigned char set[6] = {'\n', '\\', '"', '\''};
+	const char *line, *p, *nl, *end = t->mem + t->mem_size;
+	size_t pos = t->mem_pos - t->getc_buf.buffered;
+	uint32_t lines = 0;
+	int n = 4;
+	if(t->input || t->peeking || t->column || t->custom_count) return;
+	if(t->marker[MT_MULTILINE_COMMENT_START]) set[n++] = t->marker[MT_MULTILINE_COMMENT_START][0];
+	if(t->marker[MT_SINGLELINE_COMMENT_START]) set[n++] = t->marker[MT_SINGLELINE_COMMENT_START][0];
+	while(1) {
+		line = p = t->mem + pos;
+		while(p < end && (*p == ' ' || *p == '\t')) p++;
+		if(p == end || *p == '#') break;
+		/* lines with comments, strings or continuations are left to
+		   lex(), as are those that could overflow a token */
+		nl = find_any(p, end, set, n);
+		if(nl == end || *nl != '\n' || nl - line >= MAX_TOK_LEN - 2) break;
+		pos = nl + 1 - t->mem;
+		lines++;
+	}
+	if(!lines) return;
+	t->mem_pos = pos;
+	t->getc_buf.buffered = 0;
+	t->line += lines;
+}
+
+void tokenizer_set_replay(struct tokenizer *t, const struct token_record *r, size_t count, const char *strings) {
+	assert(!t->input && !t->custom_count);
+	t->replay = r;
+	t->replay_count = count;
+	t->replay_pos = 0;
+	t->replay_strings = strings;
+}
+
+void tokenizer_set_refill(struct tokenizer *t, tokenizer_refill fn, void *ctx) {
+	assert(!t->input && !t->custom_count);
+	t->refill = fn;
+	t->refill_ctx = ctx;
+}
+
+void tokenizer_set_recorder(struct tokenizer *t, tokenizer_recorder fn, void *ctx) {
+	t->recorder = fn;
+	t->recorder_ctx = ctx;
+}
+
 void tokenizer_set_flags(struct tokenizer *t, int flags) {
 	t->flags = flags;
 }
@@ -533,6 +683,10 @@ void tokenizer_init(struct tokenizer *t, FILE* in, int flags) {
 	*t = (struct tokenizer){ .input = in, .line = 1, .flags = flags, .bufsize = MAX_TOK_LEN};
 }
 
+void tokenizer_init_mem(struct tokenizer *t, const char *mem, size_t size, int flags) {
+	*t = (struct tokenizer){ .mem = mem, .mem_size = size, .line = 1, .flags = flags, .bufsize = MAX_TOK_LEN};
+}
+
 void tokenizer_register_marker(struct tokenizer *t, enum markertype mt, const char* marker)
 {
 	t->marker[mt] = marker;
@@ -542,6 +696,11 @@ int tokenizer_rewind(struct tokenizer *t) {
 	FILE *f = t->input;
 	int flags = t->flags;
 	const char* fn = t->filename;
+	if(!f) {
+		tokenizer_init_mem(t, t->mem, t->mem_size, flags);
+		tokenizer_set_filename(t, fn);
+		return 1;
+	}
 	tokenizer_init(t, f, flags);
 	tokenizer_set_filename(t, fn);
 	return fseek(f, 0, SEEK_SET) == 0;
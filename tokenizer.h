@@ -50,6 +50,28 @@ struct token {
 	int value;
 };
 
+/* the result of one tokenizer_next() call on memory input, along with
+   the state before and after it. lexing only depends on those, so a
+   record can stand in for the call whenever the state matches. */
+struct token_record {
+	uint32_t start, end; /* offsets before and after lexing */
+	uint32_t line, column; /* tokenizer position before lexing */
+	uint32_t end_line, end_column;
+	uint32_t tok_line, tok_column;
+	int32_t value;
+	uint32_t str; /* offset of the token text in the string table */
+	uint16_t type;
+	uint8_t flags;
+	uint8_t ret;
+};
+
+typedef void (*tokenizer_recorder)(void *ctx, const struct token_record *r, const char *str);
+
+struct tokenizer;
+/* called when the replay records are used up at offset pos, to pass
+   those that follow to tokenizer_set_replay(). */
+typedef void (*tokenizer_refill)(void *ctx, struct tokenizer *t, size_t pos);
+
 enum tokenizer_flags {
 	TF_PARSE_STRINGS = 1 << 0,
 	TF_PARSE_WIDE_STRINGS = 1 << 1,
@@ -57,6 +79,8 @@ enum tokenizer_flags {
 
 struct tokenizer {
 	FILE *input;
+	const char *mem;
+	size_t mem_size, mem_pos;
 	uint32_t line;
 	uint32_t column;
 	int flags;
@@ -69,13 +93,38 @@ struct tokenizer {
 	const char* marker[MT_MAX+1];
 	const char* filename;
 	struct token peek_token;
+	const struct token_record *replay; /* sorted by start */
+	size_t replay_count, replay_pos;
+	const char *replay_strings;
+	unsigned long replayed;
+	tokenizer_refill refill;
+	void *refill_ctx;
+	tokenizer_recorder recorder;
+	void *recorder_ctx;
 };
 
 void tokenizer_init(struct tokenizer *t, FILE* in, int flags);
+/* tokenize size bytes at mem instead of a FILE. mem must stay valid
+   for the lifetime of the tokenizer. */
+void tokenizer_init_mem(struct tokenizer *t, const char *mem, size_t size, int flags);
 void tokenizer_set_filename(struct tokenizer *t, const char*);
+/* serve tokenizer_next() from records where they match, lex otherwise.
+   only for memory input, without custom tokens. */
+void tokenizer_set_replay(struct tokenizer *t, const struct token_record *r, size_t count, const char *strings);
+/* for records that arrive in pieces. fn may set new ones, or none. */
+void tokenizer_set_refill(struct tokenizer *t, tokenizer_refill fn, void *ctx);
+/* pass a record of every token lexed from memory input to fn. */
+void tokenizer_set_recorder(struct tokenizer *t, tokenizer_recorder fn, void *ctx);
 void tokenizer_set_flags(struct tokenizer *t, int flags);
 int tokenizer_get_flags(struct tokenizer *t);
 off_t tokenizer_ftello(struct tokenizer *t);
+/* continue memory input at offset pos, which is at line and column.
+   pos may be before the current position. */
+void tokenizer_seek(struct tokenizer *t, size_t pos, uint32_t line, uint32_t column);
+/* at the start of a line of memory input, pass over the following
+   lines that neither start with # nor contain anything that could
+   make a token span lines. for skipping inactive blocks quickly. */
+void tokenizer_skip_plain_lines(struct tokenizer *t);
 void tokenizer_register_marker(struct tokenizer*, enum markertype, const char*);
 void tokenizer_register_custom_token(struct tokenizer*, int tokentype, const char*);
 int tokenizer_next(struct tokenizer *t, struct token* out);
@@ -0,0 +1,587 @@
+#include <string.h>
+#include <stdlib.h>
+#include "tokstream.h"
+#include "tokenizer.h"
+
+/* layout: the magic, a version byte, then records, each starting with
+   an op byte. numbers are unsigned LEB128 varints, strings a varint
+   length followed by the bytes and a 0, so the reader can point into
+   the stream.
+
+   OP_END             end of stream
+   OP_FILE string     a new file, numbered in order of appearance, is
+                      entered. inclusions are numbered in order of
+                      appearance as well.
+   OP_ENTER n         file n is entered again
+   OP_SWITCH n        back to inclusion n
+   OP_LINE delta      line += delta, zigzag encoded
+   OP_MACRO           the following tokens come from macro expansions
+   OP_SOURCE          ... and these don't
+   OP_RUN c n         n TT_SEP tokens with character c
+   OP_SEP c           a TT_SEP token with a character not in seps[]
+   OP_SPACES + n-1    n ' ' TT_SEP tokens, up to 32
+   OP_TABS + n-1      n '\t' TT_SEP tokens, up to 16
+   OP_TOKEN | type    any other token, followed by a varint v. odd v:
+                      the spelling follows, of length v >> 1. those of
+                      up to MAX_INTERNED bytes are numbered in order of
+                      appearance. even v: spelling number v >> 1.
+   OP_RECENT | i      the spelling at position i of the list of the
+                      RECENT ones used last, with the type it had when
+                      first seen
+   OP_SEPS | i        the TT_SEP token seps[i]
+
+   OP_TOKEN, OP_RECENT and OP_SEPS records can have OP_SPACE set, a ' '
+   TT_SEP token follows then. every spelling used moves to the front of
+   the recent list. tokens have the file, line and macro state of the
+   previous one, except that the line goes up by one after a '\n'. */
+
+#define TOKSTREAM_MAGIC "tcpptks"
+#define TOKSTREAM_VERSION 2
+
+enum {
+	OP_END = 0,
+	OP_FILE,
+	OP_ENTER,
+	OP_SWITCH,
+	OP_LINE,
+	OP_MACRO,
+	OP_SOURCE,
+	OP_RUN,
+	OP_SEP,
+	OP_SPACES = 0x10,
+	OP_TABS = 0x30,
+	OP_TOKEN = 0x40,
+	OP_RECENT = 0x80,
+	OP_SEPS = 0xc0,
+	OP_SPACE = 0x20,
+	OP_TYPE = 0x1f,
+	OP_INDEX = 0x1f,
+};
+
+#define MAX_SPACES 32
+#define MAX_TABS 16
+#define RECENT TOKSTREAM_RECENT
+
+static const char seps[] = "\n!\"#%&'()*+,-./:;<=>?@[\\]^`{|}~";
+
+static int sep_index(int c) {
+	const char *p;
+	return c && (p = strchr(seps, c)) ? p - seps : -1;
+}
+
+/* move spelling n to the front of the recent list. at is its position,
+   RECENT if it isn't in the list. */
+static void recent_use(uint32_t *recent, unsigned *count, unsigned at, uint32_t n) {
+	if(at == RECENT) at = *count < RECENT ? (*count)++ : RECENT - 1;
+	memmove(recent + 1, recent, at * sizeof *recent);
+	recent[0] = n;
+}
+
+#define MIN_RUN 3
+#define MAX_INTERNED 64
+
+/* strings numbered in order of appearance */
+struct strtab {
+	char *strings;
+	size_t strings_size, strings_cap;
+	uint32_t *offs; /* number -> offset in strings */
+	size_t count, offs_cap;
+	uint32_t *hash; /* open addressing, number + 1 */
+	size_t hash_cap;
+};
+
+/* an inclusion as numbered by cpp_run_tokens() */
+struct inclusion {
+	size_t stream; /* its number in the stream + 1, 0 if not seen yet */
+	size_t file;
+};
+
+struct tokstream_writer {
+	struct cpp_sink *out;
+	struct strtab strings, files;
+	unsigned char *types; /* of each spelling when it was added */
+	size_t types_cap;
+	struct inclusion *incl;
+	size_t incl_cap, ninclusions;
+	unsigned inclusion; /* the current one, as numbered by cpp */
+	size_t file; /* number of the current file, -1 before the first */
+	unsigned line; /* of the next token, unless changed */
+	int macro;
+	uint32_t recent[RECENT];
+	unsigned nrecent;
+	/* written once it's clear whether a space follows */
+	struct cpp_token held;
+	int have_held;
+	struct cpp_token run;
+	size_t run_len;
+	int failed;
+};
+
+static uint32_t fnv1a(const char *p, size_t len) {
+	uint32_t h = 0x811c9dc5;
+	while(len--) {
+		h ^= (unsigned char) *p++;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+static int grow(void *p, size_t *cap, size_t need, size_t elem) {
+	void **ptr = p;
+	size_t n = *cap ? *cap : 256;
+	if(need <= *cap) return 1;
+	while(n < need) n *= 2;
+	void *q = realloc(*ptr, n * elem);
+	if(!q) return 0;
+	*ptr = q;
+	*cap = n;
+	return 1;
+}
+
+static int strtab_rehash(struct strtab *st) {
+	size_t i, j, cap = st->hash_cap ? st->hash_cap * 2 : 1024;
+	uint32_t *n = calloc(cap, sizeof *n);
+	if(!n) return 0;
+	for(i = 0; i < st->count; i++) {
+		const char *s = st->strings + st->offs[i];
+		for(j = fnv1a(s, strlen(s)) & (cap - 1); n[j]; j = (j + 1) & (cap - 1));
+		n[j] = i + 1;
+	}
+	free(st->hash);
+	st->hash = n;
+	st->hash_cap = cap;
+	return 1;
+}
+
+/* number of s, which is added unless it's there yet. -1 on error */
+static size_t strtab_add(struct strtab *st, const char *s, size_t len, int *added) {
+	size_t i;
+	uint32_t off;
+	if(st->count * 2 >= st->hash_cap && !strtab_rehash(st)) return -1;
+	for(i = fnv1a(s, len) & (st->hash_cap - 1); st->hash[i]; i = (i + 1) & (st->hash_cap - 1)) {
+		off = st->offs[st->hash[i] - 1];
+		if(!strncmp(st->strings + off, s, len) && !st->strings[off + len]) {
+			*added = 0;
+			return st->hash[i] - 1;
+		}
+	}
+	*added = 1;
+	if(!grow(&st->strings, &st->strings_cap, st->strings_size + len + 1, 1) ||
+	   !grow(&st->offs, &st->offs_cap, st->count + 1, sizeof *st->offs)) return -1;
+	off = st->strings_size;
+	memcpy(st->strings + off, s, len);
+	st->strings[off + len] = 0;
+	st->strings_size += len + 1;
+	st->offs[st->count] = off;
+	st->hash[i] = st->count + 1;
+	return st->count++;
+}
+
+static void strtab_free(struct strtab *st) {
+	free(st->strings);
+	free(st->offs);
+	free(st->hash);
+}
+
+static void put_varint(struct cpp_sink *out, uint64_t v) {
+	unsigned char buf[10];
+	size_t n = 0;
+	do {
+		buf[n] = v & 0x7f;
+		v >>= 7;
+		if(v) buf[n] |= 0x80;
+		n++;
+	} while(v);
+	cpp_sink_write(out, (char*) buf, n);
+}
+
+static void put_string(struct cpp_sink *out, const char *s, size_t len) {
+	cpp_sink_write(out, s, len);
+	cpp_sink_putc(out, 0);
+}
+
+struct tokstream_writer *tokstream_writer_new(struct cpp_sink *out) {
+	struct tokstream_writer *w = calloc(1, sizeof *w);
+	if(!w) return 0;
+	w->out = out;
+	w->file = -1;
+	cpp_sink_write(out, TOKSTREAM_MAGIC, sizeof TOKSTREAM_MAGIC);
+	cpp_sink_putc(out, TOKSTREAM_VERSION);
+	return w;
+}
+
+void tokstream_writer_free(struct tokstream_writer *w) {
+	if(!w) return;
+	strtab_free(&w->strings);
+	strtab_free(&w->files);
+	free(w->types);
+	free(w->incl);
+	free(w);
+}
+
+/* whether a spelling goes into the string table */
+#define interned(len) ((len) <= MAX_INTERNED)
+
+static const char *file_name(struct tokstream_writer *w, size_t n) {
+	return w->files.strings + w->files.offs[n];
+}
+
+/* tok is from another inclusion than the one before */
+static void write_inclusion(struct tokstream_writer *w, const struct cpp_token *tok) {
+	struct inclusion *in;
+	size_t n, len = strlen(tok->file), old = w->incl_cap;
+	int added;
+	if(!grow(&w->incl, &w->incl_cap, (size_t) tok->inclusion + 1, sizeof *w->incl)) {
+		w->failed = 1;
+		return;
+	}
+	memset(w->incl + old, 0, (w->incl_cap - old) * sizeof *w->incl);
+	in = &w->incl[tok->inclusion];
+	w->inclusion = tok->inclusion;
+	if(in->stream && !strcmp(tok->file, file_name(w, in->file))) {
+		cpp_sink_putc(w->out, OP_SWITCH);
+		put_varint(w->out, in->stream - 1);
+		w->file = in->file;
+		return;
+	}
+	if((n = strtab_add(&w->files, tok->file, len, &added)) == (size_t) -1) {
+		w->failed = 1;
+		return;
+	}
+	if(added) {
+		cpp_sink_putc(w->out, OP_FILE);
+		put_varint(w->out, len);
+		put_string(w->out, tok->file, len);
+	} else {
+		cpp_sink_putc(w->out, OP_ENTER);
+		put_varint(w->out, n);
+	}
+	in->stream = ++w->ninclusions;
+	in->file = w->file = n;
+}
+
+/* emit changes of inclusion, line and macro state before tok */
+static void write_position(struct tokstream_writer *w, const struct cpp_token *tok) {
+	if(w->file == (size_t) -1 || tok->inclusion != w->inclusion ||
+	   strcmp(tok->file, file_name(w, w->file))) {
+		write_inclusion(w, tok);
+		if(w->failed) return;
+	}
+	if(tok->line != w->line) {
+		int64_t d = (int64_t) tok->line - w->line;
+		cpp_sink_putc(w->out, OP_LINE);
+		put_varint(w->out, d < 0 ? ((uint64_t) -d << 1) - 1 : (uint64_t) d << 1);
+		w->line = tok->line;
+	}
+	if(!tok->from_macro != !w->macro) {
+		w->macro = !!tok->from_macro;
+		cpp_sink_putc(w->out, w->macro ? OP_MACRO : OP_SOURCE);
+	}
+}
+
+/* space: a ' ' follows, only for the characters in seps[] */
+static void write_sep(struct tokstream_writer *w, const struct cpp_token *tok, int space) {
+	unsigned char c = tok->value;
+	int i = sep_index(c);
+	write_position(w, tok);
+	if(i >= 0) cpp_sink_putc(w->out, OP_SEPS | (space ? OP_SPACE : 0) | i);
+	else {
+		cpp_sink_putc(w->out, OP_SEP);
+		cpp_sink_putc(w->out, c);
+	}
+	if(c == '\n') w->line++;
+}
+
+static void write_token(struct tokstream_writer *w, const struct cpp_token *tok, int space) {
+	int added, sp = space ? OP_SPACE : 0;
+	unsigned i;
+	size_t n;
+	write_position(w, tok);
+	if(interned(tok->len)) {
+		n = strtab_add(&w->strings, tok->text, tok->len, &added);
+		if(n == (size_t) -1 || (added && !grow(&w->types, &w->types_cap, n + 1, 1))) {
+			w->failed = 1;
+			return;
+		}
+		if(!added) {
+			for(i = 0; i < w->nrecent && w->recent[i] != n; i++);
+			if(i < w->nrecent && w->types[n] == tok->type)
+				cpp_sink_putc(w->out, OP_RECENT | sp | i);
+			else {
+				cpp_sink_putc(w->out, OP_TOKEN | sp | tok->type);
+				put_varint(w->out, (uint64_t) n << 1);
+			}
+			recent_use(w->recent, &w->nrecent, i < w->nrecent ? i : RECENT, n);
+			return;
+		}
+		w->types[n] = tok->type;
+		recent_use(w->recent, &w->nrecent, RECENT, n);
+	}
+	cpp_sink_putc(w->out, OP_TOKEN | sp | tok->type);
+	put_varint(w->out, (uint64_t) tok->len << 1 | 1);
+	put_string(w->out, tok->text, tok->len);
+}
+
+static void flush_held(struct tokstream_writer *w) {
+	int c = w->run.value, max = c == ' ' ? MAX_SPACES : MAX_TABS;
+	size_t n;
+	if(w->have_held) write_token(w, &w->held, 0);
+	w->have_held = 0;
+	if(!w->run_len) return;
+	if(c == ' ' || c == '\t') {
+		write_position(w, &w->run);
+		for(; w->run_len; w->run_len -= n) {
+			n = w->run_len < (size_t) max ? w->run_len : (size_t) max;
+			cpp_sink_putc(w->out, (c == ' ' ? OP_SPACES : OP_TABS) + n - 1);
+		}
+	} else if(w->run_len >= MIN_RUN) {
+		write_position(w, &w->run);
+		cpp_sink_putc(w->out, OP_RUN);
+		cpp_sink_putc(w->out, c);
+		put_varint(w->out, w->run_len);
+		if(c == '\n') w->line += w->run_len;
+	} else for(; w->run_len; w->run_len--) {
+		write_sep(w, &w->run, 0);
+		if(c == '\n') w->run.line++;
+	}
+	w->run_len = 0;
+}
+
+static int same_position(const struct cpp_token *a, const struct cpp_token *b) {
+	return a->line == b->line && !a->from_macro == !b->from_macro &&
+		a->inclusion == b->inclusion && !strcmp(a->file, b->file);
+}
+
+int tokstream_write(void *ctx, const struct cpp_token *toks, size_t count) {
+	struct tokstream_writer *w = ctx;
+	size_t i;
+	for(i = 0; i < count && !w->failed; i++) {
+		const struct cpp_token *tok = &toks[i];
+		/* where the run would continue */
+		struct cpp_token next = w->run;
+		if(tok->type <= 0 || tok->type > OP_TYPE) {
+			w->failed = 1;
+			break;
+		}
+		if(next.value == '\n') next.line += w->run_len;
+		if(tok->type == TT_SEP && tok->value == ' ') {
+			if(w->have_held && same_position(tok, &w->held)) {
+				write_token(w, &w->held, 1);
+				w->have_held = 0;
+				continue;
+			}
+			/* a single separator that can take the space */
+			if(w->run_len == 1 && sep_index(w->run.value) >= 0 && same_position(tok, &next)) {
+				write_sep(w, &w->run, 1);
+				w->run_len = 0;
+				continue;
+			}
+		}
+		if(tok->type == TT_SEP && w->run_len && tok->value == w->run.value &&
+		   same_position(tok, &next)) {
+			w->run_len++;
+			continue;
+		}
+		flush_held(w);
+		if(tok->type == TT_SEP) {
+			w->run = *tok;
+			w->run_len = 1;
+		} else {
+			w->held = *tok;
+			w->have_held = 1;
+		}
+	}
+	/* the texts don't survive the batch */
+	flush_held(w);
+	return !w->failed && !w->out->error;
+}
+
+int tokstream_writer_finish(struct tokstream_writer *w) {
+	flush_held(w);
+	cpp_sink_putc(w->out, OP_END);
+	int ret = !w->failed && !w->out->error;
+	tokstream_writer_free(w);
+	return ret;
+}
+
+static int get_varint(struct tokstream_reader *r, uint64_t *v) {
+	unsigned shift = 0;
+	*v = 0;
+	while(r->p < r->end && shift < 64) {
+		unsigned char c = *r->p++;
+		*v |= (uint64_t) (c & 0x7f) << shift;
+		if(!(c & 0x80)) return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+/* a string of len bytes and its 0 */
+static const char *get_string(struct tokstream_reader *r, uint64_t len) {
+	const char *s = (const char*) r->p;
+	if(len >= (uint64_t) (r->end - r->p) || r->p[len]) return 0;
+	r->p += len + 1;
+	return s;
+}
+
+int tokstream_reader_init(struct tokstream_reader *r, const void *data, size_t size) {
+	*r = (struct tokstream_reader) {.p = data, .end = (const unsigned char*) data + size};
+	if(size < sizeof TOKSTREAM_MAGIC + 1 ||
+	   memcmp(data, TOKSTREAM_MAGIC, sizeof TOKSTREAM_MAGIC) ||
+	   r->p[sizeof TOKSTREAM_MAGIC] != TOKSTREAM_VERSION) {
+		r->error = 1;
+		return 0;
+	}
+	r->p += sizeof TOKSTREAM_MAGIC + 1;
+	return 1;
+}
+
+void tokstream_reader_fini(struct tokstream_reader *r) {
+	free(r->strings);
+	free(r->files);
+	free(r->types);
+	free(r->inclusions);
+}
+
+static void read_sep(struct tokstream_reader *r, struct cpp_token *tok, int c) {
+	r->sep[0] = c;
+	*tok = (struct cpp_token) {
+		.type = TT_SEP, .value = c, .text = r->sep, .len = 1,
+		.file = r->file, .line = r->line, .inclusion = r->inclusion,
+		.from_macro = r->macro,
+	};
+	if(c == '\n') r->line++;
+}
+
+static void read_string(struct tokstream_reader *r, struct cpp_token *tok, int type, const char *s, size_t len) {
+	*tok = (struct cpp_token) {
+		.type = type, .text = s, .len = len,
+		.file = r->file, .line = r->line, .inclusion = r->inclusion,
+		.from_macro = r->macro,
+	};
+}
+
+static int read_token(struct tokstream_reader *r, struct cpp_token *tok, unsigned op) {
+	uint64_t v;
+	const char *s;
+	unsigned i;
+	int type = op & OP_TYPE;
+	if(type == TT_SEP || !get_varint(r, &v)) return 0;
+	if(!(v & 1)) {
+		if((v >>= 1) >= r->nstrings) return 0;
+		for(i = 0; i < r->nrecent && r->recent[i] != v; i++);
+		recent_use(r->recent, &r->nrecent, i < r->nrecent ? i : RECENT, v);
+		s = r->strings[v];
+		read_string(r, tok, type, s, strlen(s));
+	} else {
+		if(!(s = get_string(r, v >> 1))) return 0;
+		if(interned(v >> 1)) {
+			if(!grow(&r->strings, &r->strings_cap, r->nstrings + 1, sizeof *r->strings) ||
+			   !grow(&r->types, &r->types_cap, r->nstrings + 1, 1)) return 0;
+			r->types[r->nstrings] = type;
+			recent_use(r->recent, &r->nrecent, RECENT, r->nstrings);
+			r->strings[r->nstrings++] = s;
+		}
+		read_string(r, tok, type, s, v >> 1);
+	}
+	r->space = !!(op & OP_SPACE);
+	return 1;
+}
+
+static int read_recent(struct tokstream_reader *r, struct cpp_token *tok, unsigned op) {
+	unsigned i = op & OP_INDEX;
+	uint32_t n;
+	if(i >= r->nrecent) return 0;
+	n = r->recent[i];
+	recent_use(r->recent, &r->nrecent, i, n);
+	read_string(r, tok, r->types[n], r->strings[n], strlen(r->strings[n]));
+	r->space = !!(op & OP_SPACE);
+	return 1;
+}
+
+/* a new inclusion of file n */
+static int enter_file(struct tokstream_reader *r, size_t n) {
+	if(!grow(&r->inclusions, &r->inclusions_cap, r->ninclusions + 1, sizeof *r->inclusions)) return 0;
+	r->inclusions[r->ninclusions++] = n;
+	r->inclusion = r->ninclusions;
+	r->file = r->files[n];
+	return 1;
+}
+
+int tokstream_read(struct tokstream_reader *r, struct cpp_token *tok) {
+	uint64_t v;
+	const char *s;
+	if(r->error) return -1;
+	if(r->space) {
+		r->space = 0;
+		read_sep(r, tok, ' ');
+		return 1;
+	}
+	if(r->run) {
+		r->run--;
+		read_sep(r, tok, r->run_char);
+		return 1;
+	}
+	while(r->p < r->end) {
+		unsigned op = *r->p++;
+		if(op >= OP_SPACES && !r->file) break;
+		if(op >= OP_SEPS) {
+			read_sep(r, tok, seps[op & OP_INDEX]);
+			r->space = !!(op & OP_SPACE);
+			return 1;
+		} else if(op >= OP_RECENT) {
+			if(!read_recent(r, tok, op)) break;
+			return 1;
+		} else if(op >= OP_TOKEN) {
+			if(!read_token(r, tok, op)) break;
+			return 1;
+		} else if(op >= OP_SPACES) {
+			r->run_char = op >= OP_TABS ? '\t' : ' ';
+			r->run = op - (op >= OP_TABS ? OP_TABS : OP_SPACES);
+			read_sep(r, tok, r->run_char);
+			return 1;
+		}
+		switch(op) {
+		case OP_END:
+			return 0;
+		case OP_FILE:
+			if(!get_varint(r, &v) || !(s = get_string(r, v)) ||
+			   !grow(&r->files, &r->files_cap, r->nfiles + 1, sizeof *r->files)) goto err;
+			r->files[r->nfiles] = s;
+			if(!enter_file(r, r->nfiles++)) goto err;
+			break;
+		case OP_ENTER:
+			if(!get_varint(r, &v) || v >= r->nfiles || !enter_file(r, v)) goto err;
+			break;
+		case OP_SWITCH:
+			if(!get_varint(r, &v) || v >= r->ninclusions) goto err;
+			r->inclusion = v + 1;
+			r->file = r->files[r->inclusions[v]];
+			break;
+		case OP_LINE:
+			if(!get_varint(r, &v)) goto err;
+			r->line += v & 1 ? -(int64_t) ((v + 1) >> 1) : (int64_t) (v >> 1);
+			break;
+		case OP_MACRO: case OP_SOURCE:
+			r->macro = op == OP_MACRO;
+			break;
+		case OP_RUN:
+			if(!r->file || r->p >= r->end) goto err;
+			r->run_char = *r->p++;
+			if(!get_varint(r, &v) || !v) goto err;
+			r->run = v - 1;
+			read_sep(r, tok, r->run_char);
+			return 1;
+		case OP_SEP:
+			if(!r->file || r->p >= r->end) goto err;
+			read_sep(r, tok, *r->p++);
+			return 1;
+		default:
+			goto err;
+		}
+	}
+err:
+	/* also a stream without OP_END, i.e. a truncated one */
+	r->error = 1;
+	return -1;
+}
@@ -0,0 +1,64 @@
+#ifndef TOKSTREAM_H
+#define TOKSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "preproc.h"
+
+/* binary form of preprocessed output, for passing it between processes
+   without lexing it again. spellings are stored once and referenced by
+   number afterwards, those used lately in a byte. separators, runs of
+   whitespace and a following space take a byte as well. lines and
+   files are only stored where they don't follow from the previous
+   token. it comes out at about a third to half of the text for real
+   code. small outputs can be larger than the text, as every file name
+   and spelling is stored once in full. see tokstream.c for the layout. */
+
+/* the number of spellings used last that are referenced in a byte */
+#define TOKSTREAM_RECENT 32
+
+/* collects tokens through cpp_run_tokens(tokstream_write, w) and
+   writes the stream to out, which the caller owns. the inclusion
+   numbers of the tokens read back are those of the stream, in order of
+   appearance, rather than the ones cpp_run_tokens() gave. */
+struct tokstream_writer;
+struct tokstream_writer *tokstream_writer_new(struct cpp_sink *out);
+int tokstream_write(void *w, const struct cpp_token *toks, size_t count);
+/* write the end marker. returns 0 if anything failed; w is freed. */
+int tokstream_writer_finish(struct tokstream_writer *w);
+void tokstream_writer_free(struct tokstream_writer *w);
+
+/* reads a stream from memory, e.g. a mapped file. the texts of the
+   tokens point into data, which must outlive the reader. */
+struct tokstream_reader {
+	const unsigned char *p, *end;
+	const char **strings, **files;
+	unsigned char *types;
+	size_t *inclusions; /* the file of each */
+	size_t nstrings, strings_cap, types_cap, nfiles, files_cap;
+	size_t ninclusions, inclusions_cap;
+	uint32_t recent[TOKSTREAM_RECENT];
+	unsigned nrecent;
+	const char *file;
+	unsigned line, inclusion;
+	int macro;
+	int space; /* a ' ' is due */
+	size_t run; /* repeats of run_char left */
+	int run_char;
+	char sep[2];
+	int error;
+};
+
+/* returns 0 if data isn't a token stream */
+int tokstream_reader_init(struct tokstream_reader *r, const void *data, size_t size);
+/* returns 1 and fills tok, 0 at the end, or -1 if the stream is
+   damaged. tok stays valid until the next call. */
+int tokstream_read(struct tokstream_reader *r, struct cpp_token *tok);
+void tokstream_reader_fini(struct tokstream_reader *r);
+
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"
+#endif
+#pragma RcB2 DEP "tokstream.c"
+
+#endif